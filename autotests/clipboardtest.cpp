@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QScopeGuard>
+#include <QTemporaryDir>
+#include <QTest>
+#include <QThread>
+
+#include "Clipboard_p.h"
+
+using namespace KRdp;
+using namespace Qt::StringLiterals;
+
+// More than a few chunks in memory means a transfer no longer streams to disk.
+constexpr qint64 MaximumMemoryGrowth = 32 * 1024 * 1024;
+
+/**
+ * Reset the peak memory use of this process, so it only covers what follows.
+ */
+static void resetPeakMemoryUse()
+{
+    QFile clearRefs(u"/proc/self/clear_refs"_s);
+    if (clearRefs.open(QIODevice::WriteOnly)) {
+        clearRefs.write("5");
+    }
+}
+
+/**
+ * A memory use field of this process from /proc, such as VmRSS or VmHWM, in bytes.
+ */
+static std::optional<qint64> memoryUse(const QByteArray &field)
+{
+    QFile status(u"/proc/self/status"_s);
+    if (!status.open(QIODevice::ReadOnly)) {
+        return std::nullopt;
+    }
+
+    const auto lines = status.readAll().split('\n');
+    for (const auto &line : lines) {
+        if (line.startsWith(field + ':')) {
+            // Values are in kB.
+            return line.mid(field.size() + 1).trimmed().split(' ').value(0).toLongLong() * 1024;
+        }
+    }
+    return std::nullopt;
+}
+
+class ClipboardTest : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Clipboard::Private is only accessible to this class, the fake client answers through it.
+    static UINT clientFileContentsResponse(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_RESPONSE *response)
+    {
+        return Clipboard::Private::clientFileContentsResponse(context, response);
+    }
+
+private Q_SLOTS:
+    void testFileDownload_data();
+    void testFileDownload();
+};
+
+/**
+ * A client answering file contents requests from its own thread, the same way
+ * FreeRDP's channel thread delivers its responses.
+ */
+class FakeClient
+{
+public:
+    FakeClient(CliprdrServerContext *context, quint64 size)
+        : m_context(context)
+        , m_size(size)
+    {
+        // Every chunk is a view into the same pattern, so the client itself
+        // doesn't add to the memory use of the transfer.
+        m_pattern.resize(FileChunkSize + 251);
+        for (qsizetype i = 0; i < m_pattern.size(); ++i) {
+            m_pattern[i] = char(i % 251);
+        }
+
+        m_thread.start();
+        m_receiver.moveToThread(&m_thread);
+    }
+
+    ~FakeClient()
+    {
+        m_thread.quit();
+        m_thread.wait();
+    }
+
+    static UINT request(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_REQUEST *request)
+    {
+        Q_UNUSED(context);
+        return s_instance->onRequest(*request);
+    }
+
+    static inline FakeClient *s_instance = nullptr;
+
+    std::atomic_int outstanding = 0;
+    std::atomic_int maximumOutstanding = 0;
+    std::atomic<uint32_t> maximumRequested = 0;
+    std::atomic_bool wrongPosition = false;
+
+private:
+    UINT onRequest(const CLIPRDR_FILE_CONTENTS_REQUEST request)
+    {
+        // Called with the transfer locked, answer later like a real client.
+        const auto count = ++outstanding;
+        maximumOutstanding = std::max(maximumOutstanding.load(), count);
+        maximumRequested = std::max(maximumRequested.load(), request.cbRequested);
+
+        QMetaObject::invokeMethod(
+            &m_receiver,
+            [this, request]() {
+                const auto position = (quint64(request.nPositionHigh) << 32) | request.nPositionLow;
+                if (position != m_sent) {
+                    wrongPosition = true;
+                }
+
+                const auto length = uint32_t(std::min<quint64>(request.cbRequested, m_size - std::min(m_size, position)));
+                m_sent = position + length;
+
+                CLIPRDR_FILE_CONTENTS_RESPONSE response = {};
+                response.common.msgType = CB_FILECONTENTS_RESPONSE;
+                response.common.msgFlags = CB_RESPONSE_OK;
+                response.streamId = request.streamId;
+                response.cbRequested = length;
+                response.requestedData = reinterpret_cast<const BYTE *>(m_pattern.constData() + position % 251);
+
+                outstanding--;
+                ClipboardTest::clientFileContentsResponse(m_context, &response);
+            },
+            Qt::QueuedConnection);
+
+        return CHANNEL_RC_OK;
+    }
+
+    CliprdrServerContext *m_context;
+    quint64 m_size;
+    quint64 m_sent = 0;
+    QByteArray m_pattern;
+    QThread m_thread;
+    QObject m_receiver;
+};
+
+void ClipboardTest::testFileDownload_data()
+{
+    QTest::addColumn<quint64>("size");
+    QTest::addColumn<bool>("sizeKnown");
+
+    QTest::newRow("large") << quint64(32) * 1024 * 1024 << true;
+    QTest::newRow("partial last chunk") << quint64(FileChunkSize) * 3 + 12345 << true;
+    // Without a size, the first short chunk ends the file.
+    QTest::newRow("unknown size") << quint64(FileChunkSize) * 3 + 12345 << false;
+}
+
+void ClipboardTest::testFileDownload()
+{
+    QFETCH(quint64, size);
+    QFETCH(bool, sizeKnown);
+
+    Clipboard clipboard(nullptr);
+    auto d = clipboard.d.get();
+    d->clipContext = Clipboard::Private::CliprdrServerContextPtr(cliprdr_server_context_new(nullptr), cliprdr_server_context_free);
+    QVERIFY(d->clipContext);
+    d->clipContext->custom = &clipboard;
+    d->clipContext->ServerFileContentsRequest = FakeClient::request;
+    d->enabled = true;
+
+    FakeClient client(d->clipContext.get(), size);
+    FakeClient::s_instance = &client;
+    auto reset = qScopeGuard([]() {
+        FakeClient::s_instance = nullptr;
+    });
+
+    QTemporaryDir directory;
+    QVERIFY(directory.isValid());
+    const auto path = directory.filePath(u"file"_s);
+
+    resetPeakMemoryUse();
+    const auto memoryBefore = memoryUse("VmRSS");
+
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY(d->downloadFile(0, sizeKnown ? std::optional(size) : std::nullopt, path));
+    const auto elapsed = std::max<qint64>(timer.elapsed(), 1);
+
+    const auto memoryPeak = memoryUse("VmHWM");
+
+    // Chunks are requested one after another, never more than one at a time.
+    QVERIFY(!client.wrongPosition);
+    QCOMPARE(client.maximumOutstanding.load(), 1);
+    QVERIFY(client.maximumRequested <= FileChunkSize);
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(quint64(file.size()), size);
+    quint64 position = 0;
+    while (!file.atEnd()) {
+        const auto chunk = file.read(FileChunkSize);
+        for (qsizetype i = 0; i < chunk.size(); ++i) {
+            if (chunk[i] != char((position + i) % 251)) {
+                QFAIL(qPrintable(u"Wrong contents at byte %1"_s.arg(position + i)));
+            }
+        }
+        position += chunk.size();
+    }
+
+    // Only logged, the time depends too much on the machine running the test.
+    const auto throughput = (double(size) / (1024 * 1024)) / (double(elapsed) / 1000);
+    qDebug() << "Received" << size << "bytes in" << elapsed << "ms," << throughput << "MiB/s";
+
+    if (!memoryBefore || !memoryPeak) {
+        QSKIP("Memory use of the process is not available");
+    }
+    qDebug() << "Memory use grew by at most" << (*memoryPeak - *memoryBefore) << "bytes";
+    QVERIFY2(*memoryPeak - *memoryBefore <= MaximumMemoryGrowth, qPrintable(u"Memory use grew by %1 bytes"_s.arg(*memoryPeak - *memoryBefore)));
+}
+
+QTEST_MAIN(ClipboardTest)
+
+#include "clipboardtest.moc"
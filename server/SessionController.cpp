@@ -13,10 +13,15 @@
 #include <QDBusPendingCallWatcher>
 #include <QDBusPendingReply>
 #include <QDBusReply>
+#include <QElapsedTimer>
 #include <QMenu>
+#include <QTimer>
 
 #include <KLocalizedString>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <PipeWireSourceStream>
 
 #include <Clipboard.h>
@@ -34,32 +39,105 @@
 
 using namespace Qt::StringLiterals;
 
+// In broadcast mode all clients share one screencast. One of them, the host, captures and
+// encodes it, the video streams of the others send the frames produced by the host.
+struct Broadcast {
+    ~Broadcast()
+    {
+        if (pipeWireFd >= 0) {
+            ::close(pipeWireFd);
+        }
+    }
+
+    std::shared_ptr<KRdp::AbstractSession> session;
+    bool started = false;
+    // The PipeWire remote of the screencast, kept so another client can take over
+    // capturing when the host disconnects.
+    int pipeWireFd = -1;
+    QPointer<KRdp::RdpConnection> host;
+};
+
+// The session of a client that disconnected, kept for a while so a reconnecting
+// client can continue with it.
+struct ParkedSession {
+    ~ParkedSession()
+    {
+        if (pipeWireFd >= 0) {
+            ::close(pipeWireFd);
+        }
+    }
+
+    QString userName;
+    std::shared_ptr<KRdp::AbstractSession> session;
+    int pipeWireFd = -1;
+    QTimer expiryTimer;
+};
+
 class SessionWrapper : public QObject
 {
     Q_OBJECT
 public:
-    SessionWrapper(KRdp::RdpConnection *conn, std::unique_ptr<KRdp::AbstractSession> &&sess, KStatusNotifierItem *sni)
+    SessionWrapper(KRdp::RdpConnection *conn,
+                   std::shared_ptr<KRdp::AbstractSession> sess,
+                   KStatusNotifierItem *sni,
+                   std::shared_ptr<Broadcast> sharedBroadcast = nullptr)
         : session(std::move(sess))
+        , broadcast(std::move(sharedBroadcast))
         , connection(conn)
+        , userName(conn->userName())
     {
         m_sni = sni;
 
+        connect(session.get(), &KRdp::AbstractSession::error, this, [this]() {
+            m_sessionFailed = true;
+        });
         connect(session.get(), &KRdp::AbstractSession::error, this, &SessionWrapper::sessionError);
         connect(session.get(), &KRdp::AbstractSession::started, this, &SessionWrapper::onSessionStarted);
         connect(session.get(), &KRdp::AbstractSession::clipboardDataChanged, connection->clipboard(), &KRdp::Clipboard::setServerData);
 
         connect(connection->videoStream(), &KRdp::VideoStream::cursorChanged, this, &SessionWrapper::onCursorUpdate);
-        connect(connection->videoStream(), &KRdp::VideoStream::sizeChanged, session.get(), &KRdp::AbstractSession::setSize);
         connect(connection->videoStream(), &KRdp::VideoStream::enabledChanged, this, &SessionWrapper::onVideoStreamEnabledChanged);
-        connect(connection->inputHandler(), &KRdp::InputHandler::inputEvent, session.get(), &KRdp::AbstractSession::sendEvent);
-        connect(connection->clipboard(), &KRdp::Clipboard::clientDataChanged, session.get(), [clipboard = connection->clipboard(), this]() {
-            session->setClipboardData(clipboard->getClipboard());
-        });
-        connect(connection->displayControl(), &KRdp::DisplayControl::requestedScreenSizeChanged, connection->videoStream(), &KRdp::VideoStream::setRequestedSize);
+        if (!connection->isReadOnly()) {
+            connect(connection->inputHandler(), &KRdp::InputHandler::inputEvents, session.get(), &KRdp::AbstractSession::sendEvents);
+            connect(connection->clipboard(), &KRdp::Clipboard::clientDataChanged, session.get(), [clipboard = connection->clipboard(), this]() {
+                session->setClipboardData(clipboard->getClipboard());
+            });
+        }
+        // Flush coalesced pointer motion once per captured frame.
+        connection->inputHandler()->setMotionFlushRate(connection->videoStream()->requestedFrameRate());
+        if (isCapturing()) {
+            connectCapture();
+        }
 
         connect(connection, &QObject::destroyed, this, &SessionWrapper::onConnectionDestroyed);
     }
 
+    ~SessionWrapper() override
+    {
+        if (pipeWireFd >= 0) {
+            ::close(pipeWireFd);
+        }
+    }
+
+    // Whether the video stream of this client captures the screencast.
+    bool isCapturing() const
+    {
+        return !broadcast || broadcast->host == connection;
+    }
+
+    void connectCapture()
+    {
+        connect(connection->videoStream(), &KRdp::VideoStream::sizeChanged, session.get(), &KRdp::AbstractSession::setSize);
+        connect(connection->videoStream(), &KRdp::VideoStream::monitorLayoutChanged, session.get(), &KRdp::AbstractSession::setMonitorLayout);
+        // Resizing changes what every viewer of a broadcast sees, read-only clients only watch.
+        if (!connection->isReadOnly()) {
+            connect(connection->displayControl(),
+                    &KRdp::DisplayControl::requestedScreenSizeChanged,
+                    connection->videoStream(),
+                    &KRdp::VideoStream::setRequestedSize);
+        }
+    }
+
     void onCursorUpdate(const PipeWireCursor &cursor)
     {
         if (!connection) {
@@ -74,14 +152,63 @@ public:
 
     void onVideoStreamEnabledChanged()
     {
-        connection->videoStream()->setStreamingEnabled(m_sessionStarted && connection->videoStream()->enabled());
+        // The host of a broadcast keeps streaming for the other clients while its own output
+        // is suppressed, VideoStream stops capturing once nobody is watching.
+        connection->videoStream()->setStreamingEnabled(m_sessionStarted && (broadcast || connection->videoStream()->enabled()));
     }
 
     void onSessionStarted()
     {
         m_sessionStarted = true;
-        connection->videoStream()->setPipeWireSource(session->nodeId(), session->objectSerial(), session->takePipeWireFd());
-        connection->videoStream()->setStreamingEnabled(connection->videoStream()->enabled());
+        if (!broadcast) {
+            if (pipeWireFd < 0) {
+                pipeWireFd = session->takePipeWireFd();
+            }
+            startCapture(duplicatePipeWireFd());
+        } else {
+            if (!broadcast->started) {
+                broadcast->started = true;
+                broadcast->pipeWireFd = session->takePipeWireFd();
+            }
+            if (isCapturing()) {
+                startCapture(duplicatePipeWireFd());
+            } else if (broadcast->host) {
+                connection->videoStream()->setFrameSource(broadcast->host->videoStream());
+            }
+        }
+        onVideoStreamEnabledChanged();
+    }
+
+    void startCapture(int fd)
+    {
+        if (const auto monitors = session->monitorStreams(); monitors.size() > 1) {
+            QList<KRdp::VideoStream::PipeWireSource> sources;
+            for (const auto &monitor : monitors) {
+                sources.append({monitor.nodeId, monitor.objectSerial, monitor.geometry});
+            }
+            connection->videoStream()->setPipeWireSources(sources, fd);
+        } else {
+            connection->videoStream()->setPipeWireSource(session->nodeId(), session->objectSerial(), fd);
+        }
+    }
+
+    int duplicatePipeWireFd() const
+    {
+        // The video stream takes ownership of the file descriptor it is given.
+        const int fd = broadcast ? broadcast->pipeWireFd : pipeWireFd;
+        return fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    }
+
+    // Take over capturing the broadcast from a host that disconnected.
+    void becomeHost()
+    {
+        broadcast->host = connection;
+        connection->videoStream()->setFrameSource(nullptr);
+        connectCapture();
+        if (m_sessionStarted) {
+            startCapture(duplicatePipeWireFd());
+            onVideoStreamEnabledChanged();
+        }
     }
 
     void onConnectionDestroyed()
@@ -92,10 +219,15 @@ public:
     Q_SIGNAL void sessionError();
     Q_SIGNAL void connectionDestroyed(SessionWrapper *wrapper);
 
-    std::unique_ptr<KRdp::AbstractSession> session;
+    std::shared_ptr<KRdp::AbstractSession> session;
+    std::shared_ptr<Broadcast> broadcast;
     QPointer<KRdp::RdpConnection> connection;
+    QString userName;
+    // The PipeWire remote of the session, the video stream gets duplicates of it.
+    int pipeWireFd = -1;
     KStatusNotifierItem *m_sni;
     bool m_sessionStarted = false;
+    bool m_sessionFailed = false;
 };
 
 SessionController::SessionController(KRdp::Server *server, SessionType sessionType)
@@ -127,6 +259,11 @@ void SessionController::setMonitorIndex(const std::optional<int> &index)
     m_monitorIndex = index;
 }
 
+void SessionController::setStreamAllMonitors(bool all)
+{
+    m_streamAllMonitors = all;
+}
+
 void SessionController::setVirtualMonitor(const KRdp::VirtualMonitor &virtualMonitor)
 {
     m_virtualMonitor = virtualMonitor;
@@ -137,6 +274,65 @@ void SessionController::setQuality(const std::optional<int> &quality)
     m_quality = quality;
 }
 
+void SessionController::setBroadcast(bool broadcast)
+{
+    m_broadcast = broadcast;
+}
+
+void SessionController::setReconnectGracePeriod(std::chrono::seconds period)
+{
+    m_reconnectGracePeriod = period;
+    if (period <= std::chrono::seconds(0)) {
+        m_parkedSessions.clear();
+    }
+}
+
+void SessionController::setStandby(bool standby)
+{
+    m_standby = standby;
+    if (!standby) {
+        m_initializationSession.reset();
+        m_initializationSessionStarted = false;
+        return;
+    }
+
+    // Wait for the other settings, they are needed to start the session.
+    QMetaObject::invokeMethod(this, &SessionController::prepareStandbySession, Qt::QueuedConnection);
+}
+
+void SessionController::prepareStandbySession()
+{
+    if (!m_standby || m_initializationSession || !m_wrappers.empty()) {
+        return;
+    }
+
+    // Without a stored restore token the portal would ask the user for permission
+    // now, while nobody is connecting. The session is then started on connect.
+    bool portalSession = true;
+#ifdef WITH_PLASMA_SESSION
+    portalSession = m_sessionType != SessionType::Plasma;
+#endif
+    if (portalSession && !KRdp::PortalSession::hasRestoreToken()) {
+        qInfo() << "krdp: no screencast permission stored yet, the session starts when a client connects";
+        return;
+    }
+
+    // The session only provides the PipeWire node, nothing is captured until a client
+    // creates a stream for it. With the stored restore token the portal starts it without
+    // asking the user.
+    m_initializationSession = makeSession();
+    m_initializationSessionStarted = false;
+    connect(m_initializationSession.get(), &KRdp::AbstractSession::started, this, [this]() {
+        m_initializationSessionStarted = true;
+    });
+    connect(m_initializationSession.get(), &KRdp::AbstractSession::error, this, [this]() {
+        qWarning() << "krdp: could not start the standby screencast session, clients will start their own";
+        m_initializationSession.release()->deleteLater();
+        m_initializationSessionStarted = false;
+    });
+    m_initializationSession->start();
+}
+
 void SessionController::setLockOnDisconnect(bool lock)
 {
     m_lockOnDisconnect = lock;
@@ -174,17 +370,64 @@ void SessionController::onNewConnection(KRdp::RdpConnection *newConnection)
             return;
         }
 
-        auto wrapper = std::make_unique<SessionWrapper>(newConnection, makeSession(), m_sni);
-        if (m_virtualMonitor) {
-            wrapper->session->setVirtualMonitor(*m_virtualMonitor);
-        } else if (m_monitorIndex) {
-            wrapper->session->setActiveStream(*m_monitorIndex);
+        QElapsedTimer activationTimer;
+        activationTimer.start();
+
+        // In broadcast mode, clients after the first join the screencast of the first.
+        const bool joinBroadcast = m_activeBroadcast != nullptr;
+
+        // A client reconnecting within the grace period continues with its previous session.
+        // Otherwise use the standby session if there is one, it may already be started.
+        std::shared_ptr<KRdp::AbstractSession> session;
+        auto parked = m_broadcast ? nullptr : takeParkedSession(newConnection->userName());
+        const bool standby = !parked && !joinBroadcast && m_initializationSession;
+        bool sessionStarted = false;
+        if (parked) {
+            session = std::move(parked->session);
+            sessionStarted = true;
+        } else if (standby) {
+            m_initializationSession->disconnect(this);
+            session = std::move(m_initializationSession);
+            sessionStarted = std::exchange(m_initializationSessionStarted, false);
+        } else if (!joinBroadcast) {
+            session = makeSession();
+        }
+
+        std::unique_ptr<SessionWrapper> wrapper;
+        if (m_broadcast) {
+            if (!m_activeBroadcast) {
+                m_activeBroadcast = std::make_shared<Broadcast>();
+                m_activeBroadcast->session = std::move(session);
+                m_activeBroadcast->host = newConnection;
+            }
+            wrapper = std::make_unique<SessionWrapper>(newConnection, m_activeBroadcast->session, m_sni, m_activeBroadcast);
+        } else {
+            wrapper = std::make_unique<SessionWrapper>(newConnection, std::move(session), m_sni);
+        }
+        if (parked) {
+            wrapper->pipeWireFd = std::exchange(parked->pipeWireFd, -1);
         }
         wrapper->connection->videoStream()->setVideoQuality(m_quality.value());
 
+        if (wrapper->isCapturing()) {
+            const char *origin = parked ? "(resumed session)" : standby ? "(standby session)" : "";
+            connect(
+                wrapper->connection->videoStream(),
+                &KRdp::VideoStream::frameCaptured,
+                wrapper.get(),
+                [activationTimer, origin]() {
+                    qInfo() << "krdp: time to first frame:" << activationTimer.elapsed() << "ms" << origin;
+                },
+                Qt::SingleShotConnection);
+        }
+
         setSessionLocked(false);
 
         connect(wrapper.get(), &SessionWrapper::connectionDestroyed, this, [this](SessionWrapper *wrapper) {
+            if (!wrapper->broadcast && wrapper->m_sessionStarted && !wrapper->m_sessionFailed) {
+                parkSession(wrapper);
+            }
+
             m_wrappers.erase(std::remove_if(m_wrappers.begin(),
                                             m_wrappers.end(),
                                             [wrapper](std::unique_ptr<SessionWrapper> &entry) {
@@ -192,8 +435,13 @@ void SessionController::onNewConnection(KRdp::RdpConnection *newConnection)
                                             }),
                              m_wrappers.end());
 
+            if (m_activeBroadcast && !m_activeBroadcast->host) {
+                onBroadcastHostLeft();
+            }
+
             if (m_wrappers.empty()) {
                 setSessionLocked(true);
+                prepareStandbySession();
             }
         });
 
@@ -201,15 +449,102 @@ void SessionController::onNewConnection(KRdp::RdpConnection *newConnection)
             newConnection->close(KRdp::RdpConnection::CloseReason::None);
         });
 
-        wrapper->session->start();
+        if (sessionStarted || (joinBroadcast && m_activeBroadcast->started)) {
+            wrapper->onSessionStarted();
+        } else if (!standby && !joinBroadcast) {
+            wrapper->session->start();
+        }
         m_wrappers.push_back(std::move(wrapper));
     });
 }
 
+void SessionController::parkSession(SessionWrapper *wrapper)
+{
+    if (m_reconnectGracePeriod <= std::chrono::seconds(0) || wrapper->userName.isEmpty()) {
+        return;
+    }
+
+    // Only the most recent session of a user is kept.
+    std::erase_if(m_parkedSessions, [wrapper](const std::unique_ptr<ParkedSession> &entry) {
+        return entry->userName == wrapper->userName;
+    });
+
+    auto parked = std::make_unique<ParkedSession>();
+    parked->userName = wrapper->userName;
+    parked->session = std::move(wrapper->session);
+    parked->pipeWireFd = std::exchange(wrapper->pipeWireFd, -1);
+
+    // Nothing is captured while parked, the video stream went away with the connection.
+    auto discard = [this, entry = parked.get()]() {
+        QMetaObject::invokeMethod(
+            this,
+            [this, entry]() {
+                std::erase_if(m_parkedSessions, [entry](const std::unique_ptr<ParkedSession> &parked) {
+                    return parked.get() == entry;
+                });
+            },
+            Qt::QueuedConnection);
+    };
+    parked->expiryTimer.setSingleShot(true);
+    connect(&parked->expiryTimer, &QTimer::timeout, this, discard);
+    connect(parked->session.get(), &KRdp::AbstractSession::error, this, discard);
+    parked->expiryTimer.start(m_reconnectGracePeriod);
+
+    m_parkedSessions.push_back(std::move(parked));
+}
+
+std::unique_ptr<ParkedSession> SessionController::takeParkedSession(const QString &userName)
+{
+    auto itr = std::find_if(m_parkedSessions.begin(), m_parkedSessions.end(), [&userName](const std::unique_ptr<ParkedSession> &entry) {
+        return entry->userName == userName;
+    });
+    if (itr == m_parkedSessions.end()) {
+        return nullptr;
+    }
+
+    auto parked = std::move(*itr);
+    m_parkedSessions.erase(itr);
+    parked->expiryTimer.stop();
+    parked->session->disconnect(this);
+    return parked;
+}
+
+void SessionController::onBroadcastHostLeft()
+{
+    // Prefer a client that may control the session, so the new host can resize it.
+    auto next = std::find_if(m_wrappers.begin(), m_wrappers.end(), [](const std::unique_ptr<SessionWrapper> &entry) {
+        return entry->broadcast && entry->connection && !entry->connection->isReadOnly();
+    });
+    if (next == m_wrappers.end()) {
+        next = std::find_if(m_wrappers.begin(), m_wrappers.end(), [](const std::unique_ptr<SessionWrapper> &entry) {
+            return entry->broadcast && entry->connection;
+        });
+    }
+    if (next == m_wrappers.end()) {
+        // Nobody is watching anymore, the next client starts a new screencast.
+        m_activeBroadcast.reset();
+        return;
+    }
+
+    (*next)->becomeHost();
+    for (const auto &entry : m_wrappers) {
+        if (entry->broadcast && entry->connection && !entry->isCapturing() && entry->m_sessionStarted) {
+            entry->connection->videoStream()->setFrameSource((*next)->connection->videoStream());
+        }
+    }
+}
+
 void SessionController::stopFromSNI()
 {
     // Uses dbus to stop the server service, like in the KCM
     // This kills all krdpserver instances, like a "panic button"
+    // The socket unit is stopped first, otherwise the next client connecting
+    // would start the service again right away.
+    QDBusInterface socket(u"org.freedesktop.systemd1"_s,
+                          u"/org/freedesktop/systemd1/unit/app_2dorg_2ekde_2ekrdpserver_2esocket"_s,
+                          u"org.freedesktop.systemd1.Unit"_s);
+    socket.asyncCall(u"Stop"_s);
+
     QDBusInterface unit(u"org.freedesktop.systemd1"_s,
                         u"/org/freedesktop/systemd1/unit/app_2dorg_2ekde_2ekrdpserver_2eservice"_s,
                         u"org.freedesktop.systemd1.Unit"_s);
@@ -220,14 +555,24 @@ void SessionController::stopFromSNI()
 
 std::unique_ptr<KRdp::AbstractSession> SessionController::makeSession()
 {
+    std::unique_ptr<KRdp::AbstractSession> session;
 #ifdef WITH_PLASMA_SESSION
     if (m_sessionType == SessionType::Plasma) {
-        return std::make_unique<KRdp::PlasmaScreencastV1Session>();
+        session = std::make_unique<KRdp::PlasmaScreencastV1Session>();
     } else
 #endif
     {
-        return std::make_unique<KRdp::PortalSession>();
+        session = std::make_unique<KRdp::PortalSession>();
+    }
+
+    if (m_virtualMonitor) {
+        session->setVirtualMonitor(*m_virtualMonitor);
+    } else if (m_streamAllMonitors) {
+        session->setStreamAllMonitors(true);
+    } else if (m_monitorIndex) {
+        session->setActiveStream(*m_monitorIndex);
     }
+    return session;
 }
 
 #include "SessionController.moc"
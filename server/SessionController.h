@@ -6,6 +6,7 @@
 #include "RdpConnection.h"
 #include <AbstractSession.h>
 #include <KStatusNotifierItem>
+#include <chrono>
 #include <vector>
 
 #include <QObject>
@@ -18,6 +19,8 @@ class RdpConnection;
 }
 
 class SessionWrapper;
+struct Broadcast;
+struct ParkedSession;
 
 class SessionController : public QObject
 {
@@ -33,7 +36,21 @@ public:
 
     void setVirtualMonitor(const KRdp::VirtualMonitor &vm);
     void setMonitorIndex(const std::optional<int> &index);
+    /**
+     * Stream every monitor, each as its own monitor on the client.
+     */
+    void setStreamAllMonitors(bool all);
     void setQuality(const std::optional<int> &quality);
+    /**
+     * Share one screencast between all clients.
+     *
+     * The first client starts the screencast and its video stream captures
+     * and encodes it. Every other client is sent the frames encoded for the
+     * first one. When the capturing client disconnects, the next client in
+     * line takes over capturing, which makes every client wait for a
+     * keyframe once.
+     */
+    void setBroadcast(bool broadcast);
     void setSNIStatus(const KRdp::RdpConnection::State state);
     void stopFromSNI();
 
@@ -44,19 +61,52 @@ public:
      */
     void setLockOnDisconnect(bool lock);
 
+    /**
+     * Start a screencast session before any client connects.
+     *
+     * The session is started as soon as the server runs, and again after the
+     * last client disconnected. A client connecting while it is ready skips
+     * the portal requests and only needs to create its PipeWire stream, so it
+     * gets its first frame sooner. Nothing is captured until then.
+     */
+    void setStandby(bool standby);
+
+    /**
+     * Keep the session of a disconnected client for \p period.
+     *
+     * When the same user connects again within that time, the client
+     * continues with the existing screencast session instead of starting a
+     * new one, which skips the portal requests and permission prompts. A
+     * period of 0 disables this.
+     */
+    void setReconnectGracePeriod(std::chrono::seconds period);
+
 private:
     void onNewConnection(KRdp::RdpConnection *newConnection);
+    void onBroadcastHostLeft();
+    void parkSession(SessionWrapper *wrapper);
+    std::unique_ptr<ParkedSession> takeParkedSession(const QString &userName);
     std::unique_ptr<KRdp::AbstractSession> makeSession();
+    void prepareStandbySession();
     // Lock/unlock the desktop session via logind (no-op unless setLockOnDisconnect(true)).
     void setSessionLocked(bool locked);
 
     KRdp::Server *m_server = nullptr;
     SessionType m_sessionType;
     std::optional<int> m_monitorIndex;
+    bool m_streamAllMonitors = false;
     std::optional<int> m_quality;
     std::optional<KRdp::VirtualMonitor> m_virtualMonitor;
+    bool m_broadcast = false;
+    std::shared_ptr<Broadcast> m_activeBroadcast;
 
+    // Session started in advance, see setStandby().
     std::unique_ptr<KRdp::AbstractSession> m_initializationSession;
+    bool m_initializationSessionStarted = false;
+    bool m_standby = false;
+
+    std::chrono::seconds m_reconnectGracePeriod = std::chrono::seconds(0);
+    std::vector<std::unique_ptr<ParkedSession>> m_parkedSessions;
 
     std::vector<std::unique_ptr<SessionWrapper>> m_wrappers;
 
@@ -4,10 +4,13 @@
 
 #include <csignal>
 #include <filesystem>
+#include <functional>
 
 #include <QApplication>
 #include <QCommandLineParser>
+#include <QElapsedTimer>
 #include <QRegularExpression>
+#include <QScopeGuard>
 
 #include <KAboutData>
 #include <KCrash>
@@ -25,6 +28,10 @@ using namespace Qt::StringLiterals;
 
 int main(int argc, char **argv)
 {
+    // With socket activation a client is waiting while we start, so keep track of how long that takes.
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+
     QApplication application{argc, argv};
     application.setApplicationName(u"krdp-server"_s);
     application.setApplicationDisplayName(u"KRDP Server"_s);
@@ -45,12 +52,13 @@ int main(int argc, char **argv)
         {u"port"_s, u"The port to use for connections. Defaults to 3389."_s, u"port"_s, u"3389"_s},
         {u"certificate"_s, u"The TLS certificate file to use."_s, u"certificate"_s, u"server.crt"_s},
         {u"certificate-key"_s, u"The TLS certificate key to use."_s, u"certificate-key"_s, u"server.key"_s},
-        {u"monitor"_s, u"The index of the monitor to use when streaming."_s, u"monitor"_s, u"-1"_s},
+        {u"monitor"_s, u"The index of the monitor to use when streaming, or \"all\" to stream every monitor."_s, u"monitor"_s, u"-1"_s},
         {u"virtual-monitor"_s,
          u"Creates a new virtual output to connect to (WIDTHxHEIGHT@SCALE, e.g. 1920x1080@1). Incompatible with --monitor."_s,
          u"data"_s,
          u"1920x1080@1"_s},
         {u"quality"_s, u"Encoding quality of the stream, from 0 (lowest) to 100 (highest)"_s, u"quality"_s},
+        {u"broadcast"_s, u"Share one screencast between all connected clients instead of starting one per client."_s},
 #ifdef WITH_PLASMA_SESSION
         {u"plasma"_s, u"Use Plasma protocols instead of XDP"_s},
 #endif
@@ -89,8 +97,20 @@ int main(int argc, char **argv)
     server.setAddress(address);
     server.setPort(port);
 
-    server.setTlsCertificate(certificate);
-    server.setTlsCertificateKey(certificateKey);
+    server.setTlsCredentials(certificate, certificateKey);
+
+    KRdp::ConnectionLimits limits;
+    limits.maximumConnections = config->maximumConnections();
+    limits.maximumPendingConnections = config->maximumPendingConnections();
+    limits.connectionsPerMinute = config->connectionsPerMinute();
+    limits.authenticationTimeout = std::chrono::seconds(config->authenticationTimeout());
+    server.setConnectionLimits(limits);
+
+    // Reading passwords from the keychain is asynchronous. Normally the server
+    // already listens in the meantime, but a socket activated server has a client
+    // waiting that would be refused if it was accepted before its password is known.
+    int pendingPasswordReads = 0;
+    std::function<void()> passwordsRead;
 
     // Use parsed username/pw if set
     if (parser.isSet(u"username"_s)) {
@@ -107,7 +127,13 @@ int main(int argc, char **argv)
         for (const auto &userName : users) {
             const auto readJob = new QKeychain::ReadPasswordJob(QLatin1StringView("KRDP"));
             readJob->setKey(QLatin1StringView(userName.toLatin1()));
-            QObject::connect(readJob, &QKeychain::ReadPasswordJob::finished, &server, [userName, readJob, &server]() {
+            QObject::connect(readJob, &QKeychain::ReadPasswordJob::finished, &server, [userName, readJob, &server, &pendingPasswordReads, &passwordsRead]() {
+                const auto done = qScopeGuard([&pendingPasswordReads, &passwordsRead]() {
+                    if (--pendingPasswordReads == 0 && passwordsRead) {
+                        passwordsRead();
+                    }
+                });
+
                 KRdp::User user;
                 if (readJob->error() != QKeychain::Error::NoError) {
                     qWarning() << "requestPassword: Failed to read password of " << userName << " because of error: " << readJob->error();
@@ -117,6 +143,7 @@ int main(int argc, char **argv)
                 user.password = readJob->textData();
                 server.addUser(user);
             });
+            pendingPasswordReads++;
             readJob->start();
         }
         if (users.isEmpty() && !server.usePAMAuthentication()) {
@@ -135,13 +162,50 @@ int main(int argc, char **argv)
             return 1;
         }
         controller.setVirtualMonitor({vmData, {match.capturedView(1).toInt(), match.capturedView(2).toInt()}, match.capturedView(3).toDouble()});
+    } else if (parser.value(u"monitor"_s) == u"all"_s) {
+        controller.setStreamAllMonitors(true);
     } else {
         controller.setMonitorIndex(parser.isSet(u"monitor"_s) ? std::optional(parser.value(u"monitor"_s).toInt()) : std::nullopt);
     }
     controller.setQuality(parserValueWithDefault(u"quality", config->quality()));
+    controller.setBroadcast(parser.isSet(u"broadcast"_s));
     controller.setLockOnDisconnect(config->lockOnDisconnect());
+    controller.setReconnectGracePeriod(std::chrono::seconds(config->reconnectGracePeriod()));
+    controller.setStandby(config->standbySession());
+
+    if (server.isSocketActivated()) {
+        // Started on demand, so exit again when nobody is using it.
+        server.setIdleTimeout(std::chrono::seconds(config->idleTimeout()));
+        QObject::connect(&server, &KRdp::Server::idle, &application, []() {
+            qInfo() << "No connections for a while, exiting";
+            QCoreApplication::exit(0);
+        });
+    }
+
+    QObject::connect(
+        &server,
+        &KRdp::Server::newConnectionCreated,
+        &application,
+        [&startupTimer]() {
+            qInfo() << "Accepted first connection" << startupTimer.elapsed() << "ms after startup";
+        },
+        Qt::SingleShotConnection);
+
+    auto startServer = [&server, &startupTimer]() {
+        if (!server.start()) {
+            return false;
+        }
+        qInfo().noquote() << "Accepting connections" << startupTimer.elapsed() << "ms after startup" << (server.isSocketActivated() ? u"(socket activated)"_s : QString());
+        return true;
+    };
 
-    if (!server.start()) {
+    if (server.isSocketActivated() && pendingPasswordReads > 0) {
+        passwordsRead = [startServer]() {
+            if (!startServer()) {
+                QCoreApplication::exit(-1);
+            }
+        };
+    } else if (!startServer()) {
         return -1;
     }
 
@@ -5,21 +5,93 @@
 #include "AbstractSession.h"
 #include <unistd.h>
 
+#include <algorithm>
+#include <limits>
+
 #include <QClipboard>
+#include <QLineF>
 #include <QMimeData>
 
 #include <KSystemClipboard>
 
 #include "krdp_logging.h"
 
+using namespace Qt::StringLiterals;
+
 namespace KRdp
 {
 
+/**
+ * Text, HTML, images or files on the system clipboard, which are only read when a client pastes them.
+ */
+class KRDP_NO_EXPORT SystemClipboardData : public QMimeData
+{
+public:
+    explicit SystemClipboardData(const QMimeData *data)
+    {
+        // known formats only, arbitrary MIME payloads can block on Wayland/XWayland targets (SAVE_TARGETS)
+        if (data->hasText()) {
+            m_formats.append(u"text/plain"_s);
+        }
+        if (data->hasHtml()) {
+            m_formats.append(u"text/html"_s);
+        }
+        if (data->hasFormat(u"image/png"_s)) {
+            m_formats.append(u"image/png"_s);
+        }
+        if (data->hasUrls()) {
+            m_formats.append(u"text/uri-list"_s);
+        }
+    }
+
+    QStringList formats() const override
+    {
+        return m_formats;
+    }
+
+protected:
+    QVariant retrieveData(const QString &mimeType, QMetaType type) const override
+    {
+        Q_UNUSED(type);
+
+        // Once a client's clipboard took over, reading it would have to wait for that client.
+        if (!m_formats.contains(mimeType) || KSystemClipboard::instance()->ownsClipboard()) {
+            return QVariant();
+        }
+
+        auto data = KSystemClipboard::instance()->mimeData(QClipboard::Clipboard);
+        if (!data) {
+            return QVariant();
+        }
+
+        if (mimeType == u"text/uri-list"_s) {
+            QVariantList urls;
+            const auto dataUrls = data->urls();
+            for (const auto &url : dataUrls) {
+                urls.append(url);
+            }
+            return urls;
+        }
+
+        if (mimeType == u"text/plain"_s) {
+            return data->hasText() ? QVariant(data->text()) : QVariant();
+        }
+
+        return data->data(mimeType);
+    }
+
+private:
+    QStringList m_formats;
+};
+
 class KRDP_NO_EXPORT AbstractSession::Private
 {
 public:
     std::optional<int> activeStream;
     std::optional<VirtualMonitor> virtualMonitor;
+    bool streamAllMonitors = false;
+    QList<MonitorStream> monitorStreams;
+    QList<QRect> monitorLayout;
     bool started = false;
     QSize size;
     QSize logicalSize;
@@ -47,19 +119,13 @@ AbstractSession::AbstractSession()
             return;
         }
 
-        // text only, arbitrary MIME payloads can block on Wayland/XWayland targets (SAVE_TARGETS)
-        const QString text = data->hasText() ? data->text() : QString();
-        if (!data->hasText()) {
-            qCDebug(KRDP) << "Ignoring non-text clipboard update with formats" << data->formats();
-        }
-
-        // KSystemClipboard keeps ownership of what it returns, copy into a new QMimeData
-        auto newData = new QMimeData();
-        if (!text.isEmpty()) {
-            newData->setText(text);
+        // Only look at the formats here, the contents are not read until a client pastes them.
+        auto clipboardData = std::make_shared<SystemClipboardData>(data);
+        if (clipboardData->formats().isEmpty()) {
+            qCDebug(KRDP) << "Ignoring clipboard update with unsupported formats" << data->formats();
         }
 
-        Q_EMIT clipboardDataChanged(newData);
+        Q_EMIT clipboardDataChanged(clipboardData);
     });
 }
 
@@ -79,6 +145,13 @@ void AbstractSession::setClipboardData(std::unique_ptr<QMimeData> data)
     }
 }
 
+void AbstractSession::sendEvents(const std::vector<std::shared_ptr<QEvent>> &events)
+{
+    for (const auto &event : events) {
+        sendEvent(event);
+    }
+}
+
 QSize AbstractSession::logicalSize() const
 {
     return d->logicalSize;
@@ -106,6 +179,72 @@ void AbstractSession::setVirtualMonitor(const VirtualMonitor &virtualMonitor)
     d->virtualMonitor = virtualMonitor;
 }
 
+void AbstractSession::setStreamAllMonitors(bool all)
+{
+    Q_ASSERT(!d->virtualMonitor && !d->activeStream.has_value());
+    d->streamAllMonitors = all;
+}
+
+bool AbstractSession::streamAllMonitors() const
+{
+    return d->streamAllMonitors;
+}
+
+QList<MonitorStream> AbstractSession::monitorStreams() const
+{
+    return d->monitorStreams;
+}
+
+void AbstractSession::setMonitorStreams(const QList<MonitorStream> &streams)
+{
+    d->monitorStreams = streams;
+}
+
+QList<QRect> AbstractSession::monitorLayout() const
+{
+    return d->monitorLayout;
+}
+
+void AbstractSession::setMonitorLayout(const QList<QRect> &layout)
+{
+    d->monitorLayout = layout;
+}
+
+std::optional<std::pair<int, QPointF>> AbstractSession::monitorAt(const QPointF &position) const
+{
+    if (d->monitorLayout.isEmpty()) {
+        return std::nullopt;
+    }
+
+    // Monitors can have gaps between them, fall back to the closest one.
+    int closest = -1;
+    qreal closestDistance = std::numeric_limits<qreal>::max();
+    for (int i = 0; i < d->monitorLayout.size(); ++i) {
+        const QRectF rect = d->monitorLayout.at(i);
+        if (rect.isEmpty()) {
+            continue;
+        }
+        if (rect.contains(position)) {
+            return std::make_pair(i, position - rect.topLeft());
+        }
+
+        const QPointF clamped(std::clamp(position.x(), rect.left(), rect.right()), std::clamp(position.y(), rect.top(), rect.bottom()));
+        const qreal distance = QLineF(position, clamped).length();
+        if (distance < closestDistance) {
+            closest = i;
+            closestDistance = distance;
+        }
+    }
+
+    if (closest < 0) {
+        return std::nullopt;
+    }
+
+    const QRectF rect = d->monitorLayout.at(closest);
+    const QPointF clamped(std::clamp(position.x(), rect.left(), rect.right()), std::clamp(position.y(), rect.top(), rect.bottom()));
+    return std::make_pair(closest, clamped - rect.topLeft());
+}
+
 bool AbstractSession::isStarted() const
 {
     return d->started;
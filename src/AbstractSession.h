@@ -8,9 +8,14 @@
 
 #include <memory>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include <QEvent>
+#include <QList>
 #include <QObject>
+#include <QPointF>
+#include <QRect>
 #include <QSize>
 #include <QString>
 
@@ -27,6 +32,17 @@ struct VirtualMonitor {
     qreal dpr;
 };
 
+/**
+ * A monitor that is captured as its own stream.
+ */
+struct MonitorStream {
+    quint32 nodeId = 0;
+    quint64 objectSerial = quint64(-1);
+    // Position and size of the monitor on the server's desktop, in logical coordinates.
+    QRect geometry;
+    QString mappingId;
+};
+
 class KRDP_EXPORT AbstractSession : public QObject
 {
     Q_OBJECT
@@ -41,6 +57,26 @@ public:
 
     void setActiveStream(int stream);
     void setVirtualMonitor(const VirtualMonitor &vm);
+    /**
+     * Capture every monitor as a separate stream instead of a single one.
+     *
+     * Once started, the streams are available from monitorStreams().
+     */
+    void setStreamAllMonitors(bool all);
+    /**
+     * The monitors captured by this session.
+     *
+     * Only set when streaming all monitors, the first entry matches nodeId()
+     * and objectSerial().
+     */
+    QList<MonitorStream> monitorStreams() const;
+    /**
+     * Set where each monitor stream is shown on the client's desktop.
+     *
+     * Pointer positions received from the client are relative to this
+     * layout. The list is indexed like monitorStreams().
+     */
+    void setMonitorLayout(const QList<QRect> &layout);
     quint32 nodeId() const;
     int takePipeWireFd();
 
@@ -62,14 +98,26 @@ public:
      */
     virtual void sendEvent(const std::shared_ptr<QEvent> &event) = 0;
 
+    /**
+     * Send a batch of events that belong together.
+     *
+     * The default implementation sends each event with sendEvent().
+     *
+     * \param events The events to send, in order.
+     */
+    virtual void sendEvents(const std::vector<std::shared_ptr<QEvent>> &events);
+
 Q_SIGNALS:
     void started();
     void error();
 
     /**
      * Emitted whenever the system's clipboard data changes.
+     *
+     * The data only describes which formats are available, reading it reads
+     * the system's clipboard at that moment.
      */
-    void clipboardDataChanged(const QMimeData *data);
+    void clipboardDataChanged(const std::shared_ptr<const QMimeData> &data);
 
 protected:
     bool isStarted() const;
@@ -77,12 +125,22 @@ protected:
     QSize logicalSize() const;
     std::optional<VirtualMonitor> virtualMonitor() const;
     std::optional<int> activeStream() const;
+    bool streamAllMonitors() const;
+    QList<QRect> monitorLayout() const;
+    /**
+     * Find the monitor stream at a position on the client's desktop.
+     *
+     * Returns the index of the monitor and the position relative to it, or
+     * nothing if the client's layout is not known.
+     */
+    std::optional<std::pair<int, QPointF>> monitorAt(const QPointF &position) const;
 
     void setStarted(bool started);
     void setLogicalSize(QSize size);
     void setNodeId(quint32 nodeId);
     void setPipeWireFd(int fd);
     void setObjectSerial(quint64 objectSerial);
+    void setMonitorStreams(const QList<MonitorStream> &streams);
 
 private:
     class Private;
@@ -0,0 +1,506 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+
+#include "AudioStream.h"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <QByteArray>
+
+#include <freerdp/codec/audio.h>
+#include <freerdp/peer.h>
+#include <freerdp/server/rdpsnd.h>
+#include <freerdp/server/server-common.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include "PeerContext_p.h"
+#include "RdpConnection.h"
+#include "Timestamps_p.h"
+
+#include "krdp_logging.h"
+
+namespace KRdp
+{
+
+namespace clk = std::chrono;
+
+constexpr uint32_t SampleRate = 48000;
+constexpr uint16_t Channels = 2;
+constexpr uint16_t BytesPerFrame = Channels * sizeof(int16_t);
+
+// Audio is sent in small packets to keep latency low. This is also a valid Opus frame duration.
+constexpr auto PacketDuration = clk::milliseconds(10);
+constexpr uint32_t FramesPerPacket = SampleRate * PacketDuration.count() / 1000;
+constexpr qsizetype PacketSize = FramesPerPacket * BytesPerFrame;
+
+// Bounds for the amount of audio that is sent but not yet played by the client.
+constexpr auto MinimumInFlight = clk::milliseconds(60);
+constexpr auto MaximumInFlight = clk::milliseconds(500);
+// Used until the first round trip has been measured.
+constexpr auto InitialInFlight = clk::milliseconds(200);
+// The in-flight limit covers this many times the round trip jitter, so jitter does not cause gaps.
+constexpr int JitterMultiplier = 4;
+// Audio the client may buffer before playing it, on top of what is needed to cover the network round trip.
+constexpr auto ClientBuffer = clk::milliseconds(40);
+// Blocks not confirmed within this time are considered lost.
+constexpr auto ConfirmTimeout = clk::seconds(2);
+
+constexpr auto LatencyReportInterval = clk::seconds(5);
+
+struct AudioPacket {
+    QByteArray samples;
+    clk::steady_clock::time_point captureTime;
+    uint16_t timestamp = 0;
+};
+
+struct SentBlock {
+    clk::steady_clock::time_point captureTime;
+    clk::steady_clock::time_point sendTime;
+    uint16_t timestamp = 0;
+    bool pending = false;
+};
+
+// Lower is better. Opus has the lowest delay for its bitrate, AAC is what most Windows clients decode.
+static int formatPreference(const AUDIO_FORMAT &format)
+{
+    int preference = 0;
+    switch (format.wFormatTag) {
+#ifdef WAVE_FORMAT_OPUS
+    case WAVE_FORMAT_OPUS:
+        preference = 0;
+        break;
+#endif
+    case WAVE_FORMAT_AAC_MS:
+        preference = 2;
+        break;
+    case WAVE_FORMAT_PCM:
+        preference = 4;
+        break;
+    default:
+        preference = 6;
+        break;
+    }
+
+    // Avoid resampling where possible.
+    if (format.nSamplesPerSec != SampleRate || format.nChannels != Channels) {
+        preference++;
+    }
+
+    return preference;
+}
+
+class KRDP_NO_EXPORT AudioStream::Private
+{
+public:
+    static void activated(RdpsndServerContext *context);
+    static UINT confirmBlock(RdpsndServerContext *context, BYTE blockNo, UINT16 timestamp);
+    static void process(void *data);
+
+    bool startCapture();
+    void stopCapture();
+
+    void enqueue(const char *data, qsizetype size);
+    void sendLoop(std::stop_token stopToken);
+    clk::milliseconds inFlightLimit() const;
+    void expireBlocks(clk::steady_clock::time_point now);
+
+    RdpConnection *connection = nullptr;
+    bool initialized = false;
+
+    RdpsndServerContext *context = nullptr;
+    AUDIO_FORMAT sourceFormat = {};
+
+    // Capture happens on the PipeWire thread loop.
+    pw_thread_loop *loop = nullptr;
+    pw_stream *stream = nullptr;
+    AudioPacket pendingPacket;
+
+    // Packets are encoded and sent on a separate thread, so capture is never blocked by encoding.
+    std::jthread sendThread;
+
+    mutable std::mutex mutex;
+    std::condition_variable_any condition;
+    std::deque<AudioPacket> queue;
+    std::array<SentBlock, 256> sentBlocks;
+    int inFlightBlocks = 0;
+    // Smoothed network round trip, without the time the client buffered a block, and its mean deviation.
+    clk::microseconds roundTrip = clk::microseconds(0);
+    clk::microseconds roundTripVariation = clk::microseconds(0);
+    clk::milliseconds latency = clk::milliseconds(0);
+    uint64_t droppedPackets = 0;
+    clk::steady_clock::time_point lastReport;
+};
+
+void AudioStream::Private::activated(RdpsndServerContext *context)
+{
+    auto d = static_cast<AudioStream::Private *>(context->data);
+
+    // Server formats are sorted by preference, pick the first one the client also supports.
+    for (size_t i = 0; i < context->num_server_formats; ++i) {
+        const auto &format = context->server_formats[i];
+        for (UINT16 j = 0; j < context->num_client_formats; ++j) {
+            if (!audio_format_compatible(&format, &context->client_formats[j])) {
+                continue;
+            }
+
+            qCDebug(KRDP) << "Sending audio as" << audio_format_get_tag_string(format.wFormatTag) << format.nSamplesPerSec << "Hz" << format.nChannels
+                          << "channels";
+            if (context->SelectFormat(context, j) != CHANNEL_RC_OK) {
+                qCWarning(KRDP) << "Could not select audio format";
+                return;
+            }
+
+            if (!d->startCapture()) {
+                d->stopCapture();
+            }
+            return;
+        }
+    }
+
+    qCWarning(KRDP) << "Client does not support any of the available audio formats, not sending audio";
+}
+
+UINT AudioStream::Private::confirmBlock(RdpsndServerContext *context, BYTE blockNo, UINT16 timestamp)
+{
+    auto d = static_cast<AudioStream::Private *>(context->data);
+
+    std::lock_guard lock(d->mutex);
+
+    auto &block = d->sentBlocks[blockNo];
+    if (!block.pending) {
+        return CHANNEL_RC_OK;
+    }
+
+    block.pending = false;
+    d->inFlightBlocks--;
+
+    const auto now = clk::steady_clock::now();
+    const auto roundTrip = clk::duration_cast<clk::microseconds>(now - block.sendTime);
+    // The client adds the time between receiving a block and playing it to the timestamp.
+    const auto clientDelay = std::min<clk::microseconds>(clk::milliseconds(uint16_t(timestamp - block.timestamp)), roundTrip);
+    const auto networkRoundTrip = roundTrip - clientDelay;
+
+    if (d->roundTrip == clk::microseconds(0)) {
+        d->roundTrip = std::max(networkRoundTrip, clk::microseconds(1));
+        d->roundTripVariation = networkRoundTrip / 2;
+    } else {
+        d->roundTripVariation = (d->roundTripVariation * 3 + clk::abs(d->roundTrip - networkRoundTrip)) / 4;
+        d->roundTrip = (d->roundTrip * 7 + networkRoundTrip) / 8;
+    }
+
+    d->latency = clk::duration_cast<clk::milliseconds>((block.sendTime - block.captureTime) + networkRoundTrip / 2 + clientDelay);
+
+    if (now - d->lastReport >= LatencyReportInterval) {
+        d->lastReport = now;
+        qCDebug(KRDP) << "Audio latency" << d->latency.count() << "ms, network round trip" << clk::duration_cast<clk::milliseconds>(networkRoundTrip).count()
+                      << "ms, client delay" << clk::duration_cast<clk::milliseconds>(clientDelay).count() << "ms, in flight limit"
+                      << d->inFlightLimit().count() << "ms, dropped packets" << d->droppedPackets;
+    }
+
+    d->condition.notify_one();
+    return CHANNEL_RC_OK;
+}
+
+void AudioStream::Private::process(void *data)
+{
+    auto d = static_cast<AudioStream::Private *>(data);
+
+    auto buffer = pw_stream_dequeue_buffer(d->stream);
+    if (!buffer) {
+        return;
+    }
+
+    const auto &spaData = buffer->buffer->datas[0];
+    if (spaData.data && spaData.chunk) {
+        const auto offset = std::min(spaData.chunk->offset, spaData.maxsize);
+        const auto size = std::min(spaData.chunk->size, spaData.maxsize - offset);
+        d->enqueue(static_cast<const char *>(spaData.data) + offset, size);
+    }
+
+    pw_stream_queue_buffer(d->stream, buffer);
+}
+
+bool AudioStream::Private::startCapture()
+{
+    if (loop) {
+        return true;
+    }
+
+    static std::once_flag pipeWireInitialized;
+    std::call_once(pipeWireInitialized, []() {
+        pw_init(nullptr, nullptr);
+    });
+
+    loop = pw_thread_loop_new("krdp-audio", nullptr);
+    if (!loop) {
+        qCWarning(KRDP) << "Could not create PipeWire loop for audio capture";
+        return false;
+    }
+
+    auto properties = pw_properties_new(PW_KEY_MEDIA_TYPE,
+                                        "Audio",
+                                        PW_KEY_MEDIA_CATEGORY,
+                                        "Capture",
+                                        PW_KEY_MEDIA_ROLE,
+                                        "Screen",
+                                        PW_KEY_STREAM_CAPTURE_SINK,
+                                        "true",
+                                        nullptr);
+    // Ask for buffers of a single packet, so capturing does not add latency.
+    pw_properties_setf(properties, PW_KEY_NODE_LATENCY, "%u/%u", FramesPerPacket, SampleRate);
+
+    static const pw_stream_events streamEvents = {
+        .version = PW_VERSION_STREAM_EVENTS,
+        .process = &Private::process,
+    };
+
+    stream = pw_stream_new_simple(pw_thread_loop_get_loop(loop), "KRdp Audio", properties, &streamEvents, this);
+    if (!stream) {
+        qCWarning(KRDP) << "Could not create PipeWire stream for audio capture";
+        return false;
+    }
+
+    spa_audio_info_raw info = {};
+    info.format = SPA_AUDIO_FORMAT_S16_LE;
+    info.rate = SampleRate;
+    info.channels = Channels;
+    info.position[0] = SPA_AUDIO_CHANNEL_FL;
+    info.position[1] = SPA_AUDIO_CHANNEL_FR;
+
+    uint8_t podBuffer[1024];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(podBuffer, sizeof(podBuffer));
+    const spa_pod *params[] = {spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info)};
+
+    const auto flags = pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS);
+    if (pw_stream_connect(stream, PW_DIRECTION_INPUT, PW_ID_ANY, flags, params, 1) < 0) {
+        qCWarning(KRDP) << "Could not connect PipeWire stream for audio capture";
+        return false;
+    }
+
+    sendThread = std::jthread([this](std::stop_token stopToken) {
+        sendLoop(stopToken);
+    });
+
+    if (pw_thread_loop_start(loop) < 0) {
+        qCWarning(KRDP) << "Could not start PipeWire loop for audio capture";
+        return false;
+    }
+
+    return true;
+}
+
+void AudioStream::Private::stopCapture()
+{
+    if (loop) {
+        pw_thread_loop_stop(loop);
+    }
+    if (stream) {
+        pw_stream_destroy(stream);
+        stream = nullptr;
+    }
+    if (loop) {
+        pw_thread_loop_destroy(loop);
+        loop = nullptr;
+    }
+
+    // Requesting a stop wakes the send thread, joining happens on assignment.
+    sendThread = std::jthread();
+
+    std::lock_guard lock(mutex);
+    queue.clear();
+    pendingPacket = AudioPacket{};
+}
+
+void AudioStream::Private::enqueue(const char *data, qsizetype size)
+{
+    // Collect whole packets, so every packet is sent as a single block.
+    while (size > 0) {
+        if (pendingPacket.samples.isEmpty()) {
+            pendingPacket.samples.reserve(PacketSize);
+            pendingPacket.captureTime = clk::steady_clock::now();
+            // Same time of day as the frame timestamps, so the client can match audio with video.
+            pendingPacket.timestamp = Timestamps::audioTimestamp(Timestamps::now());
+        }
+
+        const auto count = std::min(size, PacketSize - pendingPacket.samples.size());
+        pendingPacket.samples.append(data, count);
+        data += count;
+        size -= count;
+
+        if (pendingPacket.samples.size() < PacketSize) {
+            continue;
+        }
+
+        std::lock_guard lock(mutex);
+        queue.push_back(std::exchange(pendingPacket, AudioPacket{}));
+
+        // Rather than adding latency when the client or network can't keep up, drop the oldest audio.
+        const auto maximumQueued = std::max<size_t>(1, inFlightLimit() / PacketDuration);
+        while (queue.size() > maximumQueued) {
+            queue.pop_front();
+            droppedPackets++;
+        }
+
+        condition.notify_one();
+    }
+}
+
+void AudioStream::Private::sendLoop(std::stop_token stopToken)
+{
+    std::unique_lock lock(mutex);
+
+    while (!stopToken.stop_requested()) {
+        // Also wake periodically, so blocks the client never confirmed expire.
+        condition.wait_for(lock, stopToken, ConfirmTimeout / 4, [this]() {
+            expireBlocks(clk::steady_clock::now());
+            return !queue.empty() && PacketDuration * inFlightBlocks < inFlightLimit();
+        });
+
+        if (stopToken.stop_requested() || queue.empty() || PacketDuration * inFlightBlocks >= inFlightLimit()) {
+            continue;
+        }
+
+        auto packet = std::move(queue.front());
+        queue.pop_front();
+
+        const BYTE firstBlock = context->block_no;
+
+        // SendSamples encodes the packet, don't block capture or confirmations while it does.
+        lock.unlock();
+        const auto result = context->SendSamples(context, packet.samples.constData(), FramesPerPacket, packet.timestamp);
+        lock.lock();
+
+        if (result != CHANNEL_RC_OK) {
+            qCDebug(KRDP) << "Could not send audio samples";
+            continue;
+        }
+
+        const auto now = clk::steady_clock::now();
+        for (BYTE blockNo = firstBlock; blockNo != context->block_no; ++blockNo) {
+            auto &block = sentBlocks[blockNo];
+            if (!block.pending) {
+                inFlightBlocks++;
+            }
+            block = SentBlock{packet.captureTime, now, packet.timestamp, true};
+        }
+    }
+}
+
+clk::milliseconds AudioStream::Private::inFlightLimit() const
+{
+    if (roundTrip == clk::microseconds(0)) {
+        return InitialInFlight;
+    }
+
+    const auto limit = roundTrip + roundTripVariation * JitterMultiplier + ClientBuffer;
+    return std::clamp(clk::duration_cast<clk::milliseconds>(limit), MinimumInFlight, MaximumInFlight);
+}
+
+void AudioStream::Private::expireBlocks(clk::steady_clock::time_point now)
+{
+    if (inFlightBlocks == 0) {
+        return;
+    }
+
+    for (auto &block : sentBlocks) {
+        if (block.pending && now - block.sendTime > ConfirmTimeout) {
+            block.pending = false;
+            inFlightBlocks--;
+        }
+    }
+}
+
+AudioStream::AudioStream(RdpConnection *connection)
+    : QObject(nullptr)
+    , d(std::make_unique<Private>())
+{
+    d->connection = connection;
+
+    d->sourceFormat.wFormatTag = WAVE_FORMAT_PCM;
+    d->sourceFormat.nChannels = Channels;
+    d->sourceFormat.nSamplesPerSec = SampleRate;
+    d->sourceFormat.nAvgBytesPerSec = SampleRate * BytesPerFrame;
+    d->sourceFormat.nBlockAlign = BytesPerFrame;
+    d->sourceFormat.wBitsPerSample = 16;
+}
+
+AudioStream::~AudioStream()
+{
+    close();
+}
+
+bool AudioStream::initialize()
+{
+    if (d->initialized) {
+        return true;
+    }
+    // Only try once, a client without audio should not end the session.
+    d->initialized = true;
+
+    auto peer = d->connection->rdpPeer();
+    if (!freerdp_settings_get_bool(peer->context->settings, FreeRDP_AudioPlayback)) {
+        qCDebug(KRDP) << "Client does not support audio playback";
+        return true;
+    }
+
+    auto peerContext = reinterpret_cast<PeerContext *>(peer->context);
+
+    d->context = rdpsnd_server_context_new(peerContext->virtualChannelManager);
+    if (!d->context) {
+        qCWarning(KRDP) << "Failed creating audio playback context";
+        return false;
+    }
+
+    // The formats FreeRDP can encode, these are owned by the context.
+    d->context->num_server_formats = server_rdpsnd_get_formats(&d->context->server_formats);
+    std::stable_sort(d->context->server_formats,
+                     d->context->server_formats + d->context->num_server_formats,
+                     [](const AUDIO_FORMAT &first, const AUDIO_FORMAT &second) {
+                         return formatPreference(first) < formatPreference(second);
+                     });
+
+    d->context->rdpcontext = peer->context;
+    d->context->data = d.get();
+    d->context->use_dynamic_virtual_channel = TRUE;
+    d->context->src_format = &d->sourceFormat;
+    d->context->latency = PacketDuration.count();
+    d->context->Activated = Private::activated;
+    d->context->ConfirmBlock = Private::confirmBlock;
+
+    if (d->context->Initialize(d->context, TRUE) != CHANNEL_RC_OK) {
+        qCWarning(KRDP) << "Could not open audio playback channel";
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void AudioStream::close()
+{
+    d->stopCapture();
+
+    if (d->context) {
+        d->context->Stop(d->context);
+        rdpsnd_server_context_free(d->context);
+        d->context = nullptr;
+    }
+}
+
+std::chrono::milliseconds AudioStream::latency() const
+{
+    std::lock_guard lock(d->mutex);
+    return d->latency;
+}
+
+}
+
+#include "moc_AudioStream.cpp"
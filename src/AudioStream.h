@@ -0,0 +1,60 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+
+#include <QObject>
+
+#include "krdp_export.h"
+
+namespace KRdp
+{
+
+class RdpConnection;
+
+/**
+ * Plays the audio of the local session on the client.
+ *
+ * Audio is captured from the monitor of the default PipeWire sink and sent in
+ * small packets over the dynamic audio playback channel (MS-RDPEA). The format
+ * is negotiated with the client, preferring Opus over AAC over plain PCM.
+ *
+ * Packets are timestamped with the same UTC time of day as the graphics
+ * pipeline frames, see Timestamps, so the client can keep audio and video in
+ * sync. To bound
+ * latency, the amount of audio that is sent but not yet played by the client
+ * is limited based on the measured round trip time and its jitter, and the
+ * oldest audio is dropped when the client can't keep up.
+ */
+class KRDP_EXPORT AudioStream : public QObject
+{
+    Q_OBJECT
+public:
+    explicit AudioStream(RdpConnection *connection);
+    ~AudioStream() override;
+
+    /**
+     * Open the audio playback channel, if the client supports it.
+     *
+     * Capturing starts once the client has activated the channel.
+     */
+    bool initialize();
+    void close();
+
+    /**
+     * The estimated time from capturing audio until the client plays it.
+     *
+     * This is zero until the client has confirmed playing the first packet.
+     */
+    std::chrono::milliseconds latency() const;
+
+private:
+    class Private;
+    const std::unique_ptr<Private> d;
+};
+
+}
@@ -4,10 +4,40 @@
 
 #include "Clipboard.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QPointer>
+#include <QScopeGuard>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QTimer>
+#include <QUrl>
+#include <QtEndian>
+
 #include <freerdp/freerdp.h>
 #include <freerdp/peer.h>
 #include <freerdp/server/cliprdr.h>
+#include <freerdp/utils/cliprdr_utils.h>
+#include <winpr/shell.h>
 
+#include "Clipboard_p.h"
+#include "ClipboardFormats_p.h"
 #include "PeerContext_p.h"
 #include "RdpConnection.h"
 
@@ -18,89 +48,615 @@ using namespace Qt::StringLiterals;
 namespace KRdp
 {
 
-class KRDP_NO_EXPORT Clipboard::Private
+// How long a paste waits for the client to respond. For file contents this is
+// the time between two chunks, not for the whole file.
+constexpr auto ClientDataTimeout = std::chrono::seconds(5);
+
+// Registered clipboard formats use ids from 0xC000, the ids we advertise them with are ours to pick.
+constexpr uint32_t ServerFileListFormatId = 0xC0FF;
+constexpr uint32_t ServerHtmlFormatId = 0xC100;
+constexpr uint32_t ServerPngFormatId = 0xC101;
+constexpr auto FileListFormatName = "FileGroupDescriptorW";
+constexpr auto HtmlFormatName = "HTML Format";
+constexpr auto PngFormatName = "PNG";
+
+static const char *serverFormatName(uint32_t formatId)
+{
+    switch (formatId) {
+    case ServerFileListFormatId:
+        return FileListFormatName;
+    case ServerHtmlFormatId:
+        return HtmlFormatName;
+    case ServerPngFormatId:
+        return PngFormatName;
+    default:
+        return nullptr;
+    }
+}
+
+/**
+ * Convert the system clipboard's data for a format to what is sent to the client.
+ * This is not used for the file list, which depends on more than its data.
+ */
+static QByteArray serverFormatBytes(uint32_t formatId, const QVariant &data)
+{
+    switch (formatId) {
+    case CF_UNICODETEXT: {
+        if (data.typeId() != QMetaType::QString) {
+            return QByteArray();
+        }
+        const auto text = data.toString();
+        // CF_UNICODETEXT requires null-terminated UTF-16LE
+        return QByteArray(reinterpret_cast<const char *>(text.utf16()), (text.length() + 1) * 2);
+    }
+    case ServerHtmlFormatId:
+        return ClipboardFormats::htmlToCfHtml(data.toByteArray());
+    case ServerPngFormatId:
+        return data.toByteArray().size() <= ClipboardFormats::MaximumConversionSize ? data.toByteArray() : QByteArray();
+    case CF_DIB:
+        return ClipboardFormats::imageToDib(data.toByteArray());
+    default:
+        return QByteArray();
+    }
+}
+
+static QString fromNullTerminatedUtf16(const void *data, qsizetype maxLength)
+{
+    auto text = QString::fromUtf16(reinterpret_cast<const char16_t *>(data), maxLength);
+    if (auto end = text.indexOf(QChar(0)); end >= 0) {
+        text.truncate(end);
+    }
+    return text;
+}
+
+/**
+ * Clipboard data of the client that is only transferred when it is read.
+ *
+ * Clients with a large clipboard would otherwise send all of it on every copy,
+ * even if nothing is ever pasted on the server.
+ */
+class KRDP_NO_EXPORT Clipboard::Private::ClientMimeData : public QMimeData
 {
 public:
-    using CliprdrServerContextPtr = std::unique_ptr<CliprdrServerContext, decltype(&cliprdr_server_context_free)>;
+    ClientMimeData(Clipboard *clipboard, const ClientFormats &formats)
+        : m_clipboard(clipboard)
+        , m_formats(formats)
+    {
+    }
 
-    Private(Clipboard *qq)
-        : q(qq)
+    QStringList formats() const override
     {
+        QStringList result;
+        if (m_formats.text) {
+            result << u"text/plain"_s << u"text/plain;charset=utf-8"_s;
+        }
+        if (m_formats.html != 0) {
+            result << u"text/html"_s;
+        }
+        if (m_formats.image != 0) {
+            result << u"image/png"_s;
+        }
+        if (m_formats.fileList != 0) {
+            result << u"text/uri-list"_s;
+        }
+        return result;
     }
 
-    Clipboard *q;
+protected:
+    QVariant retrieveData(const QString &mimeType, QMetaType type) const override
+    {
+        Q_UNUSED(type);
 
-    uint32_t onClientCapabilities(const CLIPRDR_CAPABILITIES *capabilities);
-    uint32_t onClientFormatList(const CLIPRDR_FORMAT_LIST *formatList);
-    uint32_t onClientFormatListResponse(const CLIPRDR_FORMAT_LIST_RESPONSE *formatListResponse);
-    uint32_t onClientFormatDataRequest(const CLIPRDR_FORMAT_DATA_REQUEST *formatDataRequest);
-    uint32_t onClientFormatDataResponse(const CLIPRDR_FORMAT_DATA_RESPONSE *formatDataResponse);
+        if (!formats().contains(mimeType)) {
+            return QVariant();
+        }
 
-    RdpConnection *session;
+        if (mimeType == u"text/uri-list"_s) {
+            if (!m_files && m_clipboard) {
+                // Received files stay around for as long as this is on the clipboard.
+                auto directory = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation) + u"/krdp"_s;
+                QDir().mkpath(directory);
+                m_directory = std::make_unique<QTemporaryDir>(directory + u"/clipboard-XXXXXX"_s);
+                if (m_directory->isValid()) {
+                    m_files = m_clipboard->d->fetchClientFiles(m_formats.fileList, m_directory->path());
+                }
+            }
+            if (!m_files) {
+                return QVariant();
+            }
+
+            QVariantList urls;
+            for (const auto &url : std::as_const(*m_files)) {
+                urls.append(url);
+            }
+            return urls;
+        }
 
-    CliprdrServerContextPtr clipContext = CliprdrServerContextPtr(nullptr, cliprdr_server_context_free);
+        // Pasting the same copy more than once only transfers it once.
+        const auto key = mimeType.startsWith(u"text/plain"_s) ? u"text/plain"_s : mimeType;
+        if (auto itr = m_data.constFind(key); itr != m_data.cend()) {
+            return *itr;
+        }
+        if (!m_clipboard) {
+            return QVariant();
+        }
 
-    bool enabled = false;
-    // mstsc drops a format list sent before its capabilities response; hold until markClientReady()
-    bool clientReady = false;
-    void markClientReady()
-    {
-        if (clientReady) {
-            return;
+        QVariant value;
+        if (key == u"text/html"_s) {
+            if (auto data = m_clipboard->d->fetchClientData(m_formats.html, Conversion::Html)) {
+                value = *data;
+            }
+        } else if (key == u"image/png"_s) {
+            if (auto data = m_clipboard->d->fetchClientData(m_formats.image, m_formats.imageIsDib ? Conversion::Dib : Conversion::None)) {
+                value = *data;
+            }
+        } else if (auto data = m_clipboard->d->fetchClientData(CF_UNICODETEXT)) {
+            // CF_UNICODETEXT is null-terminated UTF-16LE
+            value = fromNullTerminatedUtf16(data->constData(), data->size() / 2);
+        }
+
+        if (value.isValid()) {
+            m_data.insert(key, value);
         }
-        clientReady = true;
-        QMetaObject::invokeMethod(q, &Clipboard::sendServerData, Qt::QueuedConnection);
+        return value;
     }
-    std::unique_ptr<const QMimeData> serverData;
-    std::unique_ptr<QMimeData> clientData;
 
-    template<typename>
-    struct function_arg_trait;
-    template<typename Argument>
-    struct function_arg_trait<uint32_t (Private::*)(Argument)> {
-        typedef Argument argument_t;
-    };
+private:
+    QPointer<Clipboard> m_clipboard;
+    ClientFormats m_formats;
+    mutable QHash<QString, QVariant> m_data;
+    mutable std::optional<QList<QUrl>> m_files;
+    mutable std::unique_ptr<QTemporaryDir> m_directory;
+};
 
-    template<auto func>
-    inline static UINT processInMainThread(Clipboard *clipboard, function_arg_trait<decltype(func)>::argument_t packet)
-    {
-        uint32_t channelState;
-        QMetaObject::invokeMethod(
-            clipboard,
-            [clipboard](function_arg_trait<decltype(func)>::argument_t packet) {
-                return ((*clipboard->d).*func)(packet);
-            },
-            Qt::BlockingQueuedConnection,
-            qReturnArg(channelState),
-            packet);
-        return channelState;
+bool Clipboard::Private::waitForClient()
+{
+    // The client's responses are delivered to this thread, so keep processing
+    // events until they arrive. Clipboard owners are expected to block while
+    // their data is read, the same happens for other clipboard implementations.
+    QPointer<Clipboard> guard(q);
+    QEventLoop loop;
+
+    // Only give up when nothing arrived for a while, a large transfer can take much longer.
+    QTimer stallTimer;
+    auto lastProgress = clientProgress.load();
+    QObject::connect(&stallTimer, &QTimer::timeout, &loop, [this, &loop, &lastProgress]() {
+        const auto progress = clientProgress.load();
+        if (progress == lastProgress) {
+            qCWarning(KRDP) << "Client stopped sending clipboard contents";
+            loop.quit();
+        }
+        lastProgress = progress;
+    });
+    stallTimer.start(ClientDataTimeout);
+
+    clientDataLoop = &loop;
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+
+    if (!guard) {
+        return false;
     }
 
-    static UINT clientCapabilities(CliprdrServerContext *context, const CLIPRDR_CAPABILITIES *capabilities)
-    {
-        return processInMainThread<&Private::onClientCapabilities>(reinterpret_cast<Clipboard *>(context->custom), capabilities);
+    clientDataLoop = nullptr;
+    if (clientDataChangedPending) {
+        clientDataChangedPending = false;
+        // Queued, the data that was just read is still in use until the caller returns.
+        QMetaObject::invokeMethod(q, &Clipboard::clientDataChanged, Qt::QueuedConnection);
     }
+    return true;
+}
 
-    static UINT clientFormatList(CliprdrServerContext *context, const CLIPRDR_FORMAT_LIST *formatList)
+void Clipboard::Private::quitWaitForClient()
+{
+    QMetaObject::invokeMethod(
+        q,
+        [this]() {
+            if (clientDataLoop) {
+                clientDataLoop->quit();
+            }
+        },
+        Qt::QueuedConnection);
+}
+
+std::optional<QByteArray> Clipboard::Private::fetchClientData(uint32_t formatId, Conversion conversion)
+{
+    if (!enabled || clientDataLoop) {
+        return std::nullopt;
+    }
+
+    // Converted in the channel thread when the response arrives.
+    const auto id = nextFormatDataRequestId++;
     {
-        return processInMainThread<&Private::onClientFormatList>(reinterpret_cast<Clipboard *>(context->custom), formatList);
+        std::lock_guard lock(formatDataRequestsMutex);
+        formatDataRequests.push_back(FormatDataRequest{.id = id, .conversion = conversion});
+    }
+    waitingFormatDataRequestId = id;
+
+    CLIPRDR_FORMAT_DATA_REQUEST formatDataRequest{.common = CLIPRDR_HEADER({.msgType = CB_FORMAT_DATA_REQUEST, .msgFlags = 0, .dataLen = 4}),
+                                                  .requestedFormatId = formatId};
+    if (clipContext->ServerFormatDataRequest(clipContext.get(), &formatDataRequest) != CHANNEL_RC_OK) {
+        std::lock_guard lock(formatDataRequestsMutex);
+        std::erase_if(formatDataRequests, [id](const FormatDataRequest &request) {
+            return request.id == id;
+        });
+        waitingFormatDataRequestId = 0;
+        return std::nullopt;
     }
 
-    static UINT clientFormatListResponse(CliprdrServerContext *context, const CLIPRDR_FORMAT_LIST_RESPONSE *formatListResponse)
+    clientFormatData.reset();
+    if (!waitForClient()) {
+        return std::nullopt;
+    }
+    // A response arriving after this belongs to a paste that gave up, it is dropped.
+    waitingFormatDataRequestId = 0;
+
+    if (!clientFormatData) {
+        qCWarning(KRDP) << "Could not get the clipboard contents of the client";
+    }
+    return std::exchange(clientFormatData, std::nullopt);
+}
+
+std::optional<QList<QUrl>> Clipboard::Private::fetchClientFiles(uint32_t formatId, const QString &directory)
+{
+    auto data = fetchClientData(formatId);
+    if (!data) {
+        return std::nullopt;
+    }
+
+    FILEDESCRIPTORW *descriptors = nullptr;
+    UINT32 count = 0;
+    if (cliprdr_parse_file_list(reinterpret_cast<const BYTE *>(data->constData()), data->size(), &descriptors, &count) != CHANNEL_RC_OK) {
+        qCWarning(KRDP) << "Received an invalid file list from the client";
+        return std::nullopt;
+    }
+    const auto freeDescriptors = qScopeGuard([descriptors]() {
+        free(descriptors);
+    });
+
+    const QDir root(directory);
+    QList<QUrl> urls;
+    for (UINT32 i = 0; i < count; ++i) {
+        const auto &descriptor = descriptors[i];
+
+        auto name = fromNullTerminatedUtf16(descriptor.cFileName, std::size(descriptor.cFileName));
+        const auto relativePath = QDir::cleanPath(name.replace(u'\\', u'/'));
+        // Names come from the client, never write outside of the directory.
+        if (relativePath.isEmpty() || QDir::isAbsolutePath(relativePath) || relativePath == u".."_s || relativePath.startsWith(u"../"_s)) {
+            qCWarning(KRDP) << "Ignoring clipboard file with invalid name" << name;
+            continue;
+        }
+
+        const auto path = root.filePath(relativePath);
+        if (descriptor.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            root.mkpath(relativePath);
+        } else {
+            root.mkpath(QFileInfo(relativePath).path());
+
+            std::optional<quint64> size;
+            if (descriptor.dwFlags & FD_FILESIZE) {
+                size = (quint64(descriptor.nFileSizeHigh) << 32) | descriptor.nFileSizeLow;
+            }
+            // Returns false when the clipboard is gone as well, so don't touch anything after that.
+            if (!downloadFile(i, size, path)) {
+                return std::nullopt;
+            }
+        }
+
+        // Only the top level entries go on the clipboard, the rest is contained in them.
+        if (!relativePath.contains(u'/')) {
+            urls.append(QUrl::fromLocalFile(path));
+        }
+    }
+
+    return urls;
+}
+
+bool Clipboard::Private::downloadFile(uint32_t listIndex, std::optional<quint64> size, const QString &path)
+{
+    auto file = std::make_unique<QFile>(path);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+        qCWarning(KRDP) << "Could not write clipboard file" << path << file->errorString();
+        return false;
+    }
+
+    if (size == 0) {
+        return true;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
     {
-        return processInMainThread<&Private::onClientFormatListResponse>(reinterpret_cast<Clipboard *>(context->custom), formatListResponse);
+        std::lock_guard lock(downloadMutex);
+        download = std::make_unique<Download>();
+        download->streamId = nextStreamId++;
+        download->listIndex = listIndex;
+        download->file = std::move(file);
+        download->size = size;
+        download->requested = size ? uint32_t(std::min<quint64>(*size, FileChunkSize)) : FileChunkSize;
+        if (sendFileContentsRequest(*download) != CHANNEL_RC_OK) {
+            download.reset();
+            return false;
+        }
+    }
+
+    if (!waitForClient()) {
+        return false;
+    }
+
+    std::lock_guard lock(downloadMutex);
+    const bool complete = download && download->complete;
+    if (complete) {
+        qCDebug(KRDP) << "Received clipboard file of" << download->received << "bytes in" << timer.elapsed() << "ms";
+    } else {
+        qCWarning(KRDP) << "Could not receive clipboard file" << path;
+    }
+    download.reset();
+    return complete;
+}
+
+UINT Clipboard::Private::sendFileContentsRequest(const Download &download)
+{
+    CLIPRDR_FILE_CONTENTS_REQUEST request = {};
+    request.common.msgType = CB_FILECONTENTS_REQUEST;
+    request.streamId = download.streamId;
+    request.listIndex = download.listIndex;
+    request.dwFlags = FILECONTENTS_RANGE;
+    request.nPositionLow = uint32_t(download.received & 0xFFFFFFFF);
+    request.nPositionHigh = uint32_t(download.received >> 32);
+    request.cbRequested = download.requested;
+    return clipContext->ServerFileContentsRequest(clipContext.get(), &request);
+}
+
+UINT Clipboard::Private::clientFileContentsResponse(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_RESPONSE *fileContentsResponse)
+{
+    auto d = reinterpret_cast<Clipboard *>(context->custom)->d.get();
+
+    std::unique_lock lock(d->downloadMutex);
+    auto download = d->download.get();
+    if (!download || download->finished || fileContentsResponse->streamId != download->streamId) {
+        return CHANNEL_RC_OK;
+    }
+
+    d->clientProgress++;
+
+    const uint32_t length = fileContentsResponse->cbRequested;
+    bool ok = fileContentsResponse->common.msgFlags & CB_RESPONSE_OK;
+    if (ok && length > 0) {
+        ok = fileContentsResponse->requestedData
+            && download->file->write(reinterpret_cast<const char *>(fileContentsResponse->requestedData), length) == qint64(length);
+    }
+
+    if (ok) {
+        download->received += length;
+
+        // Without a known size the end of the file is the first short chunk.
+        const bool shortChunk = length < download->requested;
+        const bool done = download->size ? download->received >= *download->size : shortChunk;
+        if (!done && !shortChunk) {
+            download->requested = download->size ? uint32_t(std::min<quint64>(*download->size - download->received, FileChunkSize)) : FileChunkSize;
+            if (d->sendFileContentsRequest(*download) == CHANNEL_RC_OK) {
+                return CHANNEL_RC_OK;
+            }
+        }
+        download->complete = done;
+    }
+
+    download->finished = true;
+    lock.unlock();
+
+    d->quitWaitForClient();
+    return CHANNEL_RC_OK;
+}
+
+std::vector<uint32_t> Clipboard::Private::serverFormats() const
+{
+    std::vector<uint32_t> formats;
+    if (serverData->hasText()) {
+        formats.push_back(CF_UNICODETEXT);
+    }
+    if (serverData->hasHtml()) {
+        formats.push_back(ServerHtmlFormatId);
+    }
+    if (serverData->hasFormat(u"image/png"_s)) {
+        formats.push_back(ServerPngFormatId);
+        formats.push_back(CF_DIB);
+    }
+    if (serverData->hasUrls() && clientFileClipboard) {
+        formats.push_back(ServerFileListFormatId);
+    }
+    return formats;
+}
+
+void Clipboard::Private::sendFormatList(const std::vector<uint32_t> &formats)
+{
+    std::vector<CLIPRDR_FORMAT> formatList;
+    for (auto formatId : formats) {
+        formatList.push_back(CLIPRDR_FORMAT{.formatId = formatId, .formatName = const_cast<char *>(serverFormatName(formatId))});
     }
 
-    static UINT clientFormatDataRequest(CliprdrServerContext *context, const CLIPRDR_FORMAT_DATA_REQUEST *formatDataRequest)
     {
-        return processInMainThread<&Private::onClientFormatDataRequest>(reinterpret_cast<Clipboard *>(context->custom), formatDataRequest);
+        std::lock_guard lock(sentHashesMutex);
+        sentHashes.clear();
+    }
+    advertisedFormats = formats;
+    serverDataGeneration++;
+
+    // An empty list tells the client there is nothing it can paste any more.
+    CLIPRDR_FORMAT_LIST message = {};
+    message.common.msgType = CB_FORMAT_LIST;
+    message.common.msgFlags = 0;
+    message.numFormats = formatList.size();
+    message.formats = formatList.empty() ? nullptr : formatList.data();
+    clipContext->ServerFormatList(clipContext.get(), &message);
+}
+
+QVariant Clipboard::Private::serverFormatData(uint32_t formatId) const
+{
+    if (!serverData) {
+        return QVariant();
+    }
+
+    switch (formatId) {
+    case CF_UNICODETEXT:
+        return serverData->hasText() ? QVariant(serverData->text()) : QVariant();
+    case ServerHtmlFormatId:
+        return serverData->data(u"text/html"_s);
+    case ServerPngFormatId:
+    case CF_DIB:
+        return serverData->data(u"image/png"_s);
+    case ServerFileListFormatId:
+        return serverData->hasUrls() ? QVariant::fromValue(serverData->urls()) : QVariant();
+    default:
+        return QVariant();
+    }
+}
+
+UINT Clipboard::Private::sendServerFormatData(uint32_t formatId, const QVariant &data)
+{
+    QByteArray formatData;
+    if (formatId == ServerFileListFormatId) {
+        if (data.isValid()) {
+            formatData = serverFileList(data.value<QList<QUrl>>());
+        }
+    } else {
+        formatData = serverFormatBytes(formatId, data);
+        if (!formatData.isEmpty()) {
+            std::lock_guard lock(sentHashesMutex);
+            sentHashes.insert(formatId, ClipboardFormats::contentHash(formatData));
+        }
+    }
+
+    CLIPRDR_FORMAT_DATA_RESPONSE response = {};
+    response.common.msgType = CB_FORMAT_DATA_RESPONSE;
+    response.common.msgFlags = formatData.isEmpty() ? CB_RESPONSE_FAIL : CB_RESPONSE_OK;
+    response.common.dataLen = formatData.size();
+    response.requestedFormatData = formatData.isEmpty() ? nullptr : reinterpret_cast<const BYTE *>(formatData.constData());
+
+    return clipContext->ServerFormatDataResponse(clipContext.get(), &response);
+}
+
+QByteArray Clipboard::Private::serverFileList(const QList<QUrl> &urls)
+{
+    QList<ServerFile> files;
+    auto addFile = [&files](const QFileInfo &info, const QString &name) {
+        // Larger files need huge file support, which is not enabled.
+        if (!info.isDir() && quint64(info.size()) > std::numeric_limits<uint32_t>::max()) {
+            qCWarning(KRDP) << "Not offering clipboard file" << info.filePath() << "as it is too large";
+            return;
+        }
+        files.append(ServerFile{
+            .path = info.absoluteFilePath(),
+            .name = name,
+            .size = info.isDir() ? 0 : quint64(info.size()),
+            .directory = info.isDir(),
+        });
+    };
+
+    for (const auto &url : urls) {
+        if (!url.isLocalFile()) {
+            continue;
+        }
+
+        const QFileInfo info(url.toLocalFile());
+        if (!info.exists()) {
+            continue;
+        }
+
+        addFile(info, info.fileName());
+        if (info.isDir()) {
+            const QDir parent = info.absoluteDir();
+            QDirIterator itr(info.absoluteFilePath(), QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden, QDirIterator::Subdirectories);
+            while (itr.hasNext()) {
+                const auto entry = itr.nextFileInfo();
+                addFile(entry, parent.relativeFilePath(entry.absoluteFilePath()));
+            }
+        }
+    }
+
+    std::vector<FILEDESCRIPTORW> descriptors(files.size());
+    for (qsizetype i = 0; i < files.size(); ++i) {
+        const auto &file = files.at(i);
+        auto &descriptor = descriptors[i];
+        descriptor.dwFlags = FD_ATTRIBUTES | FD_FILESIZE | FD_PROGRESSUI;
+        descriptor.dwFileAttributes = file.directory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+        descriptor.nFileSizeHigh = uint32_t(file.size >> 32);
+        descriptor.nFileSizeLow = uint32_t(file.size & 0xFFFFFFFF);
+
+        auto name = file.name;
+        name.replace(u'/', u'\\');
+        const auto length = std::min<qsizetype>(name.size(), std::size(descriptor.cFileName) - 1);
+        std::copy_n(name.utf16(), length, descriptor.cFileName);
+    }
+
+    BYTE *data = nullptr;
+    UINT32 length = 0;
+    if (cliprdr_serialize_file_list(descriptors.data(), descriptors.size(), &data, &length) != CHANNEL_RC_OK) {
+        qCWarning(KRDP) << "Could not create clipboard file list";
+        return QByteArray();
     }
+    QByteArray result(reinterpret_cast<const char *>(data), length);
+    free(data);
+
+    std::lock_guard lock(serverFilesMutex);
+    serverFiles = std::move(files);
+    openServerFile.reset();
 
-    static UINT clientFormatDataResponse(CliprdrServerContext *context, const CLIPRDR_FORMAT_DATA_RESPONSE *formatDataResponse)
+    return result;
+}
+
+std::optional<QByteArray> Clipboard::Private::readServerFile(const QString &path, quint64 offset, uint32_t length)
+{
+    if (!openServerFile || openServerFile->fileName() != path) {
+        openServerFile = std::make_unique<QFile>(path);
+        if (!openServerFile->open(QIODevice::ReadOnly)) {
+            qCWarning(KRDP) << "Could not read clipboard file" << path << openServerFile->errorString();
+            openServerFile.reset();
+            return std::nullopt;
+        }
+    }
+
+    if (!openServerFile->seek(qint64(offset))) {
+        return std::nullopt;
+    }
+
+    auto data = openServerFile->read(std::min(length, FileChunkSize));
+    if (data.isEmpty() && length > 0 && !openServerFile->atEnd()) {
+        return std::nullopt;
+    }
+    return data;
+}
+
+UINT Clipboard::Private::clientFileContentsRequest(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_REQUEST *fileContentsRequest)
+{
+    auto d = reinterpret_cast<Clipboard *>(context->custom)->d.get();
+
+    std::optional<QByteArray> data;
     {
-        return processInMainThread<&Private::onClientFormatDataResponse>(reinterpret_cast<Clipboard *>(context->custom), formatDataResponse);
+        std::lock_guard lock(d->serverFilesMutex);
+        if (fileContentsRequest->listIndex < quint64(d->serverFiles.size())) {
+            const auto &file = d->serverFiles.at(fileContentsRequest->listIndex);
+            if (fileContentsRequest->dwFlags & FILECONTENTS_SIZE) {
+                const auto size = qToLittleEndian(file.size);
+                data = QByteArray(reinterpret_cast<const char *>(&size), sizeof(size));
+            } else if ((fileContentsRequest->dwFlags & FILECONTENTS_RANGE) && !file.directory) {
+                const auto offset = (quint64(fileContentsRequest->nPositionHigh) << 32) | fileContentsRequest->nPositionLow;
+                data = d->readServerFile(file.path, offset, fileContentsRequest->cbRequested);
+            }
+        }
     }
-};
+
+    CLIPRDR_FILE_CONTENTS_RESPONSE response = {};
+    response.common.msgType = CB_FILECONTENTS_RESPONSE;
+    response.common.msgFlags = data ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
+    response.streamId = fileContentsRequest->streamId;
+    if (data) {
+        response.cbRequested = data->size();
+        response.requestedData = reinterpret_cast<const BYTE *>(data->constData());
+    }
+
+    return d->clipContext->ServerFileContentsResponse(d->clipContext.get(), &response);
+}
 
 Clipboard::Clipboard(RdpConnection *session)
     : QObject(nullptr)
@@ -111,6 +667,9 @@ Clipboard::Clipboard(RdpConnection *session)
 
 Clipboard::~Clipboard()
 {
+    if (d->clientDataLoop) {
+        d->clientDataLoop->quit();
+    }
 }
 
 bool Clipboard::initialize()
@@ -128,8 +687,9 @@ bool Clipboard::initialize()
     }
 
     d->clipContext->useLongFormatNames = TRUE;
-    d->clipContext->streamFileClipEnabled = FALSE;
-    d->clipContext->fileClipNoFilePaths = FALSE;
+    d->clipContext->streamFileClipEnabled = TRUE;
+    // Only file names relative to the copied files are sent, never local paths.
+    d->clipContext->fileClipNoFilePaths = TRUE;
     d->clipContext->canLockClipData = FALSE;
     d->clipContext->hasHugeFileSupport = FALSE;
 
@@ -141,6 +701,8 @@ bool Clipboard::initialize()
     d->clipContext->ClientFormatListResponse = Private::clientFormatListResponse;
     d->clipContext->ClientFormatDataRequest = Private::clientFormatDataRequest;
     d->clipContext->ClientFormatDataResponse = Private::clientFormatDataResponse;
+    d->clipContext->ClientFileContentsRequest = Private::clientFileContentsRequest;
+    d->clipContext->ClientFileContentsResponse = Private::clientFileContentsResponse;
 
     // returns 0 on success
     // https://pub.freerdp.com/api/server_2cliprdr__main_8c.html#ab4e8a28c6b4371c2a5f34e8716ab1e9e
@@ -172,11 +734,14 @@ void Clipboard::close()
         return;
     };
     d->enabled = false;
+    if (d->clientDataLoop) {
+        d->clientDataLoop->quit();
+    }
 }
 
-void Clipboard::setServerData(const QMimeData *data)
+void Clipboard::setServerData(const std::shared_ptr<const QMimeData> &data)
 {
-    d->serverData.reset(data);
+    d->serverData = data;
     QMetaObject::invokeMethod(this, &Clipboard::sendServerData, Qt::QueuedConnection);
 }
 
@@ -195,20 +760,61 @@ void Clipboard::sendServerData()
         return;
     }
 
-    CLIPRDR_FORMAT format = {};
-    format.formatId = CF_UNICODETEXT;
-    format.formatName = nullptr;
+    const auto formats = d->serverFormats();
+
+    QHash<uint32_t, QByteArray> sentHashes;
+    {
+        std::lock_guard lock(d->sentHashesMutex);
+        sentHashes = d->sentHashes;
+    }
+
+    // Unless the client already requested some of the current contents, telling it
+    // about the change costs less than checking whether anything changed.
+    const bool hasFileList = std::find(formats.cbegin(), formats.cend(), ServerFileListFormatId) != formats.cend();
+    if (formats != d->advertisedFormats || sentHashes.isEmpty() || hasFileList) {
+        d->sendFormatList(formats);
+        return;
+    }
+
+    // Compare what the client has with the new contents, so copying the same
+    // thing again doesn't make the client transfer it again. Reading the system
+    // clipboard needs to happen here, converting and hashing it does not.
+    QHash<uint32_t, QVariant> data;
+    for (auto itr = sentHashes.cbegin(); itr != sentHashes.cend(); ++itr) {
+        data.insert(itr.key(), d->serverFormatData(itr.key()));
+    }
 
-    CLIPRDR_FORMAT_LIST formatList = {};
-    formatList.common.msgType = CB_FORMAT_LIST;
-    formatList.common.msgFlags = 0;
-    formatList.numFormats = 1;
-    formatList.formats = &format;
-    d->clipContext->ServerFormatList(d->clipContext.get(), &formatList);
+    const auto generation = ++d->serverDataGeneration;
+    QThreadPool::globalInstance()->start([guard = QPointer(this), generation, data, sentHashes, formats]() {
+        bool unchanged = true;
+        for (auto itr = sentHashes.cbegin(); itr != sentHashes.cend() && unchanged; ++itr) {
+            unchanged = ClipboardFormats::contentHash(serverFormatBytes(itr.key(), data.value(itr.key()))) == itr.value();
+        }
+
+        // The pointer is only checked in the main thread, where the clipboard is destroyed.
+        QMetaObject::invokeMethod(
+            QCoreApplication::instance(),
+            [guard, generation, unchanged, formats]() {
+                if (!guard || guard->d->serverDataGeneration != generation) {
+                    return;
+                }
+                if (unchanged) {
+                    qCDebug(KRDP) << "Clipboard contents did not change, not sending them again";
+                    return;
+                }
+                guard->d->sendFormatList(formats);
+            },
+            Qt::QueuedConnection);
+    });
 }
 
-uint32_t Clipboard::Private::onClientCapabilities(const CLIPRDR_CAPABILITIES *)
+uint32_t Clipboard::Private::onClientCapabilities(const CLIPRDR_CAPABILITIES *capabilities)
 {
+    if (capabilities->cCapabilitiesSets > 0 && capabilities->capabilitySets->capabilitySetType == CB_CAPSTYPE_GENERAL) {
+        auto general = reinterpret_cast<const CLIPRDR_GENERAL_CAPABILITY_SET *>(capabilities->capabilitySets);
+        clientFileClipboard = general->generalFlags & CB_STREAM_FILECLIP_ENABLED;
+    }
+
     // covers copy-out with no prior copy-in: mstsc sends no format list when its clipboard starts empty
     markClientReady();
     return CHANNEL_RC_OK;
@@ -219,23 +825,66 @@ uint32_t Clipboard::Private::onClientFormatList(const CLIPRDR_FORMAT_LIST *forma
     // fallback readiness signal for clients that reach us with a format list first
     markClientReady();
 
-    for (uint32_t i = 0; i < formatList->numFormats; ++i) {
-        auto format = formatList->formats[i];
+    // The client no longer has what the server advertised, so the next copy
+    // on the server has to be announced even if its contents are the same.
+    {
+        std::lock_guard lock(sentHashesMutex);
+        sentHashes.clear();
+    }
+    advertisedFormats.clear();
+    // Drops a pending check that would still compare against the old hashes.
+    serverDataGeneration++;
 
+    ClientFormats formats;
+    uint32_t dibFormatId = 0;
+    for (uint32_t i = 0; i < formatList->numFormats; ++i) {
+        const auto &format = formatList->formats[i];
         switch (format.formatId) {
         case CF_TEXT:
         case CF_UNICODETEXT:
-        case CF_OEMTEXT: {
-            CLIPRDR_FORMAT_DATA_REQUEST formatDataRequest{.common = CLIPRDR_HEADER({.msgType = CB_FORMAT_DATA_REQUEST, .msgFlags = 0, .dataLen = 4}),
-                                                          .requestedFormatId = CF_UNICODETEXT};
-            clipContext->ServerFormatDataRequest(clipContext.get(), &formatDataRequest);
+        case CF_OEMTEXT:
+            formats.text = true;
+            break;
+        case CF_DIB:
+        case CF_DIBV5:
+            // CF_DIBV5 keeps the alpha channel, prefer it.
+            if (dibFormatId != CF_DIBV5) {
+                dibFormatId = format.formatId;
+            }
             break;
-        }
         default:
+            if (!format.formatName) {
+                break;
+            }
+            if (qstrcmp(format.formatName, HtmlFormatName) == 0) {
+                formats.html = format.formatId;
+            } else if (qstrcmp(format.formatName, PngFormatName) == 0) {
+                formats.image = format.formatId;
+            } else if (clientFileClipboard && qstrcmp(format.formatName, FileListFormatName) == 0) {
+                formats.fileList = format.formatId;
+            }
             break;
         }
     }
 
+    // PNG needs no conversion, so only fall back to a bitmap without it.
+    if (formats.image == 0 && dibFormatId != 0) {
+        formats.image = dibFormatId;
+        formats.imageIsDib = true;
+    }
+
+    // Only remember what is available, it is requested once something is pasted.
+    if (formats.text || formats.html != 0 || formats.image != 0 || formats.fileList != 0) {
+        clientData = std::make_unique<ClientMimeData>(q, formats);
+        if (clientDataLoop) {
+            // Data of the previous copy is being read further up the stack,
+            // replacing it on the system clipboard now would destroy it.
+            clientDataChangedPending = true;
+        } else {
+            Q_EMIT q->clientDataChanged();
+        }
+    }
+
     // Acknowledge the client's format list (required by CLIPRDR protocol)
     CLIPRDR_FORMAT_LIST_RESPONSE response = {};
     response.common.msgType = CB_FORMAT_LIST_RESPONSE;
@@ -250,53 +899,4 @@ uint32_t Clipboard::Private::onClientFormatListResponse(const CLIPRDR_FORMAT_LIS
     Q_UNUSED(formatListResponse);
     return CHANNEL_RC_OK;
 }
-
-uint32_t Clipboard::Private::onClientFormatDataRequest(const CLIPRDR_FORMAT_DATA_REQUEST *formatDataRequest)
-{
-    if (!serverData || formatDataRequest->requestedFormatId != CF_UNICODETEXT) {
-        CLIPRDR_FORMAT_DATA_RESPONSE response = {};
-        response.common.msgType = CB_FORMAT_DATA_RESPONSE;
-        response.common.msgFlags = CB_RESPONSE_FAIL;
-        response.common.dataLen = 0;
-        response.requestedFormatData = nullptr;
-        clipContext->ServerFormatDataResponse(clipContext.get(), &response);
-        return CHANNEL_RC_OK;
-    }
-
-    auto text = serverData->text();
-    // CF_UNICODETEXT requires null-terminated UTF-16LE
-    QByteArray utf16Data(reinterpret_cast<const char *>(text.utf16()), (text.length() + 1) * 2);
-
-    CLIPRDR_FORMAT_DATA_RESPONSE response = {};
-    response.common.msgType = CB_FORMAT_DATA_RESPONSE;
-    response.common.msgFlags = CB_RESPONSE_OK;
-    response.common.dataLen = utf16Data.size();
-    response.requestedFormatData = reinterpret_cast<const BYTE *>(utf16Data.constData());
-
-    clipContext->ServerFormatDataResponse(clipContext.get(), &response);
-
-    return CHANNEL_RC_OK;
-}
-
-uint32_t Clipboard::Private::onClientFormatDataResponse(const CLIPRDR_FORMAT_DATA_RESPONSE *formatDataResponse)
-{
-    if (!(formatDataResponse->common.msgFlags & CB_RESPONSE_OK)) {
-        return CHANNEL_RC_OK;
-    }
-
-    // dataLen is unsigned; guard before subtracting the null terminator or a short response underflows
-    if (formatDataResponse->common.dataLen < 2 || !formatDataResponse->requestedFormatData) {
-        clientData.reset();
-        Q_EMIT q->clientDataChanged();
-        return CHANNEL_RC_OK; // empty or malformed
-    }
-    const int nCharacters = int(formatDataResponse->common.dataLen / 2 - 1); // each char16_t is 2 bytes, plus null terminator
-
-    clientData.reset(new QMimeData());
-
-    clientData->setText(QString::fromUtf16(reinterpret_cast<const char16_t *>(formatDataResponse->requestedFormatData), nCharacters));
-    Q_EMIT q->clientDataChanged();
-
-    return CHANNEL_RC_OK;
-}
 }
@@ -10,10 +10,13 @@
 #include <freerdp/freerdp.h>
 #include <freerdp/server/cliprdr.h>
 
+#include <memory>
 #include <mutex>
 
 #include "krdp_export.h"
 
+class ClipboardTest;
+
 namespace KRdp
 {
 
@@ -32,12 +35,27 @@ public:
 
     bool enabled();
 
-    void setServerData(const QMimeData *data);
+    /**
+     * Offer the system's clipboard to the client.
+     *
+     * Only the formats of the data are sent to the client, its contents are
+     * only read once the client pastes.
+     */
+    void setServerData(const std::shared_ptr<const QMimeData> &data);
 
     Q_SIGNAL void clientDataChanged();
+    /**
+     * The client's clipboard.
+     *
+     * The returned data only knows which formats are available. Its contents
+     * are requested from the client when they are read, which blocks until
+     * the client responds.
+     */
     std::unique_ptr<QMimeData> getClipboard() const;
 
 private:
+    friend class ::ClipboardTest;
+
     void sendServerData();
 
     class Private;
@@ -0,0 +1,179 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include "ClipboardFormats_p.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QImage>
+#include <QtEndian>
+
+using namespace Qt::StringLiterals;
+
+namespace KRdp
+{
+
+namespace ClipboardFormats
+{
+
+static QByteArray encodePng(const QImage &image)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, "PNG")) {
+        return QByteArray();
+    }
+    return buffer.data();
+}
+
+QByteArray htmlToCfHtml(const QByteArray &html)
+{
+    if (html.isEmpty() || html.size() > MaximumConversionSize) {
+        return QByteArray();
+    }
+
+    const auto startMarker = "<!--StartFragment-->"_ba;
+    const auto endMarker = "<!--EndFragment-->"_ba;
+
+    // The contents of the body are the fragment, or everything when there is no body.
+    const auto lower = html.toLower();
+    const auto bodyStart = lower.indexOf("<body");
+    const auto bodyTagEnd = bodyStart >= 0 ? lower.indexOf('>', bodyStart) : -1;
+    const auto bodyEnd = lower.lastIndexOf("</body");
+
+    QByteArray document;
+    qsizetype fragmentStart = 0;
+    qsizetype fragmentLength = 0;
+    if (bodyTagEnd >= 0 && bodyEnd > bodyTagEnd) {
+        fragmentLength = bodyEnd - bodyTagEnd - 1;
+        document = html.left(bodyTagEnd + 1) + startMarker;
+        fragmentStart = document.size();
+        document += html.mid(bodyTagEnd + 1, fragmentLength) + endMarker + html.mid(bodyEnd);
+    } else {
+        fragmentLength = html.size();
+        document = "<html><body>"_ba + startMarker;
+        fragmentStart = document.size();
+        document += html + endMarker + "</body></html>"_ba;
+    }
+
+    // The header contains offsets into the data including the header itself. Its
+    // fields have a fixed width, so its size does not depend on their values.
+    auto header = [](qsizetype startHtml, qsizetype endHtml, qsizetype startFragment, qsizetype endFragment) {
+        auto offset = [](qsizetype value) {
+            return QByteArray::number(value).rightJustified(10, '0');
+        };
+        return "Version:0.9\r\nStartHTML:"_ba + offset(startHtml) + "\r\nEndHTML:"_ba + offset(endHtml) + "\r\nStartFragment:"_ba + offset(startFragment)
+            + "\r\nEndFragment:"_ba + offset(endFragment) + "\r\n"_ba;
+    };
+    const auto headerSize = header(0, 0, 0, 0).size();
+
+    return header(headerSize, headerSize + document.size(), headerSize + fragmentStart, headerSize + fragmentStart + fragmentLength) + document;
+}
+
+QByteArray cfHtmlToHtml(const QByteArray &cfHtml)
+{
+    if (cfHtml.isEmpty() || cfHtml.size() > MaximumConversionSize) {
+        return QByteArray();
+    }
+
+    auto headerValue = [&cfHtml](QByteArrayView name) -> qsizetype {
+        const auto start = cfHtml.indexOf(name);
+        if (start < 0) {
+            return -1;
+        }
+        const auto valueStart = start + name.size();
+        const auto valueEnd = cfHtml.indexOf('\n', valueStart);
+        bool ok = false;
+        const auto value = cfHtml.mid(valueStart, valueEnd < 0 ? -1 : valueEnd - valueStart).trimmed().toLongLong(&ok);
+        return ok ? value : -1;
+    };
+
+    auto start = headerValue("StartFragment:");
+    auto end = headerValue("EndFragment:");
+    if (start < 0 || end < 0) {
+        start = headerValue("StartHTML:");
+        end = headerValue("EndHTML:");
+    }
+
+    if (start < 0 || end <= start || end > cfHtml.size()) {
+        return QByteArray();
+    }
+
+    return cfHtml.mid(start, end - start);
+}
+
+QByteArray dibToPng(const QByteArray &dib)
+{
+    // Size of a BITMAPINFOHEADER, later versions of the header are larger.
+    constexpr quint32 InfoHeaderSize = 40;
+    constexpr quint32 FileHeaderSize = 14;
+    constexpr quint32 BiBitfields = 3;
+
+    if (dib.size() < qsizetype(InfoHeaderSize) || dib.size() > MaximumConversionSize) {
+        return QByteArray();
+    }
+
+    const auto data = reinterpret_cast<const uchar *>(dib.constData());
+    const auto headerSize = qFromLittleEndian<quint32>(data);
+    if (headerSize < InfoHeaderSize || headerSize > quint64(dib.size())) {
+        return QByteArray();
+    }
+
+    const auto bitCount = qFromLittleEndian<quint16>(data + 14);
+    const auto compression = qFromLittleEndian<quint32>(data + 16);
+    const auto colorsUsed = qFromLittleEndian<quint32>(data + 32);
+
+    // A DIB is a BMP file without the file header, which contains the offset
+    // of the pixel data. Color masks follow a BITMAPINFOHEADER, later versions
+    // of the header contain them, then comes the color table.
+    const quint64 masksSize = headerSize == InfoHeaderSize && compression == BiBitfields ? 12 : 0;
+    const quint64 colors = colorsUsed > 0 ? colorsUsed : (bitCount <= 8 ? 1u << bitCount : 0);
+    const quint64 pixelOffset = FileHeaderSize + headerSize + masksSize + colors * 4;
+    if (pixelOffset > FileHeaderSize + quint64(dib.size())) {
+        return QByteArray();
+    }
+
+    QByteArray bmp(FileHeaderSize, 0);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    qToLittleEndian<quint32>(quint32(FileHeaderSize + dib.size()), bmp.data() + 2);
+    qToLittleEndian<quint32>(quint32(pixelOffset), bmp.data() + 10);
+    bmp.append(dib);
+
+    QImage image;
+    if (!image.loadFromData(bmp, "BMP")) {
+        return QByteArray();
+    }
+    return encodePng(image);
+}
+
+QByteArray imageToDib(const QByteArray &image)
+{
+    // Size of the file header that a BMP file has and a DIB doesn't.
+    constexpr qsizetype FileHeaderSize = 14;
+
+    if (image.isEmpty() || image.size() > MaximumConversionSize) {
+        return QByteArray();
+    }
+
+    QImage decoded;
+    if (!decoded.loadFromData(image)) {
+        return QByteArray();
+    }
+
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    if (!decoded.save(&buffer, "BMP") || buffer.size() <= FileHeaderSize) {
+        return QByteArray();
+    }
+    return buffer.data().mid(FileHeaderSize);
+}
+
+QByteArray contentHash(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+}
+
+}
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <QByteArray>
+
+namespace KRdp
+{
+
+/**
+ * Conversions between Windows clipboard formats and their MIME equivalents.
+ *
+ * These can be expensive for large data, so they are meant to be used outside
+ * of the main thread. All of them return an empty array when the data is
+ * invalid or larger than MaximumConversionSize.
+ */
+namespace ClipboardFormats
+{
+
+// Largest HTML or image data that is converted.
+constexpr qsizetype MaximumConversionSize = 64 * 1024 * 1024;
+
+/**
+ * Wrap an HTML document or fragment in the "HTML Format" header.
+ */
+QByteArray htmlToCfHtml(const QByteArray &html);
+
+/**
+ * Extract the fragment from "HTML Format" data.
+ */
+QByteArray cfHtmlToHtml(const QByteArray &cfHtml);
+
+/**
+ * Convert a CF_DIB or CF_DIBV5 bitmap to PNG.
+ */
+QByteArray dibToPng(const QByteArray &dib);
+
+/**
+ * Convert an image in any format Qt can read to a CF_DIB bitmap.
+ */
+QByteArray imageToDib(const QByteArray &image);
+
+/**
+ * Hash identifying clipboard contents, to tell whether they changed.
+ */
+QByteArray contentHash(const QByteArray &data);
+}
+
+}
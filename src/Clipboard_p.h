@@ -0,0 +1,277 @@
+// SPDX-FileCopyrightText: 2024 Akseli Lahtinen <akselmo@akselmo.dev>
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <QEventLoop>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QUrl>
+#include <QVariant>
+
+#include <freerdp/server/cliprdr.h>
+
+#include "Clipboard.h"
+#include "ClipboardFormats_p.h"
+
+namespace KRdp
+{
+
+// File contents are transferred in ranges of at most this size, so only one
+// chunk per transfer is held in memory regardless of the size of the file.
+constexpr uint32_t FileChunkSize = 1024 * 1024;
+
+class KRDP_TESTS_EXPORT Clipboard::Private
+{
+public:
+    class ClientMimeData;
+
+    using CliprdrServerContextPtr = std::unique_ptr<CliprdrServerContext, decltype(&cliprdr_server_context_free)>;
+
+    Private(Clipboard *qq)
+        : q(qq)
+    {
+    }
+
+    Clipboard *q;
+
+    uint32_t onClientCapabilities(const CLIPRDR_CAPABILITIES *capabilities);
+    uint32_t onClientFormatList(const CLIPRDR_FORMAT_LIST *formatList);
+    uint32_t onClientFormatListResponse(const CLIPRDR_FORMAT_LIST_RESPONSE *formatListResponse);
+
+    RdpConnection *session;
+
+    CliprdrServerContextPtr clipContext = CliprdrServerContextPtr(nullptr, cliprdr_server_context_free);
+
+    bool enabled = false;
+    // mstsc drops a format list sent before its capabilities response; hold until markClientReady()
+    bool clientReady = false;
+    void markClientReady()
+    {
+        if (clientReady) {
+            return;
+        }
+        clientReady = true;
+        QMetaObject::invokeMethod(q, &Clipboard::sendServerData, Qt::QueuedConnection);
+    }
+    // Whether the client supports copying files, from its capabilities.
+    bool clientFileClipboard = false;
+
+    std::shared_ptr<const QMimeData> serverData;
+    std::unique_ptr<QMimeData> clientData;
+
+    // Formats of the client's clipboard, by the ids the client uses for them.
+    struct ClientFormats {
+        bool text = false;
+        uint32_t html = 0;
+        uint32_t image = 0;
+        bool imageIsDib = false;
+        uint32_t fileList = 0;
+    };
+
+    // How the data the client sends is converted before it goes on the system clipboard.
+    enum class Conversion {
+        None,
+        Html,
+        Dib,
+    };
+
+    // Set while waiting for the client, so the wait can be ended early.
+    QEventLoop *clientDataLoop = nullptr;
+    // Set when the client's clipboard changed while waiting for it, announced once the wait ended.
+    bool clientDataChangedPending = false;
+    // Increased for every response of the client, to tell a slow transfer from a stalled one.
+    std::atomic<quint64> clientProgress = 0;
+    std::optional<QByteArray> clientFormatData;
+
+    // Format data requests sent to the client that it did not answer yet, oldest
+    // first. Responses carry no id, but the client answers every request in
+    // order, so a response belongs to the oldest one. A request that timed out
+    // stays here until its late response arrives, which is then dropped.
+    struct FormatDataRequest {
+        quint64 id = 0;
+        Conversion conversion = Conversion::None;
+    };
+    std::mutex formatDataRequestsMutex;
+    std::deque<FormatDataRequest> formatDataRequests;
+    quint64 nextFormatDataRequestId = 1;
+    // The request fetchClientData() is waiting for, 0 when there is none.
+    std::atomic<quint64> waitingFormatDataRequestId = 0;
+
+    bool waitForClient();
+    void quitWaitForClient();
+    std::optional<QByteArray> fetchClientData(uint32_t formatId, Conversion conversion = Conversion::None);
+    std::optional<QList<QUrl>> fetchClientFiles(uint32_t formatId, const QString &directory);
+
+    // File contents being received from the client. Chunks are written to the
+    // file in the channel thread as they arrive.
+    struct Download {
+        uint32_t streamId = 0;
+        uint32_t listIndex = 0;
+        std::unique_ptr<QFile> file;
+        std::optional<quint64> size;
+        quint64 received = 0;
+        uint32_t requested = 0;
+        bool finished = false;
+        bool complete = false;
+    };
+    std::mutex downloadMutex;
+    std::unique_ptr<Download> download;
+    uint32_t nextStreamId = 1;
+    bool downloadFile(uint32_t listIndex, std::optional<quint64> size, const QString &path);
+    UINT sendFileContentsRequest(const Download &download);
+
+    // Files from the last file list sent to the client, which it can request
+    // the contents of. Read in the channel thread.
+    struct ServerFile {
+        QString path;
+        QString name;
+        quint64 size = 0;
+        bool directory = false;
+    };
+    std::mutex serverFilesMutex;
+    QList<ServerFile> serverFiles;
+    // Kept open as clients request a file in consecutive ranges.
+    std::unique_ptr<QFile> openServerFile;
+
+    // Formats in the last format list sent to the client.
+    std::vector<uint32_t> advertisedFormats;
+    // Hashes of the data the client requested since then, by format. If the
+    // system clipboard changes to the same contents the client already has
+    // them, so it doesn't need to be told about the change.
+    std::mutex sentHashesMutex;
+    QHash<uint32_t, QByteArray> sentHashes;
+    // Increased for every change of the system clipboard, to drop outdated checks.
+    quint64 serverDataGeneration = 0;
+
+    std::vector<uint32_t> serverFormats() const;
+    void sendFormatList(const std::vector<uint32_t> &formats);
+    QVariant serverFormatData(uint32_t formatId) const;
+    UINT sendServerFormatData(uint32_t formatId, const QVariant &data);
+    QByteArray serverFileList(const QList<QUrl> &urls);
+    std::optional<QByteArray> readServerFile(const QString &path, quint64 offset, uint32_t length);
+
+    template<typename>
+    struct function_arg_trait;
+    template<typename Argument>
+    struct function_arg_trait<uint32_t (Private::*)(Argument)> {
+        typedef Argument argument_t;
+    };
+
+    template<auto func>
+    inline static UINT processInMainThread(Clipboard *clipboard, function_arg_trait<decltype(func)>::argument_t packet)
+    {
+        uint32_t channelState;
+        QMetaObject::invokeMethod(
+            clipboard,
+            [clipboard](function_arg_trait<decltype(func)>::argument_t packet) {
+                return ((*clipboard->d).*func)(packet);
+            },
+            Qt::BlockingQueuedConnection,
+            qReturnArg(channelState),
+            packet);
+        return channelState;
+    }
+
+    static UINT clientCapabilities(CliprdrServerContext *context, const CLIPRDR_CAPABILITIES *capabilities)
+    {
+        return processInMainThread<&Private::onClientCapabilities>(reinterpret_cast<Clipboard *>(context->custom), capabilities);
+    }
+
+    static UINT clientFormatList(CliprdrServerContext *context, const CLIPRDR_FORMAT_LIST *formatList)
+    {
+        return processInMainThread<&Private::onClientFormatList>(reinterpret_cast<Clipboard *>(context->custom), formatList);
+    }
+
+    static UINT clientFormatListResponse(CliprdrServerContext *context, const CLIPRDR_FORMAT_LIST_RESPONSE *formatListResponse)
+    {
+        return processInMainThread<&Private::onClientFormatListResponse>(reinterpret_cast<Clipboard *>(context->custom), formatListResponse);
+    }
+
+    // The callbacks below carry clipboard contents. Only what needs the system
+    // clipboard is done in the main thread, payloads are handled in the
+    // channel thread so large transfers don't block either of them for long.
+
+    static UINT clientFormatDataRequest(CliprdrServerContext *context, const CLIPRDR_FORMAT_DATA_REQUEST *formatDataRequest)
+    {
+        auto clipboard = reinterpret_cast<Clipboard *>(context->custom);
+        const auto formatId = formatDataRequest->requestedFormatId;
+
+        QVariant data;
+        QMetaObject::invokeMethod(
+            clipboard,
+            [clipboard, formatId]() {
+                return clipboard->d->serverFormatData(formatId);
+            },
+            Qt::BlockingQueuedConnection,
+            qReturnArg(data));
+
+        return clipboard->d->sendServerFormatData(formatId, data);
+    }
+
+    static UINT clientFormatDataResponse(CliprdrServerContext *context, const CLIPRDR_FORMAT_DATA_RESPONSE *formatDataResponse)
+    {
+        auto clipboard = reinterpret_cast<Clipboard *>(context->custom);
+
+        std::optional<FormatDataRequest> request;
+        {
+            std::lock_guard lock(clipboard->d->formatDataRequestsMutex);
+            if (!clipboard->d->formatDataRequests.empty()) {
+                request = clipboard->d->formatDataRequests.front();
+                clipboard->d->formatDataRequests.pop_front();
+            }
+        }
+        if (!request || request->id != clipboard->d->waitingFormatDataRequestId) {
+            // Not requested, or a paste that already gave up on it. Its data must not end up in a later paste.
+            return CHANNEL_RC_OK;
+        }
+
+        std::optional<QByteArray> data;
+        if ((formatDataResponse->common.msgFlags & CB_RESPONSE_OK) && formatDataResponse->requestedFormatData) {
+            data = QByteArray(reinterpret_cast<const char *>(formatDataResponse->requestedFormatData), formatDataResponse->common.dataLen);
+
+            switch (request->conversion) {
+            case Conversion::None:
+                break;
+            case Conversion::Html:
+                data = ClipboardFormats::cfHtmlToHtml(*data);
+                break;
+            case Conversion::Dib:
+                data = ClipboardFormats::dibToPng(*data);
+                break;
+            }
+            if (data->isEmpty()) {
+                data.reset();
+            }
+        }
+        clipboard->d->clientProgress++;
+
+        QMetaObject::invokeMethod(
+            clipboard,
+            [clipboard, id = request->id, data = std::move(data)]() {
+                auto d = clipboard->d.get();
+                if (!d->clientDataLoop || d->waitingFormatDataRequestId != id) {
+                    // Nobody is waiting for it any more, for example because the request timed out.
+                    return;
+                }
+                d->clientFormatData = data;
+                d->clientDataLoop->quit();
+            },
+            Qt::QueuedConnection);
+
+        return CHANNEL_RC_OK;
+    }
+
+    static UINT clientFileContentsRequest(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_REQUEST *fileContentsRequest);
+    static UINT clientFileContentsResponse(CliprdrServerContext *context, const CLIPRDR_FILE_CONTENTS_RESPONSE *fileContentsResponse);
+};
+}
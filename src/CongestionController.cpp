@@ -0,0 +1,205 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+
+#include "CongestionController.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "krdp_logging.h"
+
+namespace KRdp
+{
+
+namespace clk = std::chrono;
+
+// Queuing delay above the high threshold signals congestion, it clears below the low one.
+constexpr auto QueuingDelayHigh = clk::milliseconds(60);
+constexpr auto QueuingDelayLow = clk::milliseconds(30);
+// The thresholds are raised on links with a lot of jitter, so noise is not mistaken for queuing.
+constexpr int JitterMultiplier = 2;
+constexpr uint32_t QueueDepthHigh = 3;
+constexpr uint32_t QueueDepthLow = 1;
+// Fraction of produced frames that may be dropped before that counts as congestion.
+constexpr double DropRatioHigh = 0.25;
+// Congestion needs to be signalled this many times in a row before leaving Steady.
+constexpr int CongestionConfirmUpdates = 2;
+
+constexpr double DecreaseFactor = 0.75;
+// The level never drops below this, so recovery starts from outputs close to their
+// minimum instead of spending a long time raising a level that changes nothing.
+constexpr double MinimumLevel = 0.05;
+constexpr auto DecreaseInterval = clk::milliseconds(500);
+constexpr double IncreaseStep = 0.05;
+constexpr auto IncreaseInterval = clk::seconds(1);
+constexpr auto RecoveryHoldTime = clk::seconds(2);
+
+// Levels at which the controller starts trading frame rate and size instead of quality.
+constexpr double FrameRateLevel = 0.5;
+constexpr double ScaleLevel = 0.25;
+
+constexpr int MinimumFrameRate = 10;
+constexpr quint8 MinimumQuality = 30;
+constexpr double MinimumScale = 0.5;
+// Scale is changed in steps, as every change requires resetting the surface.
+constexpr double ScaleStep = 0.125;
+
+constexpr qsizetype MinimumInFlightWindow = 2;
+// Never buffer more than this much video.
+constexpr double LatencyBudgetSec = 1.0;
+
+CongestionController::~CongestionController() = default;
+
+DelayBasedCongestionController::DelayBasedCongestionController() = default;
+
+void DelayBasedCongestionController::setLimits(int maximumFrameRate, quint8 maximumQuality)
+{
+    m_maximumFrameRate = std::max(1, maximumFrameRate);
+    m_maximumQuality = maximumQuality;
+}
+
+DelayBasedCongestionController::State DelayBasedCongestionController::state() const
+{
+    return m_state;
+}
+
+double DelayBasedCongestionController::level() const
+{
+    return m_level;
+}
+
+CongestionController::Outputs DelayBasedCongestionController::update(const Inputs &inputs)
+{
+    const bool haveRtt = inputs.rtt > clk::milliseconds(0) && inputs.minimumRtt > clk::milliseconds(0);
+    if (m_state == State::Startup) {
+        if (!haveRtt) {
+            return outputsForLevel(inputs);
+        }
+        m_state = State::Steady;
+        m_lastLevelChange = inputs.now;
+    }
+
+    const bool congested = haveRtt && isCongested(inputs);
+    if (congested) {
+        m_lastCongestion = inputs.now;
+        m_congestedUpdates++;
+    } else {
+        m_congestedUpdates = 0;
+    }
+
+    const auto decreaseInterval = std::max<clk::steady_clock::duration>(DecreaseInterval, inputs.rtt * 2);
+
+    switch (m_state) {
+    case State::Startup:
+        break;
+    case State::Steady:
+    case State::Recovering:
+        if (m_congestedUpdates >= CongestionConfirmUpdates || (m_state == State::Recovering && congested)) {
+            m_state = State::Congested;
+            m_level = std::max(MinimumLevel, m_level * DecreaseFactor);
+            m_lastLevelChange = inputs.now;
+            qCDebug(KRDP) << "Congestion detected, reducing video level to" << m_level;
+        } else if (m_state == State::Recovering && inputs.now - m_lastLevelChange >= IncreaseInterval) {
+            m_level = std::min(1.0, m_level + IncreaseStep);
+            m_lastLevelChange = inputs.now;
+            if (m_level >= 1.0) {
+                m_state = State::Steady;
+            }
+        }
+        break;
+    case State::Congested:
+        if (congested) {
+            if (inputs.now - m_lastLevelChange >= decreaseInterval) {
+                m_level = std::max(MinimumLevel, m_level * DecreaseFactor);
+                m_lastLevelChange = inputs.now;
+            }
+        } else if (inputs.now - m_lastCongestion >= RecoveryHoldTime) {
+            m_state = State::Recovering;
+            m_lastLevelChange = inputs.now;
+        }
+        break;
+    }
+
+    return outputsForLevel(inputs);
+}
+
+bool DelayBasedCongestionController::isCongested(const Inputs &inputs)
+{
+    const auto queuingDelay = inputs.rtt - std::min(inputs.rtt, inputs.minimumRtt);
+    const auto jitterAllowance = inputs.jitter * JitterMultiplier;
+
+    const bool delayHigh = queuingDelay > std::max<clk::milliseconds>(QueuingDelayHigh, jitterAllowance);
+    const bool delayLow = queuingDelay < std::max<clk::milliseconds>(QueuingDelayLow, jitterAllowance / 2);
+    const bool queueHigh = inputs.queueDepth > QueueDepthHigh;
+    const bool queueLow = inputs.queueDepth <= QueueDepthLow;
+
+    bool dropsHigh = false;
+    if (inputs.droppedFrames > m_lastDroppedFrames && m_lastDroppedFramesTime != clk::steady_clock::time_point{}) {
+        const double elapsed = clk::duration<double>(inputs.now - m_lastDroppedFramesTime).count();
+        const double dropRate = elapsed > 0.0 ? (inputs.droppedFrames - m_lastDroppedFrames) / elapsed : 0.0;
+        dropsHigh = dropRate > inputs.producerFrameRate * DropRatioHigh;
+    }
+    m_lastDroppedFrames = inputs.droppedFrames;
+    m_lastDroppedFramesTime = inputs.now;
+
+    if (delayHigh || queueHigh || dropsHigh) {
+        m_congested = true;
+    } else if (delayLow && queueLow) {
+        m_congested = false;
+    }
+
+    return m_congested;
+}
+
+CongestionController::Outputs DelayBasedCongestionController::outputsForLevel(const Inputs &inputs) const
+{
+    const int minimumFrameRate = std::min(MinimumFrameRate, m_maximumFrameRate);
+    const quint8 minimumQuality = std::min(MinimumQuality, m_maximumQuality);
+
+    Outputs outputs;
+    if (m_level >= FrameRateLevel) {
+        const double t = (m_level - FrameRateLevel) / (1.0 - FrameRateLevel);
+        outputs.quality = quint8(std::lround(minimumQuality + (m_maximumQuality - minimumQuality) * t));
+        outputs.frameRate = m_maximumFrameRate;
+        outputs.scale = 1.0;
+    } else if (m_level >= ScaleLevel) {
+        const double t = (m_level - ScaleLevel) / (FrameRateLevel - ScaleLevel);
+        outputs.quality = minimumQuality;
+        outputs.frameRate = int(std::lround(minimumFrameRate + (m_maximumFrameRate - minimumFrameRate) * t));
+        outputs.scale = 1.0;
+    } else {
+        const double t = m_level / ScaleLevel;
+        outputs.quality = minimumQuality;
+        outputs.frameRate = minimumFrameRate;
+        outputs.scale = std::ceil((MinimumScale + (1.0 - MinimumScale) * t) / ScaleStep) * ScaleStep;
+    }
+
+    outputs.inFlightWindow = inFlightWindow(inputs, outputs.frameRate);
+    return outputs;
+}
+
+qsizetype DelayBasedCongestionController::inFlightWindow(const Inputs &inputs, int frameRate) const
+{
+    if (inputs.rtt <= clk::milliseconds(0)) {
+        return MinimumInFlightWindow;
+    }
+
+    // Enough frames to cover one round trip, but never more than the latency budget.
+    const double fps = std::clamp(inputs.producerFrameRate, 1.0, double(frameRate));
+    const double rttSec = clk::duration<double>(std::max(inputs.rtt, inputs.minimumRtt)).count();
+    const qsizetype cap = std::max<qsizetype>(MinimumInFlightWindow, qsizetype(std::ceil(fps * LatencyBudgetSec)));
+    qsizetype window = std::clamp(qsizetype(std::ceil(fps * rttSec)), MinimumInFlightWindow, cap);
+
+    // While congested, also limit the window to what the link actually delivers,
+    // so queues along the path can drain.
+    if (m_state == State::Congested && inputs.deliveryRate > 0 && inputs.averageFrameSize > 0) {
+        const double bdpBytes = double(inputs.deliveryRate) * clk::duration<double>(inputs.minimumRtt).count();
+        const qsizetype bdpFrames = qsizetype(std::ceil(bdpBytes / double(inputs.averageFrameSize))) + 1;
+        window = std::clamp(bdpFrames, MinimumInFlightWindow, window);
+    }
+
+    return window;
+}
+
+}
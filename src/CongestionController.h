@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <QtGlobal>
+
+#include "krdp_export.h"
+
+namespace KRdp
+{
+
+/**
+ * Interface for video congestion control.
+ *
+ * A congestion controller is fed network measurements by VideoStream and
+ * decides how much video should be sent. VideoStream owns one instance,
+ * which can be replaced using VideoStream::setCongestionController().
+ */
+class KRDP_EXPORT CongestionController
+{
+public:
+    struct Inputs {
+        std::chrono::steady_clock::time_point now;
+        // Smoothed round trip time, the base RTT (the minimum over a long window, see
+        // NetworkDetection::baseRTT()) and the mean deviation of RTT samples.
+        std::chrono::milliseconds rtt = std::chrono::milliseconds(0);
+        std::chrono::milliseconds minimumRtt = std::chrono::milliseconds(0);
+        std::chrono::milliseconds jitter = std::chrono::milliseconds(0);
+        // Passive delivery rate estimate in bytes per second, 0 if unknown.
+        uint64_t deliveryRate = 0;
+        // Average encoded size of recent frames in bytes, 0 if unknown.
+        uint64_t averageFrameSize = 0;
+        // Frames produced per second by the capture source.
+        double producerFrameRate = 0.0;
+        // Number of frames the client reported as not yet decoded, 0 if unknown.
+        uint32_t queueDepth = 0;
+        // Total number of frames dropped since the stream started because the in-flight
+        // window was full or the transport was write blocked.
+        uint64_t droppedFrames = 0;
+    };
+
+    struct Outputs {
+        // Maximum number of frames sent but not yet acknowledged.
+        qsizetype inFlightWindow = 2;
+        int frameRate = 60;
+        quint8 quality = 100;
+        // Factor to scale the streamed size by, 1.0 means no downscaling.
+        double scale = 1.0;
+
+        bool operator==(const Outputs &other) const = default;
+    };
+
+    virtual ~CongestionController();
+
+    /**
+     * Set the highest frame rate and quality the controller may select.
+     */
+    virtual void setLimits(int maximumFrameRate, quint8 maximumQuality) = 0;
+
+    /**
+     * Process a new set of measurements and return the updated outputs.
+     */
+    virtual Outputs update(const Inputs &inputs) = 0;
+};
+
+/**
+ * Default congestion controller, based on queuing delay.
+ *
+ * The controller keeps a single level between 0.0 and 1.0 that is mapped to
+ * its outputs. Lowering the level first lowers quality, then frame rate and
+ * finally scales down the streamed size. This way a congested link first
+ * loses detail, then smoothness and only when that is not enough resolution.
+ *
+ * The controller is a small state machine:
+ *
+ * - Startup: no RTT measurement yet. Outputs are at their maximum and the
+ *   in-flight window at its floor. The first valid RTT sample moves to Steady.
+ * - Steady: the level is at its maximum. A congestion signal that persists
+ *   for CongestionConfirmUpdates consecutive updates moves to Congested.
+ * - Congested: the level is reduced multiplicatively, at most once per
+ *   DecreaseInterval, as long as congestion is signalled. After the signal
+ *   has been clear for RecoveryHoldTime it moves to Recovering.
+ * - Recovering: the level is raised additively once per IncreaseInterval.
+ *   Any congestion signal moves back to Congested; reaching the maximum
+ *   level moves to Steady.
+ *
+ * Congestion is signalled when queuing delay (smoothed RTT above the minimum
+ * RTT) or client queue depth exceed their high thresholds, or when a large
+ * part of the produced frames had to be dropped. The signal only clears once both are
+ * below their lower thresholds, which gives hysteresis and keeps the outputs
+ * from oscillating around a single threshold.
+ */
+class KRDP_EXPORT DelayBasedCongestionController : public CongestionController
+{
+public:
+    enum class State {
+        Startup,
+        Steady,
+        Congested,
+        Recovering,
+    };
+
+    DelayBasedCongestionController();
+
+    void setLimits(int maximumFrameRate, quint8 maximumQuality) override;
+    Outputs update(const Inputs &inputs) override;
+
+    State state() const;
+    double level() const;
+
+private:
+    bool isCongested(const Inputs &inputs);
+    Outputs outputsForLevel(const Inputs &inputs) const;
+    qsizetype inFlightWindow(const Inputs &inputs, int frameRate) const;
+
+    State m_state = State::Startup;
+    double m_level = 1.0;
+    bool m_congested = false;
+    int m_congestedUpdates = 0;
+    uint64_t m_lastDroppedFrames = 0;
+    std::chrono::steady_clock::time_point m_lastDroppedFramesTime;
+    std::chrono::steady_clock::time_point m_lastLevelChange;
+    std::chrono::steady_clock::time_point m_lastCongestion;
+
+    int m_maximumFrameRate = 60;
+    quint8 m_maximumQuality = 100;
+};
+
+}
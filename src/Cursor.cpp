@@ -4,6 +4,9 @@
 
 #include "Cursor.h"
 
+#include <mutex>
+#include <vector>
+
 #include <QHash>
 
 #include <freerdp/freerdp.h>
@@ -15,10 +18,44 @@ using namespace KRdp;
 
 static QByteArray createXorMask(const QImage &image)
 {
-    auto converted = image.convertToFormat(QImage::Format_ARGB32);
-    converted.flip(Qt::Vertical);
-    converted.rgbSwap();
-    return QByteArray(reinterpret_cast<char *>(converted.bits()), converted.sizeInBytes());
+    // The XOR mask is the ARGB32 image, bottom-up, with red and blue swapped.
+    // Do the flip and the swap in a single pass over the rows; the inner loop is
+    // plain bit twiddling so the compiler can vectorize it.
+    const auto converted = image.format() == QImage::Format_ARGB32 ? image : image.convertToFormat(QImage::Format_ARGB32);
+    const int width = converted.width();
+    const int height = converted.height();
+
+    QByteArray mask(qsizetype(width) * height * 4, Qt::Uninitialized);
+    auto output = reinterpret_cast<uint32_t *>(mask.data());
+    for (int y = 0; y < height; ++y) {
+        auto input = reinterpret_cast<const uint32_t *>(converted.constScanLine(height - 1 - y));
+        auto row = output + qsizetype(y) * width;
+        for (int x = 0; x < width; ++x) {
+            const uint32_t pixel = input[x];
+            row[x] = (pixel & 0xff00ff00) | ((pixel >> 16) & 0xff) | ((pixel & 0xff) << 16);
+        }
+    }
+    return mask;
+}
+
+namespace
+{
+/**
+ * A pointer update waiting to be sent to the client.
+ */
+struct PointerCommand {
+    enum class Type {
+        System,
+        Cached,
+        New,
+    };
+
+    Type type = Type::Cached;
+    // SYSPTR_* for System, the cache index for Cached.
+    uint32_t value = 0;
+    // The cursor to upload, for New.
+    Cursor::CursorUpdate cursor;
+};
 }
 
 bool Cursor::CursorUpdate::operator==(const Cursor::CursorUpdate &other) const
@@ -26,6 +63,12 @@ bool Cursor::CursorUpdate::operator==(const Cursor::CursorUpdate &other) const
     return hotspot == other.hotspot && image == other.image;
 }
 
+size_t KRdp::qHash(const Cursor::CursorUpdate &update, size_t seed)
+{
+    const auto &image = update.image;
+    return qHashMulti(seed, update.hotspot.x(), update.hotspot.y(), image.width(), image.height(), qHashBits(image.constBits(), image.sizeInBytes(), seed));
+}
+
 class KRDP_NO_EXPORT Cursor::Private
 {
 public:
@@ -33,9 +76,35 @@ public:
 
     CursorType cursorType = CursorType::SystemDefault;
 
-    CursorUpdate *lastUsedCursor = nullptr;
+    std::optional<uint32_t> lastUsedCacheId;
+    // PipeWire keeps handing out the same implicitly shared image until the
+    // cursor bitmap changes, so its cache key tells us the cursor is unchanged
+    // without looking at the pixels.
+    qint64 lastImageKey = 0;
+    QPoint lastHotspot;
 
     QHash<uint32_t, CursorUpdate> cursorCache;
+    // Content hash to cache id, so a cursor seen before is found without
+    // comparing it against every cached image.
+    QHash<size_t, uint32_t> hashIndex;
+
+    // Pointer updates are decided on the thread calling update() but sent from
+    // the video frame submission thread, so they go out in order with the frames.
+    std::mutex commandMutex;
+    std::vector<PointerCommand> commands;
+
+    void queueCommand(PointerCommand &&command)
+    {
+        std::lock_guard lock(commandMutex);
+        if (command.type != PointerCommand::Type::New) {
+            // Only the last pointer selection matters, but every upload is
+            // needed to fill the client's cache.
+            std::erase_if(commands, [](const PointerCommand &pending) {
+                return pending.type != PointerCommand::Type::New;
+            });
+        }
+        commands.push_back(std::move(command));
+    }
 };
 
 Cursor::Cursor(RdpConnection *session)
@@ -71,28 +140,33 @@ void Cursor::update(const Cursor::CursorUpdate &update)
     // Show a bitmap image for the cursor.
     setCursorType(CursorType::Image);
 
+    const auto now = std::chrono::steady_clock::now();
+
     // If we're already showing it, simply update the last used timestamp and
     // do nothing else.
-    if (d->lastUsedCursor && *d->lastUsedCursor == update) {
-        d->lastUsedCursor->lastUsed = std::chrono::steady_clock::now();
+    if (d->lastUsedCacheId && update.image.cacheKey() == d->lastImageKey && update.hotspot == d->lastHotspot) {
+        d->cursorCache[*d->lastUsedCacheId].lastUsed = now;
         return;
     }
+    d->lastImageKey = update.image.cacheKey();
+    d->lastHotspot = update.hotspot;
 
-    auto context = d->session->rdpPeerContext();
-    auto updatePointer = d->session->rdpPeerContext()->update->pointer;
+    const auto hash = qHash(update);
 
     // Cursor images are cached. Check to see if the newly requested cursor is
     // already in the cache, and if so, mark that as the current cursor.
-    auto itr = std::find_if(d->cursorCache.begin(), d->cursorCache.end(), [&update](const CursorUpdate &cached) {
-        return update == cached;
-    });
-    if (itr != d->cursorCache.end()) {
-        d->lastUsedCursor = &itr.value();
-        itr->lastUsed = std::chrono::steady_clock::now();
-        POINTER_CACHED_UPDATE pointerCachedUpdate;
-        pointerCachedUpdate.cacheIndex = itr->cacheId;
-        updatePointer->PointerCached(context, &pointerCachedUpdate);
-        return;
+    auto indexed = d->hashIndex.constFind(hash);
+    if (indexed != d->hashIndex.cend()) {
+        auto itr = d->cursorCache.find(*indexed);
+        if (itr != d->cursorCache.end() && *itr == update) {
+            itr->lastUsed = now;
+            if (d->lastUsedCacheId == itr->cacheId) {
+                return;
+            }
+            d->lastUsedCacheId = itr->cacheId;
+            d->queueCommand(PointerCommand{.type = PointerCommand::Type::Cached, .value = itr->cacheId});
+            return;
+        }
     }
 
     // We have a completely new cursor, let's add the required metadata for the
@@ -101,7 +175,9 @@ void Cursor::update(const Cursor::CursorUpdate &update)
     newCursor.hotspot = update.hotspot;
     newCursor.image = update.image;
     newCursor.cacheId = d->cursorCache.size();
-    newCursor.lastUsed = std::chrono::steady_clock::now();
+    newCursor.contentHash = hash;
+    newCursor.lastUsed = now;
+    newCursor.xorMask = createXorMask(newCursor.image);
 
     // Evict least recently used cursor from the cache if it has grown too large.
     if (d->cursorCache.size() >= freerdp_settings_get_uint32(d->session->rdpPeerContext()->settings, FreeRDP_PointerCacheSize)) {
@@ -109,47 +185,19 @@ void Cursor::update(const Cursor::CursorUpdate &update)
             return first.lastUsed < second.lastUsed;
         });
         newCursor.cacheId = lru->cacheId;
+        if (d->hashIndex.value(lru->contentHash) == lru->cacheId) {
+            d->hashIndex.remove(lru->contentHash);
+        }
         d->cursorCache.erase(lru);
     }
 
-    if (update.image.width() < 96 && update.image.height() < 96) {
-        POINTER_NEW_UPDATE pointerNewUpdate;
-        pointerNewUpdate.xorBpp = 32;
-        auto &colorUpdate = pointerNewUpdate.colorPtrAttr;
-        colorUpdate.cacheIndex = newCursor.cacheId;
-        colorUpdate.hotSpotX = newCursor.hotspot.x();
-        colorUpdate.hotSpotY = newCursor.hotspot.y();
-        colorUpdate.width = newCursor.image.width();
-        colorUpdate.height = newCursor.image.height();
-        colorUpdate.lengthAndMask = 0;
-        colorUpdate.andMaskData = nullptr;
-        auto xorMask = createXorMask(newCursor.image);
-        colorUpdate.lengthXorMask = xorMask.size();
-        colorUpdate.xorMaskData = reinterpret_cast<BYTE *>(xorMask.data());
-        updatePointer->PointerNew(context, &pointerNewUpdate);
-    } else {
-        POINTER_LARGE_UPDATE pointerLargeUpdate;
-        pointerLargeUpdate.xorBpp = 32;
-        pointerLargeUpdate.cacheIndex = newCursor.cacheId;
-        pointerLargeUpdate.hotSpotX = newCursor.hotspot.x();
-        pointerLargeUpdate.hotSpotY = newCursor.hotspot.y();
-        pointerLargeUpdate.width = newCursor.image.width();
-        pointerLargeUpdate.height = newCursor.image.height();
-        pointerLargeUpdate.lengthAndMask = 0;
-        pointerLargeUpdate.andMaskData = nullptr;
-        auto xorMask = createXorMask(newCursor.image);
-        pointerLargeUpdate.lengthXorMask = xorMask.size();
-        pointerLargeUpdate.xorMaskData = reinterpret_cast<BYTE *>(xorMask.data());
-        updatePointer->PointerLarge(context, &pointerLargeUpdate);
-    }
-
-    POINTER_CACHED_UPDATE pointerCachedUpdate;
-    pointerCachedUpdate.cacheIndex = newCursor.cacheId;
-    updatePointer->PointerCached(context, &pointerCachedUpdate);
+    d->queueCommand(PointerCommand{.type = PointerCommand::Type::New, .cursor = newCursor});
+    d->queueCommand(PointerCommand{.type = PointerCommand::Type::Cached, .value = newCursor.cacheId});
 
     // Actually insert the new cursor into the cache.
-    auto inserted = d->cursorCache.insert(newCursor.cacheId, newCursor);
-    d->lastUsedCursor = &inserted.value();
+    d->cursorCache.insert(newCursor.cacheId, newCursor);
+    d->hashIndex.insert(hash, newCursor.cacheId);
+    d->lastUsedCacheId = newCursor.cacheId;
 }
 
 void Cursor::setCursorType(Cursor::CursorType type)
@@ -161,10 +209,75 @@ void Cursor::setCursorType(Cursor::CursorType type)
     d->cursorType = type;
 
     if (type != CursorType::Image) {
-        d->lastUsedCursor = nullptr;
-        POINTER_SYSTEM_UPDATE pointerSystemUpdate;
-        pointerSystemUpdate.type = type == CursorType::Hidden ? SYSPTR_NULL : SYSPTR_DEFAULT;
-        d->session->rdpPeerContext()->update->pointer->PointerSystem(d->session->rdpPeerContext(), &pointerSystemUpdate);
+        d->lastUsedCacheId.reset();
+        d->lastImageKey = 0;
+        d->queueCommand(PointerCommand{.type = PointerCommand::Type::System, .value = uint32_t(type == CursorType::Hidden ? SYSPTR_NULL : SYSPTR_DEFAULT)});
+    }
+}
+
+void Cursor::sendPendingUpdates()
+{
+    std::vector<PointerCommand> commands;
+    {
+        std::lock_guard lock(d->commandMutex);
+        if (d->commands.empty()) {
+            return;
+        }
+        commands.swap(d->commands);
+    }
+
+    auto context = d->session->rdpPeerContext();
+    auto updatePointer = context->update->pointer;
+
+    for (const auto &command : commands) {
+        switch (command.type) {
+        case PointerCommand::Type::System: {
+            POINTER_SYSTEM_UPDATE pointerSystemUpdate;
+            pointerSystemUpdate.type = command.value;
+            updatePointer->PointerSystem(context, &pointerSystemUpdate);
+            break;
+        }
+        case PointerCommand::Type::Cached: {
+            POINTER_CACHED_UPDATE pointerCachedUpdate;
+            pointerCachedUpdate.cacheIndex = command.value;
+            updatePointer->PointerCached(context, &pointerCachedUpdate);
+            break;
+        }
+        case PointerCommand::Type::New: {
+            const auto &cursor = command.cursor;
+            // The mask is only read by FreeRDP, the const_cast is for its API.
+            auto xorMask = reinterpret_cast<BYTE *>(const_cast<char *>(cursor.xorMask.constData()));
+            if (cursor.image.width() < 96 && cursor.image.height() < 96) {
+                POINTER_NEW_UPDATE pointerNewUpdate;
+                pointerNewUpdate.xorBpp = 32;
+                auto &colorUpdate = pointerNewUpdate.colorPtrAttr;
+                colorUpdate.cacheIndex = cursor.cacheId;
+                colorUpdate.hotSpotX = cursor.hotspot.x();
+                colorUpdate.hotSpotY = cursor.hotspot.y();
+                colorUpdate.width = cursor.image.width();
+                colorUpdate.height = cursor.image.height();
+                colorUpdate.lengthAndMask = 0;
+                colorUpdate.andMaskData = nullptr;
+                colorUpdate.lengthXorMask = cursor.xorMask.size();
+                colorUpdate.xorMaskData = xorMask;
+                updatePointer->PointerNew(context, &pointerNewUpdate);
+            } else {
+                POINTER_LARGE_UPDATE pointerLargeUpdate;
+                pointerLargeUpdate.xorBpp = 32;
+                pointerLargeUpdate.cacheIndex = cursor.cacheId;
+                pointerLargeUpdate.hotSpotX = cursor.hotspot.x();
+                pointerLargeUpdate.hotSpotY = cursor.hotspot.y();
+                pointerLargeUpdate.width = cursor.image.width();
+                pointerLargeUpdate.height = cursor.image.height();
+                pointerLargeUpdate.lengthAndMask = 0;
+                pointerLargeUpdate.andMaskData = nullptr;
+                pointerLargeUpdate.lengthXorMask = cursor.xorMask.size();
+                pointerLargeUpdate.xorMaskData = xorMask;
+                updatePointer->PointerLarge(context, &pointerLargeUpdate);
+            }
+            break;
+        }
+        }
     }
 }
 
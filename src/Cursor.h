@@ -37,6 +37,10 @@ public:
         QImage image;
 
         uint32_t cacheId = 0;
+        size_t contentHash = 0;
+        // The image converted to the client's XOR mask format, built once
+        // when the cursor enters the cache.
+        QByteArray xorMask;
         std::chrono::steady_clock::time_point lastUsed;
 
         bool operator==(const CursorUpdate &other) const;
@@ -54,7 +58,15 @@ public:
     void update(const CursorUpdate &update);
 
 private:
+    friend class VideoStream;
+
     void setCursorType(CursorType type);
+    /**
+     * Send pointer updates queued by update() to the client.
+     *
+     * Called from the video frame submission thread.
+     */
+    void sendPendingUpdates();
 
     class Private;
     const std::unique_ptr<Private> d;
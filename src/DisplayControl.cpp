@@ -6,6 +6,9 @@
 #include "PeerContext_p.h"
 #include "RdpConnection.h"
 
+#include <algorithm>
+#include <utility>
+
 #include <QDebug>
 #include <QSize>
 
@@ -15,16 +18,38 @@
 
 using namespace KRdp;
 
+// Time a requested size needs to be stable before it is applied.
+constexpr auto ResizeDebounceInterval = std::chrono::milliseconds(150);
+// During a continuous resize, apply the latest size at least this often.
+constexpr qint64 ResizeMaximumDelayMs = 1000;
+// Largest monitor count allowed by MS-RDPEDISP.
+constexpr uint32_t MaximumMonitors = 16;
+
 static UINT display_control_receive_monitor_layout(DispServerContext *context, const DISPLAY_CONTROL_MONITOR_LAYOUT_PDU *pdu)
 {
-    if (pdu->NumMonitors != 1) {
+    if (pdu->NumMonitors < 1 || pdu->NumMonitors > MaximumMonitors) {
         return CHANNEL_RC_BAD_CHANNEL;
     }
 
-    QSize monitorSize = QSize(pdu->Monitors[0].Width, pdu->Monitors[0].Height);
+    // Only the primary monitor can be resized, other monitors keep the size of
+    // the server's monitor they show.
+    auto primary = std::find_if(pdu->Monitors, pdu->Monitors + pdu->NumMonitors, [](const DISPLAY_CONTROL_MONITOR_LAYOUT &monitor) {
+        return monitor.Flags & DISPLAY_CONTROL_MONITOR_PRIMARY;
+    });
+    if (primary == pdu->Monitors + pdu->NumMonitors) {
+        primary = pdu->Monitors;
+    }
+
+    QSize monitorSize = QSize(primary->Width, primary->Height);
 
     auto c = static_cast<DisplayControl *>(context->custom);
-    Q_EMIT c->requestedScreenSizeChanged(monitorSize);
+    // Layouts arrive on the connection thread, coalesce them on the thread DisplayControl lives on.
+    QMetaObject::invokeMethod(
+        c,
+        [c, monitorSize]() {
+            c->requestScreenSize(monitorSize);
+        },
+        Qt::QueuedConnection);
 
     return CHANNEL_RC_OK;
 }
@@ -32,6 +57,41 @@ static UINT display_control_receive_monitor_layout(DispServerContext *context, c
 DisplayControl::DisplayControl(RdpConnection *session)
     : m_session(session)
 {
+    m_debounceTimer.setSingleShot(true);
+    m_debounceTimer.setInterval(ResizeDebounceInterval);
+    connect(&m_debounceTimer, &QTimer::timeout, this, &DisplayControl::emitRequestedSize);
+}
+
+void DisplayControl::requestScreenSize(const QSize &size)
+{
+    if (m_closed) {
+        return;
+    }
+
+    if (!m_pendingSize.isValid()) {
+        m_pendingSince.start();
+    }
+    m_pendingSize = size;
+
+    if (m_pendingSince.elapsed() >= ResizeMaximumDelayMs) {
+        emitRequestedSize();
+        return;
+    }
+
+    m_debounceTimer.start();
+}
+
+void DisplayControl::emitRequestedSize()
+{
+    m_debounceTimer.stop();
+
+    const auto size = std::exchange(m_pendingSize, QSize());
+    if (m_closed || !size.isValid() || size == m_requestedSize) {
+        return;
+    }
+
+    m_requestedSize = size;
+    Q_EMIT requestedScreenSizeChanged(size);
 }
 
 bool DisplayControl::initialize()
@@ -48,12 +108,13 @@ bool DisplayControl::initialize()
         return false;
     }
 
+    m_closed = false;
     m_dispManager->rdpcontext = m_session->rdpPeer()->context;
     m_dispManager->custom = this;
 
     m_dispManager->DispMonitorLayout = display_control_receive_monitor_layout;
 
-    m_dispManager->MaxNumMonitors = 1;
+    m_dispManager->MaxNumMonitors = MaximumMonitors;
     m_dispManager->MaxMonitorAreaFactorA = 8192;
     m_dispManager->MaxMonitorAreaFactorB = 8192;
 
@@ -71,6 +132,16 @@ bool DisplayControl::initialize()
 
 void DisplayControl::close()
 {
+    m_closed = true;
+    // The timer and pending size belong to the thread this object lives on.
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+            m_debounceTimer.stop();
+            m_pendingSize = QSize();
+        },
+        Qt::QueuedConnection);
+
     if (m_dispManager) {
         disp_server_context_free(m_dispManager);
         m_dispManager = nullptr;
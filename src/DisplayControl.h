@@ -4,8 +4,13 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "freerdp/server/disp.h"
+#include <QElapsedTimer>
 #include <QObject>
+#include <QSize>
+#include <QTimer>
 
 #include "krdp_export.h"
 
@@ -24,12 +29,31 @@ public:
     bool initialize();
     void close();
 
+    /**
+     * Handle a monitor layout request from the client.
+     *
+     * While a client window is being resized, clients send a layout for
+     * every intermediate size. These are coalesced so that
+     * requestedScreenSizeChanged() is only emitted once the size has settled,
+     * or periodically during a long resize.
+     */
+    void requestScreenSize(const QSize &size);
+
 Q_SIGNALS:
     void requestedScreenSizeChanged(const QSize &size);
 
 private:
+    void emitRequestedSize();
+
     RdpConnection *m_session = nullptr;
     DispServerContext *m_dispManager = nullptr;
+
+    QTimer m_debounceTimer;
+    QElapsedTimer m_pendingSince;
+    QSize m_pendingSize;
+    QSize m_requestedSize;
+    // Set by close(), which runs on the connection thread rather than the thread this object lives on.
+    std::atomic_bool m_closed = false;
 };
 
 }
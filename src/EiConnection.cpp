@@ -71,22 +71,31 @@ public:
     EisPointerDevice(const EisPointerDevice &) = delete;
     EisPointerDevice &operator=(const EisPointerDevice &) = delete;
 
-    [[nodiscard]] std::optional<Region> regionForMapping(const QString &mappingId) const
+    [[nodiscard]] const QHash<QString, Region> &regions() const
     {
-        const auto it = m_regions.constFind(mappingId);
-        if (it != m_regions.cend()) {
-            return *it;
-        }
-
-        return std::nullopt;
+        return m_regions;
     }
 
 private:
     QHash<QString, Region> m_regions;
 };
 
+/**
+ * Lookup tables for the devices events are sent to.
+ *
+ * Rebuilt whenever a device is added or removed so that sending an event does
+ * not need to scan the device list.
+ */
+struct EiDeviceIndex {
+    EisPointerDevice *absolutePointer = nullptr;
+    EisPointerDevice *button = nullptr;
+    EisPointerDevice *scroll = nullptr;
+    QHash<QString, std::pair<EisPointerDevice *, EisPointerDevice::Region>> mappings;
+};
+
 EiConnection::EiConnection(int fd, QObject *parent)
     : QObject(parent)
+    , m_deviceIndex(std::make_unique<EiDeviceIndex>())
 {
     m_ei = ei_new_sender(this);
     if (!m_ei) {
@@ -111,6 +120,7 @@ EiConnection::~EiConnection()
         return;
     }
 
+    commitFrame();
     ei_disconnect(m_ei);
     while (auto event = ei_get_event(m_ei)) {
         ei_event_unref(event);
@@ -125,32 +135,34 @@ bool EiConnection::isValid() const
 
 void EiConnection::sendEvent(const std::shared_ptr<QEvent> &event, const QSize &streamSize, const QString &mappingId)
 {
-    const auto findPointerDeviceWithCapability = [this](enum ei_device_capability capability) -> EisPointerDevice * {
-        for (const auto &pointerDevice : m_pointerDevices) {
-            if (ei_device_has_capability(pointerDevice->device(), capability)) {
-                return pointerDevice.get();
-            }
-        }
+    if (!m_ei) {
+        return;
+    }
 
-        return nullptr;
-    };
+    emitEvent(*event, streamSize, mappingId);
+}
 
-    const auto findPointerDeviceForMappingId =
-        [this](const QString &mappingId) -> std::optional<std::pair<EisPointerDevice *, EisPointerDevice::Region>> {
-        for (const auto &pointerDevice : m_pointerDevices) {
-            const auto region = pointerDevice->regionForMapping(mappingId);
-            if (region.has_value()) {
-                return std::pair{pointerDevice.get(), *region};
-            }
-        }
+void EiConnection::sendEvents(const std::vector<std::shared_ptr<QEvent>> &events, const QSize &streamSize, const QString &mappingId)
+{
+    if (!m_ei || events.empty()) {
+        return;
+    }
 
-        return std::nullopt;
-    };
+    // Read the clock once and stamp every frame of the batch with it.
+    m_batchTime = ei_now(m_ei);
+    for (const auto &event : events) {
+        emitEvent(*event, streamSize, mappingId);
+    }
+    commitFrame();
+    m_batchTime = 0;
+}
 
-    switch (event->type()) {
+void EiConnection::emitEvent(const QEvent &event, const QSize &streamSize, const QString &mappingId)
+{
+    switch (event.type()) {
     case QEvent::MouseButtonPress:
     case QEvent::MouseButtonRelease: {
-        auto me = std::static_pointer_cast<QMouseEvent>(event);
+        auto me = static_cast<const QMouseEvent *>(&event);
         int button = 0;
         if (me->button() == Qt::LeftButton) {
             button = BTN_LEFT;
@@ -166,17 +178,19 @@ void EiConnection::sendEvent(const std::shared_ptr<QEvent> &event, const QSize &
             qCWarning(KRDP) << "Unsupported mouse button" << me->button();
             return;
         }
-        auto pointerDevice = m_ei ? findPointerDeviceWithCapability(EI_DEVICE_CAP_BUTTON) : nullptr;
+        auto pointerDevice = m_deviceIndex->button;
         if (!pointerDevice) {
             qCWarning(KRDP) << "Mouse press event received but no button devices are available.";
             return;
         }
         ei_device_button_button(pointerDevice->device(), button, me->type() == QEvent::MouseButtonPress);
-        ei_device_frame(pointerDevice->device(), ei_now(m_ei));
+        // A button change ends the frame, so a press and release never share one.
+        appendToFrame(pointerDevice->device());
+        commitFrame();
         break;
     }
     case QEvent::MouseMove: {
-        if (!m_ei || m_pointerDevices.empty()) {
+        if (m_pointerDevices.empty()) {
             qCWarning(KRDP) << "Mouse move event received but no pointer devices are available.";
             return;
         }
@@ -184,63 +198,72 @@ void EiConnection::sendEvent(const std::shared_ptr<QEvent> &event, const QSize &
             qCWarning(KRDP) << "Mouse move event received but stream size is unknown.";
             return;
         }
-        auto me = std::static_pointer_cast<QMouseEvent>(event);
+        auto me = static_cast<const QMouseEvent *>(&event);
 
         EisPointerDevice *pointerDevice;
         QPointF devicePosition;
         QPointF streamPosition = me->position();
 
         if (!mappingId.isEmpty()) {
-            const auto mappedPointerDevice = findPointerDeviceForMappingId(mappingId);
-            if (!mappedPointerDevice) {
+            const auto it = m_deviceIndex->mappings.constFind(mappingId);
+            if (it == m_deviceIndex->mappings.cend()) {
                 qCWarning(KRDP) << "Mouse move event whilst screen has explicit mapping, but no associated device found.";
                 return;
             }
 
-            const auto &[mappedDevice, region] = *mappedPointerDevice;
+            const auto &[mappedDevice, region] = *it;
             pointerDevice = mappedDevice;
             auto logicalStreamPosition =
                 QPointF{(streamPosition.x() / streamSize.width()) * region.rect.width(), (streamPosition.y() / streamSize.height()) * region.rect.height()};
             devicePosition = QPointF{region.rect.x() + logicalStreamPosition.x(), region.rect.y() + logicalStreamPosition.y()};
         } else {
-            pointerDevice = findPointerDeviceWithCapability(EI_DEVICE_CAP_POINTER_ABSOLUTE);
+            pointerDevice = m_deviceIndex->absolutePointer;
             devicePosition = me->position();
         }
 
+        if (!pointerDevice) {
+            qCWarning(KRDP) << "Mouse move event received but no absolute pointer device is available.";
+            return;
+        }
+
         ei_device_pointer_motion_absolute(pointerDevice->device(), devicePosition.x(), devicePosition.y());
-        ei_device_frame(pointerDevice->device(), ei_now(m_ei));
+        appendToFrame(pointerDevice->device());
         break;
     }
     case QEvent::Wheel: {
-        auto pointerDevice = m_ei ? findPointerDeviceWithCapability(EI_DEVICE_CAP_SCROLL) : nullptr;
+        auto pointerDevice = m_deviceIndex->scroll;
         if (!pointerDevice) {
             return;
         }
-        auto we = std::static_pointer_cast<QWheelEvent>(event);
+        auto we = static_cast<const QWheelEvent *>(&event);
         auto delta = we->angleDelta();
         ei_device_scroll_discrete(pointerDevice->device(), delta.x(), delta.y());
-        ei_device_frame(pointerDevice->device(), ei_now(m_ei));
+        appendToFrame(pointerDevice->device());
+        commitFrame();
         break;
     }
     case QEvent::KeyPress:
     case QEvent::KeyRelease: {
-        auto ke = std::static_pointer_cast<QKeyEvent>(event);
-        const auto isPress = event->type() == QEvent::KeyPress;
+        auto ke = static_cast<const QKeyEvent *>(&event);
+        const auto isPress = event.type() == QEvent::KeyPress;
+
+        // Key events are framed on their own, after any pointer events before them.
+        commitFrame();
 
         if (ke->nativeScanCode()) {
-            if (!m_ei || !m_keyboardDevice) {
+            if (!m_keyboardDevice) {
                 qCWarning(KRDP) << "Keyboard event received but no keyboard device is available.";
                 return;
             }
             ei_device_keyboard_key(m_keyboardDevice->device(), ke->nativeScanCode(), isPress);
-            ei_device_frame(m_keyboardDevice->device(), ei_now(m_ei));
+            ei_device_frame(m_keyboardDevice->device(), frameTime());
         } else if (ke->nativeVirtualKey()) {
-            if (!m_ei || !m_textDevice) {
+            if (!m_textDevice) {
                 qCWarning(KRDP) << "Keyboard event received but no text device is available.";
                 return;
             }
             ei_device_text_keysym(m_textDevice->device(), ke->nativeVirtualKey(), isPress);
-            ei_device_frame(m_textDevice->device(), ei_now(m_ei));
+            ei_device_frame(m_textDevice->device(), frameTime());
         }
         break;
     }
@@ -249,6 +272,53 @@ void EiConnection::sendEvent(const std::shared_ptr<QEvent> &event, const QSize &
     }
 }
 
+void EiConnection::appendToFrame(struct ei_device *device)
+{
+    if (m_unframedDevice == device) {
+        return;
+    }
+
+    commitFrame();
+    m_unframedDevice = device;
+    QMetaObject::invokeMethod(this, &EiConnection::commitFrame, Qt::QueuedConnection);
+}
+
+void EiConnection::commitFrame()
+{
+    if (!m_unframedDevice) {
+        return;
+    }
+
+    ei_device_frame(std::exchange(m_unframedDevice, nullptr), frameTime());
+}
+
+uint64_t EiConnection::frameTime() const
+{
+    return m_batchTime ? m_batchTime : ei_now(m_ei);
+}
+
+void EiConnection::rebuildDeviceIndex()
+{
+    *m_deviceIndex = EiDeviceIndex{};
+
+    for (const auto &pointerDevice : m_pointerDevices) {
+        const auto assign = [&pointerDevice](EisPointerDevice *&slot, enum ei_device_capability capability) {
+            if (!slot && ei_device_has_capability(pointerDevice->device(), capability)) {
+                slot = pointerDevice.get();
+            }
+        };
+        assign(m_deviceIndex->absolutePointer, EI_DEVICE_CAP_POINTER_ABSOLUTE);
+        assign(m_deviceIndex->button, EI_DEVICE_CAP_BUTTON);
+        assign(m_deviceIndex->scroll, EI_DEVICE_CAP_SCROLL);
+
+        for (const auto &[mappingId, region] : pointerDevice->regions().asKeyValueRange()) {
+            if (!m_deviceIndex->mappings.contains(mappingId)) {
+                m_deviceIndex->mappings.insert(mappingId, {pointerDevice.get(), region});
+            }
+        }
+    }
+}
+
 void EiConnection::processEisEvents()
 {
     while (auto event = ei_get_event(m_ei)) {
@@ -287,6 +357,7 @@ void EiConnection::processEisEvents()
         case EI_EVENT_DEVICE_ADDED:
             if (ei_device_has_capability(device, EI_DEVICE_CAP_POINTER_ABSOLUTE)) {
                 m_pointerDevices.push_back(std::make_unique<EisPointerDevice>(device));
+                rebuildDeviceIndex();
             }
             if (!m_keyboardDevice && ei_device_has_capability(device, EI_DEVICE_CAP_KEYBOARD)) {
                 m_keyboardDevice.reset(new EiDevice(device));
@@ -297,9 +368,14 @@ void EiConnection::processEisEvents()
             ei_device_start_emulating(device, ei_now(m_ei));
             break;
         case EI_EVENT_DEVICE_REMOVED:
-            std::erase_if(m_pointerDevices, [device](const auto &pointerDevice) {
-                return pointerDevice->device() == device;
-            });
+            if (m_unframedDevice == device) {
+                m_unframedDevice = nullptr;
+            }
+            if (std::erase_if(m_pointerDevices, [device](const auto &pointerDevice) {
+                    return pointerDevice->device() == device;
+                })) {
+                rebuildDeviceIndex();
+            }
             if (m_keyboardDevice && m_keyboardDevice->device() == device) {
                 m_keyboardDevice.reset();
             }
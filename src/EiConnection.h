@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -16,12 +17,14 @@ class QSize;
 class QString;
 class QSocketNotifier;
 struct ei;
+struct ei_device;
 
 namespace KRdp
 {
 
 class EiDevice;
 class EisPointerDevice;
+struct EiDeviceIndex;
 
 class KRDP_EXPORT EiConnection : public QObject
 {
@@ -33,6 +36,13 @@ public:
 
     [[nodiscard]] bool isValid() const;
     void sendEvent(const std::shared_ptr<QEvent> &event, const QSize &streamSize, const QString &mappingId);
+    /**
+     * Send a batch of events.
+     *
+     * All frames emitted for the batch share a single timestamp and the last
+     * frame is committed before returning.
+     */
+    void sendEvents(const std::vector<std::shared_ptr<QEvent>> &events, const QSize &streamSize, const QString &mappingId);
 
 Q_SIGNALS:
     void error();
@@ -41,11 +51,28 @@ private:
     void processEisEvents();
     Q_SLOT void onEisReadyRead();
 
+    void emitEvent(const QEvent &event, const QSize &streamSize, const QString &mappingId);
+    void rebuildDeviceIndex();
+
+    /**
+     * Add the events just emitted on \p device to the pending frame.
+     *
+     * Pointer events emitted back to back on the same device, such as a
+     * coalesced motion followed by a button press, share a single ei frame
+     * that is committed once control returns to the event loop.
+     */
+    void appendToFrame(struct ei_device *device);
+    void commitFrame();
+    [[nodiscard]] uint64_t frameTime() const;
+
     std::unique_ptr<QSocketNotifier> m_eisNotifier;
     struct ei *m_ei = nullptr;
     std::vector<std::unique_ptr<EisPointerDevice>> m_pointerDevices;
     std::unique_ptr<EiDevice> m_keyboardDevice;
     std::unique_ptr<EiDevice> m_textDevice;
+    std::unique_ptr<EiDeviceIndex> m_deviceIndex;
+    struct ei_device *m_unframedDevice = nullptr;
+    uint64_t m_batchTime = 0;
 };
 
 }
@@ -4,9 +4,15 @@
 
 #include "InputHandler.h"
 
+#include <algorithm>
+#include <optional>
+#include <utility>
+
 #include <QKeyEvent>
 #include <QMetaObject>
+#include <QScopeGuard>
 #include <QSet>
+#include <QTimer>
 
 #include <xkbcommon/xkbcommon.h>
 
@@ -17,6 +23,8 @@
 namespace KRdp
 {
 
+constexpr int DefaultMotionFlushRate = 60;
+
 template<typename ReturnType, typename... MethodArgs, typename... CallArgs>
 static BOOL invokeOnInputHandlerThread(InputHandler *inputHandler, ReturnType (InputHandler::*method)(MethodArgs...), CallArgs &&...args)
 {
@@ -70,6 +78,15 @@ public:
     // Keycodes the client currently holds, so they can be released if a key-release
     // is lost and the client re-synchronizes its keyboard state.
     QSet<quint32> pressedKeys;
+
+    // Pointer motion coalescing. The first motion after an idle period is sent
+    // right away; motions arriving while the timer runs only replace the pending
+    // position, which is sent when the timer fires.
+    QTimer motionTimer;
+    std::optional<QPointF> pendingMotion;
+
+    // Events produced by the client input event currently being handled.
+    std::vector<std::shared_ptr<QEvent>> events;
 };
 
 InputHandler::InputHandler(KRdp::RdpConnection *session)
@@ -77,6 +94,11 @@ InputHandler::InputHandler(KRdp::RdpConnection *session)
     , d(std::make_unique<Private>())
 {
     d->session = session;
+
+    d->motionTimer.setTimerType(Qt::PreciseTimer);
+    d->motionTimer.setSingleShot(true);
+    connect(&d->motionTimer, &QTimer::timeout, this, &InputHandler::onMotionTimeout);
+    setMotionFlushRate(DefaultMotionFlushRate);
 }
 
 InputHandler::~InputHandler() noexcept
@@ -93,10 +115,31 @@ void InputHandler::initialize(rdpInput *input)
     input->UnicodeKeyboardEvent = inputUnicodeKeyboardEvent;
 }
 
+void InputHandler::setMotionFlushRate(int rate)
+{
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
+    if (rate <= 0) {
+        d->motionTimer.stop();
+        d->motionTimer.setInterval(0);
+        flushMotion();
+        return;
+    }
+
+    d->motionTimer.setInterval(std::max(1, 1000 / rate));
+}
+
 bool InputHandler::synchronizeEvent(uint32_t /*flags*/)
 {
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
     // Client is resynchronizing its keyboard state; release any keys we still
     // believe are held so a lost key-release does not leave a key stuck down.
+    flushMotion();
     const auto stuck = d->pressedKeys;
     d->pressedKeys.clear();
     if (!stuck.isEmpty()) {
@@ -104,13 +147,17 @@ bool InputHandler::synchronizeEvent(uint32_t /*flags*/)
     }
     for (auto keycode : stuck) {
         auto event = std::make_shared<QKeyEvent>(QEvent::KeyRelease, 0, Qt::KeyboardModifiers{}, keycode, 0, 0);
-        Q_EMIT inputEvent(event);
+        queueEvent(event);
     }
     return true;
 }
 
 bool InputHandler::mouseEvent(uint16_t x, uint16_t y, uint16_t flags)
 {
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
     QPointF position = QPointF(x, y);
 
     // Track last known mouse position for wheel events from clients
@@ -128,6 +175,10 @@ bool InputHandler::mouseEvent(uint16_t x, uint16_t y, uint16_t flags)
         button = Qt::MiddleButton;
     }
 
+    if (!(flags & PTR_FLAGS_MOVE) || flags & (PTR_FLAGS_DOWN | PTR_FLAGS_WHEEL | PTR_FLAGS_HWHEEL)) {
+        flushMotion();
+    }
+
     if (flags & PTR_FLAGS_WHEEL || flags & PTR_FLAGS_HWHEEL) {
         // Use last known mouse position if the client sends (0,0)
         if (position.isNull() && !d->lastMousePosition.isNull()) {
@@ -151,7 +202,7 @@ bool InputHandler::mouseEvent(uint16_t x, uint16_t y, uint16_t flags)
                                                        Qt::KeyboardModifiers{},
                                                        Qt::NoScrollPhase,
                                                        false);
-            Q_EMIT inputEvent(event);
+            queueEvent(event);
         }
         if (flags & PTR_FLAGS_HWHEEL) {
             auto event = std::make_shared<QWheelEvent>(position,
@@ -162,26 +213,33 @@ bool InputHandler::mouseEvent(uint16_t x, uint16_t y, uint16_t flags)
                                                        Qt::KeyboardModifiers{},
                                                        Qt::NoScrollPhase,
                                                        false);
-            Q_EMIT inputEvent(event);
+            queueEvent(event);
         }
         return true;
     }
 
+    if (!(flags & PTR_FLAGS_DOWN) && flags & PTR_FLAGS_MOVE) {
+        queueMotion(position);
+        return true;
+    }
+
     std::shared_ptr<QMouseEvent> event;
     if (flags & PTR_FLAGS_DOWN) {
         event = std::make_shared<QMouseEvent>(QEvent::MouseButtonPress, position, QPointF{}, button, button, Qt::NoModifier);
-    } else if (flags & PTR_FLAGS_MOVE) {
-        event = std::make_shared<QMouseEvent>(QEvent::MouseMove, position, QPointF{}, button, button, Qt::NoModifier);
     } else {
         event = std::make_shared<QMouseEvent>(QEvent::MouseButtonRelease, position, QPointF{}, button, button, Qt::NoModifier);
     }
-    Q_EMIT inputEvent(event);
+    queueEvent(event);
 
     return true;
 }
 
 bool InputHandler::extendedMouseEvent(uint16_t x, uint16_t y, uint16_t flags)
 {
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
     if (flags & PTR_FLAGS_MOVE) {
         return mouseEvent(x, y, PTR_FLAGS_MOVE);
     }
@@ -195,6 +253,8 @@ bool InputHandler::extendedMouseEvent(uint16_t x, uint16_t y, uint16_t flags)
         return false;
     }
 
+    flushMotion();
+
     std::shared_ptr<QMouseEvent> event;
     if (flags & PTR_XFLAGS_DOWN) {
         event = std::make_shared<QMouseEvent>(QEvent::MouseButtonPress, QPointF(x, y), QPointF{}, button, button, Qt::KeyboardModifiers{});
@@ -202,13 +262,17 @@ bool InputHandler::extendedMouseEvent(uint16_t x, uint16_t y, uint16_t flags)
     } else {
         event = std::make_shared<QMouseEvent>(QEvent::MouseButtonRelease, QPointF(x, y), QPointF{}, button, button, Qt::KeyboardModifiers{});
     }
-    Q_EMIT inputEvent(event);
+    queueEvent(event);
 
     return true;
 }
 
 bool InputHandler::keyboardEvent(uint16_t code, uint16_t flags)
 {
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
     auto virtualCode = GetVirtualKeyCodeFromVirtualScanCode(flags & KBD_FLAGS_EXTENDED ? code | KBDEXT : code, 4);
     virtualCode = flags & KBD_FLAGS_EXTENDED ? virtualCode | KBDEXT : virtualCode;
 
@@ -216,6 +280,8 @@ bool InputHandler::keyboardEvent(uint16_t code, uint16_t flags)
 
     auto type = flags & KBD_FLAGS_RELEASE ? QEvent::KeyRelease : QEvent::KeyPress;
 
+    flushMotion();
+
     if (type == QEvent::KeyRelease) {
         d->pressedKeys.remove(keycode);
     } else {
@@ -223,13 +289,17 @@ bool InputHandler::keyboardEvent(uint16_t code, uint16_t flags)
     }
 
     auto event = std::make_shared<QKeyEvent>(type, 0, Qt::KeyboardModifiers{}, keycode, 0, 0);
-    Q_EMIT inputEvent(event);
+    queueEvent(event);
 
     return true;
 }
 
 bool InputHandler::unicodeKeyboardEvent(uint16_t code, uint16_t flags)
 {
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
     auto text = QString(QChar::fromUcs2(code));
     auto keysym = xkb_utf32_to_keysym(text.toUcs4().first());
     if (!keysym) {
@@ -238,12 +308,68 @@ bool InputHandler::unicodeKeyboardEvent(uint16_t code, uint16_t flags)
 
     auto type = flags & KBD_FLAGS_RELEASE ? QEvent::KeyRelease : QEvent::KeyPress;
 
+    flushMotion();
+
     auto event = std::make_shared<QKeyEvent>(type, 0, Qt::KeyboardModifiers{}, 0, keysym, 0);
-    Q_EMIT inputEvent(event);
+    queueEvent(event);
 
     return true;
 }
 
+void InputHandler::queueMotion(const QPointF &position)
+{
+    if (d->motionTimer.interval() > 0 && d->motionTimer.isActive()) {
+        d->pendingMotion = position;
+        return;
+    }
+
+    auto event = std::make_shared<QMouseEvent>(QEvent::MouseMove, position, QPointF{}, Qt::NoButton, Qt::NoButton, Qt::NoModifier);
+    queueEvent(event);
+
+    if (d->motionTimer.interval() > 0) {
+        d->motionTimer.start();
+    }
+}
+
+void InputHandler::flushMotion()
+{
+    if (!d->pendingMotion) {
+        return;
+    }
+
+    auto position = *std::exchange(d->pendingMotion, std::nullopt);
+    auto event = std::make_shared<QMouseEvent>(QEvent::MouseMove, position, QPointF{}, Qt::NoButton, Qt::NoButton, Qt::NoModifier);
+    queueEvent(event);
+}
+
+void InputHandler::onMotionTimeout()
+{
+    auto batch = qScopeGuard([this]() {
+        sendEvents();
+    });
+
+    // Keep the timer running while motion keeps arriving so that the next
+    // motion after an idle period is again sent without delay.
+    if (d->pendingMotion) {
+        flushMotion();
+        d->motionTimer.start();
+    }
+}
+
+void InputHandler::queueEvent(const std::shared_ptr<QEvent> &event)
+{
+    d->events.push_back(event);
+}
+
+void InputHandler::sendEvents()
+{
+    if (d->events.empty()) {
+        return;
+    }
+
+    Q_EMIT inputEvents(std::exchange(d->events, {}));
+}
+
 }
 
 #include "moc_InputHandler.cpp"
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <QInputEvent>
 #include <QObject>
@@ -37,12 +38,28 @@ public:
     void initialize(rdpInput *input);
 
     /**
-     * Emitted whenever a new input event was received from the client.
+     * Set the rate at which coalesced pointer motion is flushed.
      *
-     * \param event The input event that was received.
+     * Consecutive absolute pointer motions are merged and forwarded at most
+     * this many times per second. Any other input event flushes a pending
+     * motion first so event ordering is preserved. A rate of 0 disables
+     * coalescing and forwards every motion as it arrives.
+     *
+     * \param rate The flush rate, usually the capture frame rate.
+     */
+    void setMotionFlushRate(int rate);
+
+    /**
+     * Emitted whenever new input events were received from the client.
+     *
+     * The events produced by a single client input event are emitted together,
+     * so a pending coalesced motion is delivered in the same batch as the
+     * button or key event that flushed it.
+     *
+     * \param events The input events that were received, in order.
      */
-    // Note: Intentional pass-by-value to ensure lifetime of the shared_ptr is extended.
-    Q_SIGNAL void inputEvent(std::shared_ptr<QInputEvent> event);
+    // Note: Intentional pass-by-value to ensure lifetime of the shared_ptrs is extended.
+    Q_SIGNAL void inputEvents(std::vector<std::shared_ptr<QEvent>> events);
 
 private:
     // FreeRDP callbacks that need to call the event handler functions in the
@@ -71,6 +88,24 @@ private:
     bool keyboardEvent(uint16_t code, uint16_t flags);
     bool unicodeKeyboardEvent(uint16_t code, uint16_t flags);
 
+    /**
+     * Emit a pointer motion, or hold it back if one was emitted recently.
+     */
+    void queueMotion(const QPointF &position);
+    /**
+     * Emit any pending coalesced pointer motion.
+     */
+    void flushMotion();
+    void onMotionTimeout();
+    /**
+     * Add an event to the current batch.
+     */
+    void queueEvent(const std::shared_ptr<QEvent> &event);
+    /**
+     * Emit the current batch of events, if any.
+     */
+    void sendEvents();
+
     class Private;
     const std::unique_ptr<Private> d;
 };
@@ -9,10 +9,15 @@
 
 #include "NetworkDetection.h"
 
-#include <ranges>
-
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <optional>
 
+#include <QHash>
 #include <QQueue>
 #include <QTimer>
 
@@ -27,12 +32,39 @@ namespace KRdp
 namespace clk = std::chrono;
 
 constexpr auto rttUpdateInterval = clk::milliseconds(70);
+// While no video is being sent, probe less often but often enough that a fresh
+// estimate is available once streaming resumes.
+constexpr auto idleRttUpdateInterval = clk::milliseconds(250);
+constexpr auto activityTimeout = clk::seconds(1);
+// Retry interval while the transport is write blocked.
+constexpr auto saturatedRetryInterval = clk::milliseconds(20);
 constexpr auto rttAverageInterval = clk::milliseconds(500);
+// The base RTT is the minimum over this much longer window, like the min_rtt filter of BBR,
+// so a standing queue that builds up over a few seconds does not become the baseline.
+constexpr auto baseRttInterval = clk::seconds(10);
 constexpr auto networkResultInterval = clk::seconds(1);
+// Probes not answered within this time are considered lost.
+constexpr auto rttProbeTimeout = clk::seconds(2);
+
+// Number of RTT samples kept for the sliding minimum and the percentiles. At one
+// probe per rttUpdateInterval this covers well over rttAverageInterval.
+constexpr size_t rttSampleCapacity = 64;
+// Capacity of the base RTT candidates, covering every probe sent in baseRttInterval.
+constexpr size_t baseRttCandidateCapacity = 256;
+// Smoothing factors as used by TCP for SRTT and RTTVAR (RFC 6298).
+constexpr double rttEwmaAlpha = 1.0 / 8.0;
+constexpr double rttVarianceBeta = 1.0 / 4.0;
+constexpr double probeLossAlpha = 1.0 / 16.0;
 
 constexpr auto bandwidthMeasureDuration = clk::milliseconds(500);
 constexpr auto bandwidthMeasureInterval = clk::seconds(2);
 
+// Delivery rate samples older than this no longer count towards the estimate.
+constexpr auto deliveryRateWindow = clk::seconds(2);
+// Frames that were never acknowledged are forgotten after this time.
+constexpr auto sentFrameTimeout = clk::seconds(10);
+constexpr size_t deliveryRateSampleCapacity = 128;
+
 BOOL rttMeasureResponse(rdpAutoDetect *rdpAutodetect, RDP_TRANSPORT_TYPE, uint16_t sequence)
 {
     auto context = reinterpret_cast<PeerContext *>(rdpAutodetect->context);
@@ -56,6 +88,164 @@ struct RTTMeasurement {
     clk::system_clock::duration roundTripTime;
 };
 
+/**
+ * Fixed capacity FIFO. Pushing onto a full buffer drops the oldest entry.
+ */
+template<typename T, size_t Capacity>
+class RingBuffer
+{
+public:
+    bool empty() const
+    {
+        return m_count == 0;
+    }
+    bool full() const
+    {
+        return m_count == Capacity;
+    }
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    const T &front() const
+    {
+        return m_items[m_head];
+    }
+    const T &back() const
+    {
+        return m_items[(m_head + m_count - 1) % Capacity];
+    }
+    const T &operator[](size_t index) const
+    {
+        return m_items[(m_head + index) % Capacity];
+    }
+
+    void pushBack(const T &item)
+    {
+        if (full()) {
+            popFront();
+        }
+        m_items[(m_head + m_count) % Capacity] = item;
+        ++m_count;
+    }
+    void popFront()
+    {
+        m_head = (m_head + 1) % Capacity;
+        --m_count;
+    }
+    void popBack()
+    {
+        --m_count;
+    }
+
+private:
+    std::array<T, Capacity> m_items;
+    size_t m_head = 0;
+    size_t m_count = 0;
+};
+
+struct DeliveryRateSample {
+    clk::steady_clock::time_point time;
+    uint64_t bytesPerSecond;
+};
+
+/**
+ * Passive delivery rate estimation, in the style of BBR.
+ *
+ * For every frame we remember how much data had been acknowledged when it was
+ * sent. Once the frame is acknowledged, the data acknowledged in between over
+ * the time that took gives a delivery rate sample. The estimate is the maximum
+ * sample within deliveryRateWindow, since most samples are limited by how fast
+ * frames are produced rather than by the network.
+ */
+class DeliveryRateEstimator
+{
+public:
+    void frameSent(uint32_t frameId, uint64_t bytes)
+    {
+        const auto now = clk::steady_clock::now();
+        std::lock_guard lock(m_mutex);
+
+        // Nothing in flight: restart the delivery clock, otherwise the idle
+        // time would be counted against the next sample.
+        if (m_sentFrames.isEmpty()) {
+            m_deliveredTime = now;
+            m_firstSentTime = now;
+        }
+
+        for (auto it = m_sentFrames.begin(); it != m_sentFrames.end();) {
+            if (now - it->sendTime > sentFrameTimeout) {
+                it = m_sentFrames.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        m_sentFrames.insert(frameId,
+                            SentFrame{
+                                .sendTime = now,
+                                .firstSentTime = m_firstSentTime,
+                                .deliveredTime = m_deliveredTime,
+                                .delivered = m_delivered,
+                                .bytes = bytes,
+                            });
+    }
+
+    std::optional<uint64_t> frameAcknowledged(uint32_t frameId)
+    {
+        const auto now = clk::steady_clock::now();
+        std::lock_guard lock(m_mutex);
+
+        const auto it = m_sentFrames.constFind(frameId);
+        if (it == m_sentFrames.cend()) {
+            return std::nullopt;
+        }
+        const auto frame = *it;
+        m_sentFrames.erase(it);
+
+        m_delivered += frame.bytes;
+        m_deliveredTime = now;
+        m_firstSentTime = frame.sendTime;
+
+        const auto sendElapsed = frame.sendTime - frame.firstSentTime;
+        const auto ackElapsed = now - frame.deliveredTime;
+        const auto interval = std::max(sendElapsed, ackElapsed);
+        if (interval < clk::milliseconds(1)) {
+            return std::nullopt;
+        }
+
+        const auto rate = uint64_t((m_delivered - frame.delivered) / clk::duration<double>(interval).count());
+
+        // Windowed maximum over a monotonic deque: rates decrease from front to back.
+        while (!m_samples.empty() && now - m_samples.front().time > deliveryRateWindow) {
+            m_samples.popFront();
+        }
+        while (!m_samples.empty() && m_samples.back().bytesPerSecond <= rate) {
+            m_samples.popBack();
+        }
+        m_samples.pushBack(DeliveryRateSample{now, rate});
+
+        return m_samples.front().bytesPerSecond;
+    }
+
+private:
+    struct SentFrame {
+        clk::steady_clock::time_point sendTime;
+        clk::steady_clock::time_point firstSentTime;
+        clk::steady_clock::time_point deliveredTime;
+        uint64_t delivered;
+        uint64_t bytes;
+    };
+
+    std::mutex m_mutex;
+    QHash<uint32_t, SentFrame> m_sentFrames;
+    uint64_t m_delivered = 0;
+    clk::steady_clock::time_point m_deliveredTime;
+    clk::steady_clock::time_point m_firstSentTime;
+    RingBuffer<DeliveryRateSample, deliveryRateSampleCapacity> m_samples;
+};
+
 class NetworkDetection::Private
 {
 public:
@@ -68,16 +258,47 @@ public:
 
     uint32_t sequenceNumber = 0;
 
-    uint32_t lastBandwithMeasurement = 0;
+    // In kilobits per second, as reported to the client. Written on the rdpgfx
+    // thread by frameAcknowledged() as well as on the connection thread.
+    std::atomic<uint32_t> lastBandwithMeasurement{0};
+
+    DeliveryRateEstimator deliveryRateEstimator;
+    std::atomic<uint64_t> deliveryRate{0};
+    std::atomic<clk::system_clock::time_point> lastDeliveryRateSample;
 
     bool rttEnabled = false;
     clk::system_clock::time_point lastRttUpdate;
+    clk::system_clock::time_point nextRttUpdate;
+    // Last time a video frame was sent, written from the frame submission thread.
+    std::atomic<clk::system_clock::time_point> lastActivity;
+    bool idle = true;
     QHash<uint32_t, clk::system_clock::time_point> rttRequests;
-    std::vector<RTTMeasurement> rttMeasurements;
+    // Samples within rttAverageInterval, oldest first.
+    RingBuffer<RTTMeasurement, rttSampleCapacity> rttMeasurements;
+    // Monotonic deque over rttMeasurements: round trip times increase from
+    // front to back, so the front is always the minimum of the window.
+    RingBuffer<RTTMeasurement, rttSampleCapacity> rttMinimumCandidates;
+    // Same as rttMinimumCandidates, but over baseRttInterval.
+    RingBuffer<RTTMeasurement, baseRttCandidateCapacity> baseRttCandidates;
+    double smoothedRttMs = 0.0;
+    double rttVarianceMs = 0.0;
+    bool hasSmoothedRtt = false;
+    double probeLoss = 0.0;
 
     // Published as atomic tick counts so the getters are safe to read from any thread.
     std::atomic<clk::system_clock::rep> minimumRttTicks{0};
+    std::atomic<clk::system_clock::rep> baseRttTicks{0};
     std::atomic<clk::system_clock::rep> averageRttTicks{0};
+    std::atomic<clk::system_clock::rep> rttJitterTicks{0};
+    std::atomic<clk::system_clock::rep> medianRttTicks{0};
+    std::atomic<clk::system_clock::rep> rtt95thPercentileTicks{0};
+    std::atomic<double> publishedProbeLoss{0.0};
+
+    void addRttSample(const RTTMeasurement &rtt);
+    void expireRttSamples(clk::system_clock::time_point now);
+    void expireProbes(clk::system_clock::time_point now);
+    void updateProbeLoss(bool lost);
+    bool isSaturated() const;
 
     clk::system_clock::time_point lastNetworkResult;
 
@@ -99,11 +320,60 @@ std::chrono::system_clock::duration NetworkDetection::minimumRTT() const
     return clk::system_clock::duration(d->minimumRttTicks.load());
 }
 
+std::chrono::system_clock::duration NetworkDetection::baseRTT() const
+{
+    return clk::system_clock::duration(d->baseRttTicks.load());
+}
+
 std::chrono::system_clock::duration NetworkDetection::averageRTT() const
 {
     return clk::system_clock::duration(d->averageRttTicks.load());
 }
 
+std::chrono::system_clock::duration NetworkDetection::rttJitter() const
+{
+    return clk::system_clock::duration(d->rttJitterTicks.load());
+}
+
+std::chrono::system_clock::duration NetworkDetection::medianRTT() const
+{
+    return clk::system_clock::duration(d->medianRttTicks.load());
+}
+
+std::chrono::system_clock::duration NetworkDetection::rtt95thPercentile() const
+{
+    return clk::system_clock::duration(d->rtt95thPercentileTicks.load());
+}
+
+double NetworkDetection::probeLoss() const
+{
+    return d->publishedProbeLoss.load();
+}
+
+uint64_t NetworkDetection::deliveryRate() const
+{
+    return d->deliveryRate.load();
+}
+
+void NetworkDetection::frameSent(uint32_t frameId, uint64_t bytes)
+{
+    d->deliveryRateEstimator.frameSent(frameId, bytes);
+    d->lastActivity = clk::system_clock::now();
+}
+
+void NetworkDetection::frameAcknowledged(uint32_t frameId)
+{
+    const auto rate = d->deliveryRateEstimator.frameAcknowledged(frameId);
+    if (!rate) {
+        return;
+    }
+
+    d->deliveryRate.store(*rate);
+    d->lastDeliveryRateSample = clk::system_clock::now();
+    d->lastBandwithMeasurement.store(static_cast<uint32_t>(std::min<uint64_t>(*rate * 8 / 1000, std::numeric_limits<uint32_t>::max())));
+    Q_EMIT deliveryRateChanged();
+}
+
 void NetworkDetection::initialize()
 {
     d->rdpAutodetect = d->session->rdpPeerContext()->autodetect;
@@ -142,22 +412,55 @@ void NetworkDetection::update()
 
     if (d->state == State::PendingStop && (now - d->bandwidthMeasureStartTime) >= bandwidthMeasureDuration) {
         stopBandwidthMeasure();
-    } else if (d->state == State::None && (now - d->lastBandwidthMeasureStart) >= bandwidthMeasureInterval) {
+    } else if (d->state == State::None && (now - d->lastBandwidthMeasureStart) >= bandwidthMeasureInterval
+               && (now - d->lastDeliveryRateSample.load()) >= bandwidthMeasureInterval) {
+        // Only measure actively while acknowledged frames give no passive estimate.
         d->lastBandwidthMeasureStart = now;
         startBandwidthMeasure();
     }
 
-    if ((now - d->lastRttUpdate) < rttUpdateInterval) {
+    // Probe immediately when video starts flowing again after an idle period,
+    // so the first frames are paced by a current estimate.
+    const bool active = (now - d->lastActivity.load()) < activityTimeout;
+    const bool resumed = active && d->idle;
+    d->idle = !active;
+
+    if (!resumed && now < d->nextRttUpdate) {
+        return;
+    }
+
+    // Probes would only queue behind the pending data and measure our own send
+    // buffer, so hold them back until the transport accepts data again.
+    if (d->isSaturated()) {
+        d->nextRttUpdate = now + saturatedRetryInterval;
         return;
     }
 
     d->lastRttUpdate = now;
+    d->nextRttUpdate = now + (active ? rttUpdateInterval : idleRttUpdateInterval);
+
+    d->expireProbes(now);
 
     auto sequence = d->nextSequenceNumber();
     d->rttRequests.insert(sequence, now);
     d->rdpAutodetect->RTTMeasureRequest(d->rdpAutodetect, RDP_TRANSPORT_TCP, sequence);
 }
 
+std::optional<std::chrono::milliseconds> NetworkDetection::timeUntilUpdate() const
+{
+    if (d->session->state() != RdpConnection::State::Streaming) {
+        return std::nullopt;
+    }
+
+    auto deadline = d->nextRttUpdate;
+    if (d->state == State::PendingStop) {
+        deadline = std::min(deadline, d->bandwidthMeasureStartTime + bandwidthMeasureDuration);
+    }
+
+    const auto remaining = clk::ceil<clk::milliseconds>(deadline - clk::system_clock::now());
+    return std::max(remaining, clk::milliseconds(0));
+}
+
 bool NetworkDetection::onRttMeasureResponse(uint16_t sequence)
 {
     if (!d->rttRequests.contains(sequence)) {
@@ -168,11 +471,13 @@ bool NetworkDetection::onRttMeasureResponse(uint16_t sequence)
     rtt.measurementTime = clk::system_clock::now();
     rtt.roundTripTime = rtt.measurementTime - d->rttRequests.take(sequence);
 
+    d->updateProbeLoss(false);
+
     if (rtt.roundTripTime.count() <= 0) {
         return true;
     }
 
-    d->rttMeasurements.push_back(std::move(rtt));
+    d->addRttSample(rtt);
 
     updateAverageRtt();
 
@@ -191,7 +496,8 @@ bool NetworkDetection::onBandwidthMeasureResults(uint32_t timeDelta, uint32_t by
         return true;
     }
 
-    d->lastBandwithMeasurement = static_cast<uint32_t>((static_cast<uint64_t>(byteCount) * 1000ULL) / static_cast<uint64_t>(timeDelta));
+    // byteCount over timeDelta milliseconds, in kilobits per second.
+    d->lastBandwithMeasurement.store(static_cast<uint32_t>((static_cast<uint64_t>(byteCount) * 8ULL) / static_cast<uint64_t>(timeDelta)));
 
     updateAverageRtt();
 
@@ -201,29 +507,38 @@ bool NetworkDetection::onBandwidthMeasureResults(uint32_t timeDelta, uint32_t by
 void NetworkDetection::updateAverageRtt()
 {
     auto now = clk::system_clock::now();
-    d->rttMeasurements.erase(std::remove_if(d->rttMeasurements.begin(),
-                                            d->rttMeasurements.end(),
-                                            [now](const auto &measurement) {
-                                                return (now - measurement.measurementTime) > rttAverageInterval;
-                                            }),
-                             d->rttMeasurements.end());
+    d->expireRttSamples(now);
     if (d->rttMeasurements.empty()) {
         return;
     }
 
-    auto minimum = std::numeric_limits<clk::system_clock::duration>::max();
-    auto sum = clk::system_clock::duration(0);
-    std::for_each(d->rttMeasurements.begin(), d->rttMeasurements.end(), [&minimum, &sum](const auto &measurement) {
-        minimum = std::min(minimum, measurement.roundTripTime);
-        sum = sum + measurement.roundTripTime;
-    });
-    const auto average = sum / d->rttMeasurements.size();
+    const auto minimum = d->rttMinimumCandidates.front().roundTripTime;
+    const auto average = clk::duration_cast<clk::system_clock::duration>(clk::duration<double, std::milli>(d->smoothedRttMs));
+
+    // Percentiles over the window; it holds at most rttSampleCapacity samples.
+    std::array<clk::system_clock::duration, rttSampleCapacity> sorted;
+    const auto count = d->rttMeasurements.size();
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = d->rttMeasurements[i].roundTripTime;
+    }
+    const auto percentile = [&sorted, count](double p) {
+        auto nth = sorted.begin() + std::min(count - 1, size_t(p * count));
+        std::nth_element(sorted.begin(), nth, sorted.begin() + count);
+        return *nth;
+    };
+
     d->minimumRttTicks.store(minimum.count());
+    d->baseRttTicks.store(d->baseRttCandidates.front().roundTripTime.count());
     d->averageRttTicks.store(average.count());
+    d->rttJitterTicks.store(clk::duration_cast<clk::system_clock::duration>(clk::duration<double, std::milli>(d->rttVarianceMs)).count());
+    d->medianRttTicks.store(percentile(0.5).count());
+    d->rtt95thPercentileTicks.store(percentile(0.95).count());
+    d->publishedProbeLoss.store(d->probeLoss);
 
     Q_EMIT rttChanged();
 
-    if (d->lastBandwithMeasurement == 0) {
+    const auto bandwidth = d->lastBandwithMeasurement.load();
+    if (bandwidth == 0) {
         return;
     }
 
@@ -237,20 +552,88 @@ void NetworkDetection::updateAverageRtt()
     result.type = RDP_NETCHAR_RESULT_TYPE_BASE_RTT_BW_AVG_RTT;
     result.baseRTT = clk::duration_cast<clk::milliseconds>(minimum).count();
     result.averageRTT = clk::duration_cast<clk::milliseconds>(average).count();
-    result.bandwidth = d->lastBandwithMeasurement;
+    result.bandwidth = bandwidth;
     d->rdpAutodetect->NetworkCharacteristicsResult(d->rdpAutodetect, RDP_TRANSPORT_TCP, d->nextSequenceNumber(), &result);
 }
 
+bool NetworkDetection::Private::isSaturated() const
+{
+    auto peer = session->rdpPeer();
+    return peer->IsWriteBlocked && peer->IsWriteBlocked(peer);
+}
+
 uint32_t NetworkDetection::Private::nextSequenceNumber()
 {
-    auto sequence = sequenceNumber;
+    // Responses only carry 16 bits of sequence number, so wrap around there.
+    auto sequence = uint16_t(sequenceNumber);
     while (sequence == 0 || rttRequests.contains(sequence)) {
         ++sequence;
     }
-    sequenceNumber = sequence + 1;
+    sequenceNumber = uint16_t(sequence + 1);
     return sequence;
 }
 
+void NetworkDetection::Private::addRttSample(const RTTMeasurement &rtt)
+{
+    // A full buffer drops its oldest sample, which may be the current minimum.
+    if (rttMeasurements.full() && !rttMinimumCandidates.empty()
+        && rttMinimumCandidates.front().measurementTime <= rttMeasurements.front().measurementTime) {
+        rttMinimumCandidates.popFront();
+    }
+    rttMeasurements.pushBack(rtt);
+
+    while (!rttMinimumCandidates.empty() && rttMinimumCandidates.back().roundTripTime >= rtt.roundTripTime) {
+        rttMinimumCandidates.popBack();
+    }
+    rttMinimumCandidates.pushBack(rtt);
+
+    while (!baseRttCandidates.empty() && baseRttCandidates.back().roundTripTime >= rtt.roundTripTime) {
+        baseRttCandidates.popBack();
+    }
+    baseRttCandidates.pushBack(rtt);
+
+    const double sampleMs = clk::duration<double, std::milli>(rtt.roundTripTime).count();
+    if (!hasSmoothedRtt) {
+        smoothedRttMs = sampleMs;
+        rttVarianceMs = sampleMs / 2.0;
+        hasSmoothedRtt = true;
+    } else {
+        rttVarianceMs = (1.0 - rttVarianceBeta) * rttVarianceMs + rttVarianceBeta * std::abs(smoothedRttMs - sampleMs);
+        smoothedRttMs = (1.0 - rttEwmaAlpha) * smoothedRttMs + rttEwmaAlpha * sampleMs;
+    }
+}
+
+void NetworkDetection::Private::expireRttSamples(clk::system_clock::time_point now)
+{
+    while (!rttMeasurements.empty() && (now - rttMeasurements.front().measurementTime) > rttAverageInterval) {
+        rttMeasurements.popFront();
+    }
+    while (!rttMinimumCandidates.empty() && (now - rttMinimumCandidates.front().measurementTime) > rttAverageInterval) {
+        rttMinimumCandidates.popFront();
+    }
+    // Always keep the latest sample, so there is a base RTT while probes are sparse.
+    while (baseRttCandidates.size() > 1 && (now - baseRttCandidates.front().measurementTime) > baseRttInterval) {
+        baseRttCandidates.popFront();
+    }
+}
+
+void NetworkDetection::Private::expireProbes(clk::system_clock::time_point now)
+{
+    for (auto it = rttRequests.begin(); it != rttRequests.end();) {
+        if (now - it.value() > rttProbeTimeout) {
+            it = rttRequests.erase(it);
+            updateProbeLoss(true);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void NetworkDetection::Private::updateProbeLoss(bool lost)
+{
+    probeLoss = (1.0 - probeLossAlpha) * probeLoss + probeLossAlpha * (lost ? 1.0 : 0.0);
+}
+
 } // namespace KRdp
 
 #include "moc_NetworkDetection.cpp"
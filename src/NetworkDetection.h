@@ -6,6 +6,7 @@
 
 #include <chrono>
 #include <memory>
+#include <optional>
 
 #include <QObject>
 
@@ -34,10 +35,42 @@ public:
 
     Q_PROPERTY(std::chrono::system_clock::duration minimumRTT READ minimumRTT NOTIFY rttChanged)
     std::chrono::system_clock::duration minimumRTT() const;
+    /**
+     * Minimum round trip time over the last ten seconds.
+     *
+     * Unlike minimumRTT(), which only covers the samples used for the
+     * average, this does not rise along with a queue that persists for a few
+     * seconds, so it can be used as baseline to detect queuing delay.
+     */
+    Q_PROPERTY(std::chrono::system_clock::duration baseRTT READ baseRTT NOTIFY rttChanged)
+    std::chrono::system_clock::duration baseRTT() const;
     Q_PROPERTY(std::chrono::system_clock::duration averageRTT READ averageRTT NOTIFY rttChanged)
     std::chrono::system_clock::duration averageRTT() const;
+    /**
+     * Smoothed mean deviation of the round trip time.
+     */
+    Q_PROPERTY(std::chrono::system_clock::duration rttJitter READ rttJitter NOTIFY rttChanged)
+    std::chrono::system_clock::duration rttJitter() const;
+    Q_PROPERTY(std::chrono::system_clock::duration medianRTT READ medianRTT NOTIFY rttChanged)
+    std::chrono::system_clock::duration medianRTT() const;
+    Q_PROPERTY(std::chrono::system_clock::duration rtt95thPercentile READ rtt95thPercentile NOTIFY rttChanged)
+    std::chrono::system_clock::duration rtt95thPercentile() const;
+    /**
+     * Smoothed fraction, from 0 to 1, of RTT probes that were never answered.
+     */
+    Q_PROPERTY(double probeLoss READ probeLoss NOTIFY rttChanged)
+    double probeLoss() const;
+    /**
+     * Passively estimated delivery rate, in bytes per second.
+     *
+     * Derived from the size of sent video frames and the time until the client
+     * acknowledges them, see frameSent() and frameAcknowledged().
+     */
+    Q_PROPERTY(uint64_t deliveryRate READ deliveryRate NOTIFY deliveryRateChanged)
+    uint64_t deliveryRate() const;
 
     Q_SIGNAL void rttChanged();
+    Q_SIGNAL void deliveryRateChanged();
 
     void initialize();
 
@@ -45,6 +78,23 @@ public:
     void stopBandwidthMeasure();
 
     void update();
+    /**
+     * Time until update() needs to be called again.
+     *
+     * RdpConnection uses this as timeout while waiting for connection events,
+     * so probes are sent on schedule even when the connection is otherwise
+     * quiet. Returns std::nullopt if nothing is scheduled.
+     */
+    std::optional<std::chrono::milliseconds> timeUntilUpdate() const;
+
+    /**
+     * Record that a video frame of \p bytes was sent. Safe to call from any thread.
+     */
+    void frameSent(uint32_t frameId, uint64_t bytes);
+    /**
+     * Record that the client acknowledged a video frame.
+     */
+    void frameAcknowledged(uint32_t frameId);
 
 private:
     friend BOOL rttMeasureResponse(rdpAutoDetect *, RDP_TRANSPORT_TYPE, uint16_t);
@@ -4,9 +4,17 @@
 
 #include "PlasmaScreencastV1Session.h"
 
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <vector>
+
 #include <QGuiApplication>
+#include <QHash>
 #include <QMouseEvent>
 #include <QQueue>
+#include <QScreen>
+#include <QVarLengthArray>
 #include <QWaylandClientExtensionTemplate>
 #include <qpa/qplatformnativeinterface.h>
 
@@ -62,30 +70,18 @@ class Xkb : public QtWayland::wl_keyboard
 {
 public:
     struct Code {
-        const uint32_t level;
-        const uint32_t code;
+        // Evdev keycodes of the modifiers that need to be held to reach the
+        // level the keysym is on, e.g. Shift or AltGr.
+        QVarLengthArray<uint32_t, 2> modifiers;
+        uint32_t code = 0;
     };
-    std::optional<Code> keycodeFromKeysym(xkb_keysym_t keysym)
+    std::optional<Code> keycodeFromKeysym(xkb_keysym_t keysym) const
     {
-        /* The offset between KEY_* numbering, and keycodes in the XKB evdev
-         * dataset. */
-        static const uint EVDEV_OFFSET = 8;
-
-        auto layout = xkb_state_serialize_layout(m_state.get(), XKB_STATE_LAYOUT_EFFECTIVE);
-        const xkb_keycode_t max = xkb_keymap_max_keycode(m_keymap.get());
-        for (xkb_keycode_t keycode = xkb_keymap_min_keycode(m_keymap.get()); keycode < max; keycode++) {
-            uint levelCount = xkb_keymap_num_levels_for_key(m_keymap.get(), keycode, layout);
-            for (uint currentLevel = 0; currentLevel < levelCount; currentLevel++) {
-                const xkb_keysym_t *syms;
-                uint num_syms = xkb_keymap_key_get_syms_by_level(m_keymap.get(), keycode, layout, currentLevel, &syms);
-                for (uint sym = 0; sym < num_syms; sym++) {
-                    if (syms[sym] == keysym) {
-                        return Code{currentLevel, keycode - EVDEV_OFFSET};
-                    }
-                }
-            }
+        const auto it = m_keysymIndex.constFind(keysym);
+        if (it == m_keysymIndex.cend()) {
+            return {};
         }
-        return {};
+        return *it;
     }
 
     static Xkb *self()
@@ -95,6 +91,12 @@ public:
     }
 
 private:
+    /* The offset between KEY_* numbering, and keycodes in the XKB evdev
+     * dataset. */
+    static constexpr uint EVDEV_OFFSET = 8;
+    // Masks to consider per shift level, more than any real keymap uses.
+    static constexpr size_t MaximumLevelMasks = 8;
+
     Xkb()
     {
         m_ctx.reset(xkb_context_new(XKB_CONTEXT_NO_FLAGS));
@@ -112,12 +114,114 @@ private:
             qCWarning(KRDP) << "Failed to create the xkb state";
             return;
         }
+        rebuildIndex();
 
         QPlatformNativeInterface *nativeInterface = qGuiApp->platformNativeInterface();
         auto seat = static_cast<wl_seat *>(nativeInterface->nativeResourceForIntegration("wl_seat"));
         init(wl_seat_get_keyboard(seat));
     }
 
+    /**
+     * Build the keysym to keycode index for the current keymap and layout.
+     *
+     * Each keysym maps to the key and modifiers that produce it at the lowest
+     * shift level, so looking up a keysym does not walk the keymap.
+     */
+    void rebuildIndex()
+    {
+        m_keysymIndex.clear();
+        if (!m_keymap || !m_state) {
+            return;
+        }
+
+        m_layout = xkb_state_serialize_layout(m_state.get(), XKB_STATE_LAYOUT_EFFECTIVE);
+
+        const xkb_keycode_t min = xkb_keymap_min_keycode(m_keymap.get());
+        const xkb_keycode_t max = xkb_keymap_max_keycode(m_keymap.get());
+
+        // Find a key for every modifier that selects a shift level, along with
+        // the modifier mask it sets when pressed.
+        QVarLengthArray<std::pair<uint32_t, xkb_mod_mask_t>, 4> modifierKeys;
+        for (const xkb_keysym_t modifierSym : {XKB_KEY_Shift_L, XKB_KEY_ISO_Level3_Shift, XKB_KEY_ISO_Level5_Shift, XKB_KEY_Control_L, XKB_KEY_Alt_L}) {
+            const auto keycode = levelZeroKeycode(modifierSym, min, max);
+            if (!keycode) {
+                continue;
+            }
+            ScopedXKBState scratch(xkb_state_new(m_keymap.get()));
+            if (!scratch) {
+                continue;
+            }
+            xkb_state_update_key(scratch.get(), *keycode, XKB_KEY_DOWN);
+            const xkb_mod_mask_t mask = xkb_state_serialize_mods(scratch.get(), XKB_STATE_MODS_DEPRESSED);
+            if (mask) {
+                modifierKeys.append({*keycode - EVDEV_OFFSET, mask});
+            }
+        }
+
+        // Resolve a modifier mask to the keys to press, if they all exist.
+        auto modifiersForMask = [&modifierKeys](xkb_mod_mask_t mask) -> std::optional<QVarLengthArray<uint32_t, 2>> {
+            QVarLengthArray<uint32_t, 2> modifiers;
+            for (const auto &[modifierCode, modifierMask] : modifierKeys) {
+                if (mask & modifierMask) {
+                    modifiers.append(modifierCode);
+                    mask &= ~modifierMask;
+                }
+            }
+            if (mask) {
+                return std::nullopt;
+            }
+            return modifiers;
+        };
+
+        QHash<xkb_keysym_t, xkb_level_index_t> levels;
+        for (xkb_keycode_t keycode = min; keycode <= max; keycode++) {
+            const xkb_level_index_t levelCount = xkb_keymap_num_levels_for_key(m_keymap.get(), keycode, m_layout);
+            for (xkb_level_index_t level = 0; level < levelCount; level++) {
+                Code code;
+                code.code = keycode - EVDEV_OFFSET;
+                if (level > 0) {
+                    // A level can usually be reached with several masks, some of which
+                    // need modifiers we can't press, such as Lock. Use the first one we can.
+                    std::array<xkb_mod_mask_t, MaximumLevelMasks> masks;
+                    const size_t maskCount = xkb_keymap_key_get_mods_for_level(m_keymap.get(), keycode, m_layout, level, masks.data(), masks.size());
+                    std::optional<QVarLengthArray<uint32_t, 2>> modifiers;
+                    for (size_t i = 0; i < maskCount && !modifiers; i++) {
+                        modifiers = modifiersForMask(masks[i]);
+                    }
+                    if (!modifiers) {
+                        continue;
+                    }
+                    code.modifiers = *modifiers;
+                }
+
+                const xkb_keysym_t *syms;
+                const int symCount = xkb_keymap_key_get_syms_by_level(m_keymap.get(), keycode, m_layout, level, &syms);
+                for (int sym = 0; sym < symCount; sym++) {
+                    const auto existing = levels.constFind(syms[sym]);
+                    if (existing == levels.cend() || *existing > level) {
+                        levels.insert(syms[sym], level);
+                        m_keysymIndex.insert(syms[sym], code);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * The key producing \p keysym without any modifiers, if there is one.
+     */
+    std::optional<xkb_keycode_t> levelZeroKeycode(xkb_keysym_t keysym, xkb_keycode_t min, xkb_keycode_t max) const
+    {
+        for (xkb_keycode_t keycode = min; keycode <= max; keycode++) {
+            const xkb_keysym_t *syms;
+            const int symCount = xkb_keymap_key_get_syms_by_level(m_keymap.get(), keycode, m_layout, 0, &syms);
+            if (std::find(syms, syms + symCount, keysym) != syms + symCount) {
+                return keycode;
+            }
+        }
+        return std::nullopt;
+    }
+
     void keyboard_keymap(uint32_t format, int32_t fd, uint32_t size) override
     {
         if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
@@ -140,11 +244,28 @@ private:
             m_state.reset(xkb_state_new(m_keymap.get()));
         else
             m_state.reset(nullptr);
+
+        rebuildIndex();
+    }
+
+    void keyboard_modifiers(uint32_t, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group) override
+    {
+        if (!m_state) {
+            return;
+        }
+
+        xkb_state_update_mask(m_state.get(), depressed, latched, locked, 0, 0, group);
+        // The index is per layout, only a layout switch invalidates it.
+        if (xkb_state_serialize_layout(m_state.get(), XKB_STATE_LAYOUT_EFFECTIVE) != m_layout) {
+            rebuildIndex();
+        }
     }
 
     ScopedXKBContext m_ctx;
     ScopedXKBKeymap m_keymap;
     ScopedXKBState m_state;
+    xkb_layout_index_t m_layout = 0;
+    QHash<xkb_keysym_t, Code> m_keysymIndex;
 };
 
 class KRDP_NO_EXPORT PlasmaScreencastV1Session::Private
@@ -154,6 +275,9 @@ public:
 
     Screencasting m_screencasting;
     std::unique_ptr<ScreencastingStream> request;
+    // One stream per screen when streaming all monitors.
+    std::vector<std::unique_ptr<ScreencastingStream>> monitorRequests;
+    QList<MonitorStream> monitors;
     std::unique_ptr<FakeInput> remoteInterface;
 };
 
@@ -172,6 +296,11 @@ PlasmaScreencastV1Session::~PlasmaScreencastV1Session()
 
 void PlasmaScreencastV1Session::start()
 {
+    if (streamAllMonitors()) {
+        startMonitorStreams();
+        return;
+    }
+
     if (auto vm = virtualMonitor()) {
         d->request.reset(d->m_screencasting.createVirtualMonitorStream(vm->name, vm->size, vm->dpr, Screencasting::Metadata));
     } else if (const auto streamIndex = activeStream()) {
@@ -198,6 +327,41 @@ void PlasmaScreencastV1Session::start()
     });
 }
 
+void PlasmaScreencastV1Session::startMonitorStreams()
+{
+    const auto screens = qApp->screens();
+    d->monitors.resize(screens.size());
+    for (int i = 0; i < screens.size(); ++i) {
+        d->monitors[i].geometry = screens.at(i)->geometry();
+
+        auto request = d->m_screencasting.createOutputStream(screens.at(i), Screencasting::Metadata);
+        connect(request, &ScreencastingStream::failed, this, &PlasmaScreencastV1Session::error);
+        connect(request, &ScreencastingStream::serial, this, [this, i](quint64 serial) {
+            d->monitors[i].objectSerial = serial;
+        });
+        connect(request, &ScreencastingStream::created, this, [this, i](uint nodeId) {
+            d->monitors[i].nodeId = nodeId;
+            // Only start once every screen has a stream.
+            const bool allCreated = std::all_of(d->monitors.cbegin(), d->monitors.cend(), [](const MonitorStream &monitor) {
+                return monitor.nodeId != 0;
+            });
+            if (!allCreated) {
+                return;
+            }
+
+            qCDebug(KRDP) << "Started Plasma session with" << d->monitors.size() << "monitors";
+
+            const auto &primary = d->monitors.constFirst();
+            setMonitorStreams(d->monitors);
+            setLogicalSize(primary.geometry.size());
+            setNodeId(primary.nodeId);
+            setObjectSerial(primary.objectSerial);
+            setStarted(true);
+        });
+        d->monitorRequests.emplace_back(request);
+    }
+}
+
 void PlasmaScreencastV1Session::sendEvent(const std::shared_ptr<QEvent> &event)
 {
     if (!isStarted()) {
@@ -226,6 +390,20 @@ void PlasmaScreencastV1Session::sendEvent(const std::shared_ptr<QEvent> &event)
     case QEvent::MouseMove: {
         auto me = std::static_pointer_cast<QMouseEvent>(event);
         auto position = me->position();
+        if (monitorStreams().size() > 1) {
+            // The position is on the client's desktop, map it into the monitor it is on.
+            const auto monitor = monitorAt(position);
+            if (!monitor) {
+                return;
+            }
+            const auto &[index, monitorPosition] = *monitor;
+            const QSize monitorSize = monitorLayout().at(index).size();
+            const QRect geometry = monitorStreams().at(index).geometry;
+            const auto logicalPosition = QPointF{geometry.x() + (monitorPosition.x() / monitorSize.width()) * geometry.width(),
+                                                 geometry.y() + (monitorPosition.y() / monitorSize.height()) * geometry.height()};
+            d->remoteInterface->pointer_motion_absolute(wl_fixed_from_double(logicalPosition.x()), wl_fixed_from_double(logicalPosition.y()));
+            break;
+        }
         auto logicalPosition = QPointF{(position.x() / size().width()) * logicalSize().width(), (position.y() / size().height()) * logicalSize().height()};
         d->remoteInterface->pointer_motion_absolute(wl_fixed_from_double(logicalPosition.x()), wl_fixed_from_double(logicalPosition.y()));
         break;
@@ -259,23 +437,18 @@ void PlasmaScreencastV1Session::sendEvent(const std::shared_ptr<QEvent> &event)
                 return;
             }
 
-            auto sendKey = [this, state](int keycode) {
-                d->remoteInterface->keyboard_key(keycode, state);
-            };
-            switch (keycode->level) {
-            case 0:
-                break;
-            case 1:
-                sendKey(KEY_LEFTSHIFT);
-                break;
-            case 2:
-                sendKey(KEY_RIGHTALT);
-                break;
-            default:
-                qCWarning(KRDP) << "Unsupported key level" << keycode->level;
-                break;
+            // Hold the level's modifiers around the key, releasing in reverse order.
+            if (state) {
+                for (auto modifier : std::as_const(keycode->modifiers)) {
+                    d->remoteInterface->keyboard_key(modifier, state);
+                }
+                d->remoteInterface->keyboard_key(keycode->code, state);
+            } else {
+                d->remoteInterface->keyboard_key(keycode->code, state);
+                for (auto it = keycode->modifiers.crbegin(); it != keycode->modifiers.crend(); ++it) {
+                    d->remoteInterface->keyboard_key(*it, state);
+                }
             }
-            sendKey(keycode->code);
         }
         break;
     }
@@ -38,6 +38,8 @@ public:
     void sendEvent(const std::shared_ptr<QEvent> &event) override;
 
 private:
+    void startMonitorStreams();
+
     class Private;
     const std::unique_ptr<Private> d;
 };
@@ -5,6 +5,7 @@
 #include "PortalSession.h"
 
 #include <QGuiApplication>
+#include <QMouseEvent>
 #include <QQueue>
 
 #include <KConfigGroup>
@@ -85,6 +86,27 @@ QString createHandleToken()
     return QStringLiteral("krdp%1").arg(QRandomGenerator::global()->generate());
 }
 
+static QString storedRestoreToken()
+{
+    // name is set explicitly as this is also used by the KCM
+    KConfigGroup restorationGroup = KSharedConfig::openStateConfig(QStringLiteral("krdp-serverstaterc"))->group(QStringLiteral("General"));
+    QString restoreToken = restorationGroup.readEntry(QStringLiteral("restorationToken"));
+
+    // this is a compatibility path for krdp < 6.3 that used a different name and in .config
+    // in 6.4 onwards it can be killed
+    if (restoreToken.isEmpty()) {
+        KConfigGroup restorationGroup = KSharedConfig::openConfig(QStringLiteral("krdp-serverrc"))->group(QStringLiteral("General"));
+        restoreToken = restorationGroup.readEntry(QStringLiteral("restorationToken"));
+    } // end compat
+
+    return restoreToken;
+}
+
+bool PortalSession::hasRestoreToken()
+{
+    return !storedRestoreToken().isEmpty();
+}
+
 PortalSession::PortalSession()
     : AbstractSession()
     , d(std::make_unique<Private>())
@@ -124,11 +146,63 @@ void PortalSession::start()
 
 void PortalSession::sendEvent(const std::shared_ptr<QEvent> &event)
 {
-    if (isStarted() && d->eiConnection) {
-        d->eiConnection->sendEvent(event, size(), d->mappingId);
+    if (!isStarted() || !d->eiConnection) {
+        return;
+    }
+
+    if (const auto target = targetForEvent(event)) {
+        d->eiConnection->sendEvent(target->event, target->streamSize, target->mappingId);
     }
 }
 
+void PortalSession::sendEvents(const std::vector<std::shared_ptr<QEvent>> &events)
+{
+    if (!isStarted() || !d->eiConnection) {
+        return;
+    }
+
+    std::vector<std::shared_ptr<QEvent>> batch;
+    QSize batchSize;
+    QString batchMappingId;
+    for (const auto &event : events) {
+        const auto target = targetForEvent(event);
+        if (!target) {
+            continue;
+        }
+
+        if (!batch.empty() && (target->streamSize != batchSize || target->mappingId != batchMappingId)) {
+            d->eiConnection->sendEvents(batch, batchSize, batchMappingId);
+            batch.clear();
+        }
+
+        batch.push_back(target->event);
+        batchSize = target->streamSize;
+        batchMappingId = target->mappingId;
+    }
+
+    if (!batch.empty()) {
+        d->eiConnection->sendEvents(batch, batchSize, batchMappingId);
+    }
+}
+
+std::optional<PortalSession::EventTarget> PortalSession::targetForEvent(const std::shared_ptr<QEvent> &event) const
+{
+    if (event->type() == QEvent::MouseMove && monitorStreams().size() > 1) {
+        // The position is on the client's desktop, which contains all monitors.
+        auto me = std::static_pointer_cast<QMouseEvent>(event);
+        const auto monitor = monitorAt(me->position());
+        if (!monitor) {
+            return std::nullopt;
+        }
+
+        const auto &[index, position] = *monitor;
+        auto monitorEvent = std::make_shared<QMouseEvent>(QEvent::MouseMove, position, me->globalPosition(), me->button(), me->buttons(), me->modifiers());
+        return EventTarget{monitorEvent, monitorLayout().at(index).size(), monitorStreams().at(index).mappingId};
+    }
+
+    return EventTarget{event, size(), d->mappingId};
+}
+
 void PortalSession::onCreateSession(uint code, const QVariantMap &result)
 {
     if (code != 0) {
@@ -146,17 +220,7 @@ void PortalSession::onCreateSession(uint code, const QVariantMap &result)
         {QStringLiteral("handle_token"), createHandleToken()},
         {QStringLiteral("persist_mode"), PermissionsPersistUntilExplicitlyRevoked},
     };
-    // name is set explicitly as this is also used by the KCM
-    KConfigGroup restorationGroup = KSharedConfig::openStateConfig(QStringLiteral("krdp-serverstaterc"))->group(QStringLiteral("General"));
-    QString restoreToken = restorationGroup.readEntry(QStringLiteral("restorationToken"));
-
-    // this is a compatibility path for krdp < 6.3 that used a different name and in .config
-    // in 6.4 onwards it can be killed
-    if (restoreToken.isEmpty()) {
-        KConfigGroup restorationGroup = KSharedConfig::openConfig(QStringLiteral("krdp-serverrc"))->group(QStringLiteral("General"));
-        restoreToken = restorationGroup.readEntry(QStringLiteral("restorationToken"));
-    } // end compat
-
+    const QString restoreToken = storedRestoreToken();
     if (!restoreToken.isEmpty()) {
         parameters[QStringLiteral("restore_token")] = restoreToken;
     }
@@ -177,7 +241,7 @@ void PortalSession::onDevicesSelected(uint code, const QVariantMap & /*result*/)
         parameters = {{QStringLiteral("types"), 4u}}; // VIRTUAL
     } else {
         parameters = {{QStringLiteral("types"), 1u}, // MONITOR
-                      {QStringLiteral("multiple"), activeStream().has_value()}};
+                      {QStringLiteral("multiple"), activeStream().has_value() || streamAllMonitors()}};
     }
     parameters[QStringLiteral("cursor_mode")] = 4u; // Metadata
 
@@ -226,6 +290,19 @@ void KRdp::PortalSession::onSessionStarted(uint code, const QVariantMap &result)
     connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, streams](QDBusPendingCallWatcher *watcher) {
         auto reply = QDBusReply<QDBusUnixFileDescriptor>(*watcher);
         if (reply.isValid()) {
+            if (streamAllMonitors()) {
+                QList<MonitorStream> monitors;
+                for (const auto &stream : streams) {
+                    monitors.append(MonitorStream{
+                        .nodeId = stream.nodeId,
+                        .geometry = QRect(qdbus_cast<QPoint>(stream.map.value(u"position"_s)), qdbus_cast<QSize>(stream.map.value(u"size"_s))),
+                        .mappingId = stream.map.value(u"mapping_id"_s).toString(),
+                    });
+                }
+                qCDebug(KRDP) << "Streaming" << monitors.size() << "monitors";
+                setMonitorStreams(monitors);
+            }
+
             auto streamIndex = activeStream().value_or(0);
             if (streamIndex < 0 || streamIndex >= streams.size()) {
                 qCWarning(KRDP) << "Requested monitor index out of range, using first monitor";
@@ -37,6 +37,13 @@ public:
     explicit PortalSession();
     ~PortalSession() override;
 
+    /**
+     * Whether a restore token of an earlier session is stored.
+     *
+     * With one, starting a session does not ask the user for permission again.
+     */
+    static bool hasRestoreToken();
+
     void start() override;
     /**
      * Send a new event to the portal.
@@ -44,8 +51,25 @@ public:
      * \param event The new event to send.
      */
     void sendEvent(const std::shared_ptr<QEvent> &event) override;
+    /**
+     * Send a batch of events to the portal.
+     *
+     * Consecutive events for the same stream are sent as a single batch with
+     * one timestamp.
+     */
+    void sendEvents(const std::vector<std::shared_ptr<QEvent>> &events) override;
 
 private:
+    struct EventTarget {
+        std::shared_ptr<QEvent> event;
+        QSize streamSize;
+        QString mappingId;
+    };
+    /**
+     * Find the stream an event is for, mapping its position into that stream.
+     */
+    std::optional<EventTarget> targetForEvent(const std::shared_ptr<QEvent> &event) const;
+
     void connectToEis();
 
     void onCreateSession(uint code, const QVariantMap &result);
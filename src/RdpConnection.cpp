@@ -9,12 +9,16 @@
 
 #include "RdpConnection.h"
 
-#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
 
 #include <fcntl.h>
 
 #include <QHostAddress>
-#include <QStandardPaths>
 #include <QTcpSocket>
 #include <QTemporaryFile>
 #include <QThread>
@@ -26,6 +30,7 @@
 #include <freerdp/channels/drdynvc.h>
 
 #include "AbstractSession.h"
+#include "AudioStream.h"
 #include "Clipboard.h"
 #include "Cursor.h"
 #include "DisplayControl.h"
@@ -39,52 +44,9 @@
 
 #include "krdp_logging.h"
 
-namespace fs = std::filesystem;
-
 namespace KRdp
 {
 
-/**
- * Create the "sam" file used by FreeRDP for reading username and password
- * information. It hashes the password in the appropriate format and writes that
- * along with the username to the provided temporary file.
- */
-static bool createSamFile(QTemporaryFile &file, const QList<User> &users)
-{
-    auto runtimePath = fs::path(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation).toStdString());
-
-    auto path = runtimePath / "krdp";
-    fs::create_directories(path);
-
-    file.setFileTemplate(QString::fromStdString(path / "rdp-sam-XXXXXX"));
-    if (!file.open()) {
-        qCWarning(KRDP) << "Could not open SAM file";
-        return false;
-    }
-
-    QString data;
-
-    for (const auto &user : users) {
-        auto username = user.name;
-        auto password = user.password.toUtf8();
-
-        std::array<uint8_t, 16> hash;
-        NTOWFv1A((LPSTR)password.data(), password.size(), hash.data());
-
-        auto entry = QStringLiteral("%1:::").arg(username);
-        for (int i = 0; i < 16; ++i) {
-            entry.append(QStringLiteral("%1").arg(hash[i], 2, 16, QLatin1Char('0')));
-        }
-        entry.append(QStringLiteral(":::\n"));
-        data.append(entry);
-    }
-
-    file.write(data.toUtf8());
-    file.close();
-
-    return true;
-}
-
 #include <security/pam_appl.h>
 
 typedef struct {
@@ -174,6 +136,7 @@ static int pamAuthenticate(const QString &user, const QString &password)
 
     if (pam_status != PAM_SUCCESS) {
         qWarning() << "pam_authenticate failure:" << pam_strerror(info.handle, pam_status);
+        pam_end(info.handle, pam_status);
         return -1;
     }
 
@@ -181,12 +144,102 @@ static int pamAuthenticate(const QString &user, const QString &password)
 
     if (pam_status != PAM_SUCCESS) {
         qWarning() << "pam_acct_mgmt failure:" << pam_strerror(info.handle, pam_status);
+        pam_end(info.handle, pam_status);
         return -1;
     }
 
+    pam_end(info.handle, pam_status);
     return 1;
 }
 
+constexpr int PamMaximumConcurrency = 2; // PAM conversations clients wait for at the same time
+constexpr int PamMaximumAbandoned = 8; // timed out PAM conversations still running in the background
+constexpr auto PamTimeout = std::chrono::seconds(15); // longest a client waits for PAM
+
+/**
+ * Run pamAuthenticate() on its own thread, waiting at most PamTimeout.
+ *
+ * PAM stacks that talk to the network can take seconds per attempt, so only
+ * PamMaximumConcurrency attempts are waited for at the same time. Further
+ * attempts are refused right away instead of queueing behind them. The caller
+ * gives up after PamTimeout or when its connection is stopped. PAM cannot be
+ * interrupted, so an attempt that was given up on keeps running on its
+ * detached thread but no longer counts against PamMaximumConcurrency. To
+ * bound the number of threads stuck in a hanging PAM module, new attempts are
+ * also refused while PamMaximumAbandoned of those are still running.
+ */
+static bool pamAuthenticateWithTimeout(const QString &user, const QString &password, std::stop_token stopToken)
+{
+    struct Attempts {
+        std::mutex mutex;
+        int waiting = 0;
+        int abandoned = 0;
+    };
+    // Intentionally never destroyed, a hanging PAM thread may still use it when exiting.
+    static Attempts *attempts = new Attempts;
+
+    struct Attempt {
+        bool finished = false;
+        bool abandoned = false;
+        std::promise<bool> result;
+    };
+
+    {
+        std::lock_guard lock(attempts->mutex);
+        if (attempts->waiting >= PamMaximumConcurrency) {
+            qCWarning(KRDP) << "Refusing PAM authentication for" << user << "as" << attempts->waiting << "attempts are already running";
+            return false;
+        }
+        if (attempts->abandoned >= PamMaximumAbandoned) {
+            qCWarning(KRDP) << "Refusing PAM authentication for" << user << "as" << attempts->abandoned << "timed out attempts are still running";
+            return false;
+        }
+        attempts->waiting++;
+    }
+
+    auto attempt = std::make_shared<Attempt>();
+    auto result = attempt->result.get_future();
+    std::thread([attempt, user, password]() {
+        const bool authenticated = pamAuthenticate(user, password) >= 0;
+        {
+            std::lock_guard lock(attempts->mutex);
+            attempt->finished = true;
+            if (attempt->abandoned) {
+                attempts->abandoned--;
+            }
+        }
+        attempt->result.set_value(authenticated);
+    }).detach();
+
+    auto abandon = [&attempt]() {
+        std::lock_guard lock(attempts->mutex);
+        attempts->waiting--;
+        if (!attempt->finished) {
+            attempt->abandoned = true;
+            attempts->abandoned++;
+        }
+    };
+
+    const auto deadline = std::chrono::steady_clock::now() + PamTimeout;
+    while (result.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        if (stopToken.stop_requested()) {
+            abandon();
+            return false;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            qCWarning(KRDP) << "PAM authentication for" << user << "did not finish within" << PamTimeout.count() << "seconds";
+            abandon();
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard lock(attempts->mutex);
+        attempts->waiting--;
+    }
+    return result.get();
+}
+
 /**
  * FreeRDP callback for the capabilities event.
  */
@@ -241,7 +294,8 @@ class KRDP_NO_EXPORT RdpConnection::Private
 public:
     Server *server = nullptr;
 
-    State state = State::Initial;
+    // Written by the run thread, read from the main thread as well.
+    std::atomic<State> state = State::Initial;
 
     qintptr socketHandle;
 
@@ -251,6 +305,7 @@ public:
     std::unique_ptr<NetworkDetection> networkDetection;
     std::unique_ptr<Clipboard> clipboard;
     std::unique_ptr<DisplayControl> displayControl;
+    std::unique_ptr<AudioStream> audioStream;
 
     freerdp_peer *peer = nullptr;
 
@@ -271,7 +326,11 @@ public:
         }
     }
 
-    QTemporaryFile samFile;
+    // Shared with the server, see Server::samFile().
+    std::shared_ptr<QTemporaryFile> samFile;
+
+    QString userName;
+    bool readOnly = false;
 };
 
 RdpConnection::RdpConnection(Server *server, qintptr socketHandle)
@@ -283,6 +342,7 @@ RdpConnection::RdpConnection(Server *server, qintptr socketHandle)
 
     d->inputHandler = std::make_unique<InputHandler>(this);
     d->videoStream = std::make_unique<VideoStream>(this);
+    connect(d->inputHandler.get(), &InputHandler::inputEvents, d->videoStream.get(), &VideoStream::notifyInput);
     connect(d->videoStream.get(), &VideoStream::closed, this, [this]() {
         if (d->state == State::Running || d->state == State::Streaming) {
             qCDebug(KRDP) << "Video stream closed, closing session";
@@ -293,6 +353,7 @@ RdpConnection::RdpConnection(Server *server, qintptr socketHandle)
     d->networkDetection = std::make_unique<NetworkDetection>(this);
     d->clipboard = std::make_unique<Clipboard>(this);
     d->displayControl = std::make_unique<DisplayControl>(this);
+    d->audioStream = std::make_unique<AudioStream>(this);
 
     QMetaObject::invokeMethod(this, &RdpConnection::initialize, Qt::QueuedConnection);
 }
@@ -306,7 +367,7 @@ RdpConnection::~RdpConnection()
     if (d->thread.joinable()) {
         d->requestStop();
         d->thread.join();
-    } else if (d->peer && d->state != State::Closed) {
+    } else if (d->peer) {
         // The run thread was never started (peer set up but initialize failed):
         // nothing else touches the peer, so close it here before freeing.
         d->peer->Close(d->peer);
@@ -331,11 +392,10 @@ RdpConnection::State RdpConnection::state() const
 
 void RdpConnection::setState(KRdp::RdpConnection::State newState)
 {
-    if (newState == d->state) {
+    if (d->state.exchange(newState) == newState) {
         return;
     }
 
-    d->state = newState;
     Q_EMIT stateChanged(newState);
 }
 
@@ -345,6 +405,12 @@ void RdpConnection::close(RdpConnection::CloseReason reason)
         return;
     }
 
+    if (!d->thread.joinable()) {
+        // The connection never started running, so there is no run thread to finish closing it.
+        setState(State::Closed);
+        return;
+    }
+
     switch (reason) {
     case CloseReason::VideoInitFailed:
         freerdp_set_error_info(d->peer->context->rdp, ERRINFO_GRAPHICS_SUBSYSTEM_FAILED);
@@ -390,6 +456,16 @@ NetworkDetection *RdpConnection::networkDetection() const
     return d->networkDetection.get();
 }
 
+bool RdpConnection::isReadOnly() const
+{
+    return d->readOnly;
+}
+
+QString RdpConnection::userName() const
+{
+    return d->userName;
+}
+
 void RdpConnection::initialize()
 {
     setState(State::Starting);
@@ -420,30 +496,23 @@ void RdpConnection::initialize()
     const bool usePamAuthentication = d->server->usePAMAuthentication();
 
     if (!usePamAuthentication) {
-        if (!createSamFile(d->samFile, d->server->users())) {
+        d->samFile = d->server->samFile();
+        if (!d->samFile) {
             qFatal("Failed to create SAM database");
             return;
         }
 
-        if (!freerdp_settings_set_string(settings, FreeRDP_NtlmSamFile, d->samFile.fileName().toUtf8().constData())) {
+        if (!freerdp_settings_set_string(settings, FreeRDP_NtlmSamFile, d->samFile->fileName().toUtf8().constData())) {
             qFatal("Failed to set SAM database");
             return;
         }
     }
 
-    auto certificate = freerdp_certificate_new_from_file(d->server->tlsCertificate().string().data());
-    if (!certificate) {
-        qCWarning(KRDP) << "Could not read certificate file" << d->server->tlsCertificate().string();
+    // The certificate and key are parsed once by the server and copied along with its settings.
+    if (!freerdp_settings_get_pointer(settings, FreeRDP_RdpServerCertificate) || !freerdp_settings_get_pointer(settings, FreeRDP_RdpServerRsaKey)) {
+        qCWarning(KRDP) << "No TLS certificate available for connection";
         return;
     }
-    freerdp_settings_set_pointer_len(settings, FreeRDP_RdpServerCertificate, certificate, 1);
-
-    auto key = freerdp_key_new_from_file(d->server->tlsCertificateKey().string().data());
-    if (!key) {
-        qCWarning(KRDP) << "Could not read certificate file" << d->server->tlsCertificate().string();
-        return;
-    }
-    freerdp_settings_set_pointer_len(settings, FreeRDP_RdpServerRsaKey, key, 1);
 
     freerdp_settings_set_bool(settings, FreeRDP_RdpSecurity, false);
     freerdp_settings_set_bool(settings, FreeRDP_TlsSecurity, usePamAuthentication);
@@ -453,8 +522,7 @@ void RdpConnection::initialize()
     // PSEUDO_XSERVER is apparently required for things to work properly.
     freerdp_settings_set_uint32(settings, FreeRDP_OsMinorType, OSMINORTYPE_PSEUDO_XSERVER);
 
-    // TODO: Implement audio support
-    freerdp_settings_set_bool(settings, FreeRDP_AudioPlayback, false);
+    freerdp_settings_set_bool(settings, FreeRDP_AudioPlayback, true);
 
     freerdp_settings_set_uint32(settings, FreeRDP_ColorDepth, 32);
 
@@ -532,8 +600,9 @@ void RdpConnection::run(std::stop_token stopToken)
             qCDebug(KRDP) << "Unable to get transport event handles";
             break;
         }
-        // Wait for something to happen on the connection.
-        WaitForMultipleObjects(2 + handleCount, events.data(), FALSE, INFINITE);
+        // Wait for something to happen on the connection, or until network detection needs to send its next probe.
+        const auto timeout = d->networkDetection->timeUntilUpdate();
+        WaitForMultipleObjects(2 + handleCount, events.data(), FALSE, timeout ? DWORD(timeout->count()) : INFINITE);
 
         // Bail out before touching the peer transport if we were asked to stop,
         // so teardown stays race-free.
@@ -573,6 +642,10 @@ void RdpConnection::run(std::stop_token stopToken)
             if (!d->displayControl->initialize()) {
                 break;
             }
+            // Audio is optional, the session continues without it.
+            if (!d->audioStream->initialize()) {
+                qCWarning(KRDP) << "Unable to initialize audio playback";
+            }
             if (!d->videoStream->initialize()) {
                 break;
             }
@@ -641,11 +714,18 @@ bool RdpConnection::onPostConnect()
 {
     qCInfo(KRDP) << "New client connected:" << d->peer->hostname << freerdp_peer_os_major_type_string(d->peer) << freerdp_peer_os_minor_type_string(d->peer);
 
-    d->samFile.remove();
+    d->samFile.reset();
 
     rdpSettings *settings = d->peer->context->settings;
     const QString username = QString::fromLatin1(freerdp_settings_get_string(settings, FreeRDP_Username));
 
+    d->userName = username;
+
+    const auto users = d->server->users();
+    d->readOnly = std::any_of(users.cbegin(), users.cend(), [&username](const User &user) {
+        return user.name == username && user.readOnly;
+    });
+
     if (d->server->usePAMAuthentication()) {
         if (!freerdp_settings_set_bool(settings, FreeRDP_AutoLogonEnabled, true)) {
             return false;
@@ -654,12 +734,11 @@ bool RdpConnection::onPostConnect()
         const QString password = QString::fromLatin1(freerdp_settings_get_string(settings, FreeRDP_Password));
         qCDebug(KRDP) << "Attempting authenticating user with PAM";
         if (username == KUser().loginName() || KUser().loginName() == QStringLiteral("plasmalogin")) {
-            if (pamAuthenticate(username, password) >= 0) {
+            if (pamAuthenticateWithTimeout(username, password, d->thread.get_stop_token())) {
                 qCDebug(KRDP) << "PAM authentication succeeded for user" << username;
                 return true;
             }
         }
-        const auto users = d->server->users();
         for (auto user : users) {
             if (user.password.isEmpty()) {
                 return false;
@@ -678,6 +757,7 @@ bool RdpConnection::onPostConnect()
 
 bool RdpConnection::onClose()
 {
+    d->audioStream->close();
     d->displayControl->close();
     d->clipboard->close();
     d->videoStream->close();
@@ -23,6 +23,7 @@ class Cursor;
 class NetworkDetection;
 class Clipboard;
 class DisplayControl;
+class AudioStream;
 
 /**
  * An RDP session.
@@ -72,6 +73,8 @@ public:
 
     /**
      * The current session state.
+     *
+     * This can be called from any thread.
      */
     State state() const;
     Q_SIGNAL void stateChanged(State newState);
@@ -103,6 +106,21 @@ public:
 
     NetworkDetection *networkDetection() const;
 
+    /**
+     * Whether the authenticated user may only watch the session.
+     *
+     * This is only valid once the client has been authenticated. Input and
+     * clipboard changes from a read-only connection should be ignored.
+     */
+    bool isReadOnly() const;
+
+    /**
+     * The name of the user the client authenticated as.
+     *
+     * This is only valid once the client has been authenticated.
+     */
+    QString userName() const;
+
 private:
     friend BOOL peerCapabilities(freerdp_peer *);
     friend BOOL peerActivate(freerdp_peer *);
@@ -114,6 +132,7 @@ private:
     friend class NetworkDetection;
     friend class Clipboard;
     friend class DisplayControl;
+    friend class AudioStream;
 
     void setState(State newState);
     void initialize();
@@ -4,12 +4,27 @@
 
 #include "Server.h"
 
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <QCoreApplication>
+#include <QHash>
+#include <QHostAddress>
+#include <QTimer>
+#include <QStandardPaths>
+#include <QTemporaryFile>
 
 #include <freerdp/channels/channels.h>
+#include <freerdp/crypto/certificate.h>
+#include <freerdp/crypto/privatekey.h>
 #include <freerdp/freerdp.h>
+#include <winpr/ntlm.h>
 #include <winpr/ssl.h>
 
 #include "RdpConnection.h"
@@ -30,16 +45,198 @@ public:
     QList<User> users;
     bool usePamAuthentication = false;
 
+    ConnectionLimits limits;
+    // Accept times of recent connections by source address, for ConnectionLimits::connectionsPerMinute.
+    QHash<QHostAddress, QList<std::chrono::steady_clock::time_point>> recentConnections;
+
     std::filesystem::path tlsCertificate;
     std::filesystem::path tlsCertificateKey;
+
+    // Written when the users change rather than for every connection. Connections keep
+    // the file they were given until they are authenticated.
+    std::shared_ptr<QTemporaryFile> samFile;
+
+    // Listening socket passed by the service manager, until start() takes it.
+    int activationSocket = -1;
+    bool socketActivated = false;
+
+    std::chrono::seconds idleTimeout = std::chrono::seconds(0);
+    QTimer idleTimer;
+
+    bool loadTlsCredentials();
+    bool admitConnection(qintptr handle);
+    void updateIdleTimer();
 };
 
+bool Server::Private::loadTlsCredentials()
+{
+    // Only parsed once, connections get a copy along with the rest of the settings.
+    auto certificate = freerdp_certificate_new_from_file(tlsCertificate.string().data());
+    if (!certificate) {
+        qCWarning(KRDP) << "Could not read certificate file" << tlsCertificate.string();
+        return false;
+    }
+
+    auto key = freerdp_key_new_from_file(tlsCertificateKey.string().data());
+    if (!key) {
+        qCWarning(KRDP) << "Could not read certificate key file" << tlsCertificateKey.string();
+        freerdp_certificate_free(certificate);
+        return false;
+    }
+
+    freerdp_settings_set_pointer_len(settings, FreeRDP_RdpServerCertificate, certificate, 1);
+    freerdp_settings_set_pointer_len(settings, FreeRDP_RdpServerRsaKey, key, 1);
+    return true;
+}
+
+static bool isAuthenticating(const RdpConnection *connection)
+{
+    const auto state = connection->state();
+    return state == RdpConnection::State::Initial || state == RdpConnection::State::Starting || state == RdpConnection::State::Running;
+}
+
+bool Server::Private::admitConnection(qintptr handle)
+{
+    if (limits.maximumConnections > 0 && qsizetype(sessions.size()) >= limits.maximumConnections) {
+        qCWarning(KRDP) << "Rejecting connection, already" << sessions.size() << "connections open";
+        return false;
+    }
+
+    if (limits.maximumPendingConnections > 0) {
+        const auto pending = std::count_if(sessions.cbegin(), sessions.cend(), [](const auto &session) {
+            return isAuthenticating(session.get());
+        });
+        if (pending >= limits.maximumPendingConnections) {
+            qCWarning(KRDP) << "Rejecting connection, already" << pending << "connections authenticating";
+            return false;
+        }
+    }
+
+    if (limits.connectionsPerMinute > 0) {
+        sockaddr_storage storage = {};
+        socklen_t length = sizeof(storage);
+        if (getpeername(int(handle), reinterpret_cast<sockaddr *>(&storage), &length) != 0) {
+            return false;
+        }
+        QHostAddress address(reinterpret_cast<sockaddr *>(&storage));
+        // Treat IPv4 clients connecting to an IPv6 socket the same as other IPv4 clients.
+        bool isIPv4 = false;
+        if (const auto ipv4 = address.toIPv4Address(&isIPv4); isIPv4) {
+            address = QHostAddress(ipv4);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        for (auto itr = recentConnections.begin(); itr != recentConnections.end();) {
+            itr->removeIf([now](std::chrono::steady_clock::time_point time) {
+                return now - time >= std::chrono::minutes(1);
+            });
+            itr = itr->isEmpty() ? recentConnections.erase(itr) : std::next(itr);
+        }
+
+        auto &times = recentConnections[address];
+        if (times.size() >= limits.connectionsPerMinute) {
+            qCWarning(KRDP) << "Rejecting connection from" << address << "after" << times.size() << "connections in the last minute";
+            return false;
+        }
+        times.append(now);
+    }
+
+    return true;
+}
+
+void Server::Private::updateIdleTimer()
+{
+    if (sessions.empty() && idleTimeout > std::chrono::seconds(0)) {
+        idleTimer.start(idleTimeout);
+    } else {
+        idleTimer.stop();
+    }
+}
+
+/**
+ * Take the listening socket passed using the systemd socket activation
+ * protocol, see sd_listen_fds(3). This is simple enough that it is not worth
+ * depending on libsystemd for.
+ */
+static int takeActivationSocket()
+{
+    // Passed descriptors always start right after stdin, stdout and stderr.
+    constexpr int ListenFdsStart = 3;
+
+    bool ok = false;
+    const auto pid = qEnvironmentVariableIntValue("LISTEN_PID", &ok);
+    if (!ok || pid != getpid()) {
+        return -1;
+    }
+
+    const auto count = qEnvironmentVariableIntValue("LISTEN_FDS");
+
+    // These are meant for this process only, so don't let child processes see them.
+    qunsetenv("LISTEN_PID");
+    qunsetenv("LISTEN_FDS");
+    qunsetenv("LISTEN_FDNAMES");
+
+    if (count < 1) {
+        return -1;
+    }
+
+    if (count > 1) {
+        qCWarning(KRDP) << "Received" << count << "sockets from the service manager, only the first one is used";
+    }
+
+    fcntl(ListenFdsStart, F_SETFD, FD_CLOEXEC);
+    return ListenFdsStart;
+}
+
+/**
+ * Create the "sam" file used by FreeRDP for reading username and password
+ * information. It hashes the password in the appropriate format and writes that
+ * along with the username to a new temporary file.
+ */
+static std::shared_ptr<QTemporaryFile> createSamFile(const QList<User> &users)
+{
+    auto runtimePath = std::filesystem::path(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation).toStdString());
+
+    auto path = runtimePath / "krdp";
+    std::filesystem::create_directories(path);
+
+    auto file = std::make_shared<QTemporaryFile>(QString::fromStdString(path / "rdp-sam-XXXXXX"));
+    if (!file->open()) {
+        qCWarning(KRDP) << "Could not open SAM file";
+        return nullptr;
+    }
+
+    QByteArray data;
+    for (const auto &user : users) {
+        auto password = user.password.toUtf8();
+
+        std::array<uint8_t, 16> hash;
+        NTOWFv1A((LPSTR)password.data(), password.size(), hash.data());
+
+        data.append(user.name.toUtf8());
+        data.append(":::");
+        data.append(QByteArray::fromRawData(reinterpret_cast<const char *>(hash.data()), hash.size()).toHex());
+        data.append(":::\n");
+    }
+
+    file->write(data);
+    file->close();
+
+    return file;
+}
+
 Server::Server(QObject *parent)
     : QTcpServer(parent)
     , d(std::make_unique<Private>())
 {
     winpr_InitializeSSL(WINPR_SSL_INIT_DEFAULT);
     WTSRegisterWtsApiFunctionTable(FreeRDP_InitWtsApi());
+
+    d->activationSocket = takeActivationSocket();
+    d->socketActivated = d->activationSocket >= 0;
+
+    d->idleTimer.setSingleShot(true);
+    connect(&d->idleTimer, &QTimer::timeout, this, &Server::idle);
 }
 
 Server::~Server()
@@ -55,16 +252,32 @@ bool Server::start()
         return false;
     }
 
-    if (!listen(d->address, d->port)) {
+    // FreeRDP3 tries to use a global instance of the settings object when
+    // initializing a new peer. However, it seems to fail at actually creating a
+    // global default instance. So create one here and use that.
+    d->settings = freerdp_settings_new(FREERDP_SETTINGS_SERVER_MODE);
+    if (!d->loadTlsCredentials()) {
+        stop();
+        return false;
+    }
+
+    if (d->activationSocket >= 0) {
+        // The socket is owned by QTcpServer from here on, so a later start() binds a new one.
+        const auto socket = std::exchange(d->activationSocket, -1);
+        if (!setSocketDescriptor(socket)) {
+            qCCritical(KRDP) << "Unable to use the listening socket passed by the service manager:" << errorString();
+            ::close(socket);
+            stop();
+            return false;
+        }
+    } else if (!listen(d->address, d->port)) {
         // NOTE: We cannot use QTcpServer methods to get the server address and port because it won't initialize them if listen fails.
         qCCritical(KRDP) << "Unable to listen for connections on" << d->address << d->port;
+        stop();
         return false;
     }
 
-    // FreeRDP3 tries to use a global instance of the settings object when
-    // initializing a new peer. However, it seems to fail at actually creating a
-    // global default instance. So create one here and use that.
-    d->settings = freerdp_settings_new(FREERDP_SETTINGS_SERVER_MODE);
+    d->updateIdleTimer();
 
     qCDebug(KRDP) << "Listening for connections on" << serverAddress() << serverPort();
     return true;
@@ -73,11 +286,14 @@ bool Server::start()
 void Server::stop()
 {
     close();
+    d->idleTimer.stop();
 
     if (d->settings) {
         freerdp_settings_free(d->settings);
         d->settings = nullptr;
     }
+
+    d->samFile.reset();
 }
 
 QHostAddress Server::address() const
@@ -108,6 +324,28 @@ void Server::setPort(quint16 newPort)
     d->port = newPort;
 }
 
+bool Server::isSocketActivated() const
+{
+    return d->socketActivated;
+}
+
+std::chrono::seconds Server::idleTimeout() const
+{
+    return d->idleTimeout;
+}
+
+void Server::setIdleTimeout(std::chrono::seconds timeout)
+{
+    if (timeout == d->idleTimeout) {
+        return;
+    }
+
+    d->idleTimeout = timeout;
+    if (isListening()) {
+        d->updateIdleTimer();
+    }
+}
+
 QList<User> KRdp::Server::users() const
 {
     return d->users;
@@ -116,11 +354,13 @@ QList<User> KRdp::Server::users() const
 void KRdp::Server::setUsers(const QList<User> &users)
 {
     d->users = users;
+    d->samFile.reset();
 }
 
 void KRdp::Server::addUser(const User &user)
 {
     d->users.append(user);
+    d->samFile.reset();
 }
 
 bool Server::usePAMAuthentication() const
@@ -133,6 +373,16 @@ void Server::setUsePAMAuthentication(bool usePAM)
     d->usePamAuthentication = usePAM;
 }
 
+ConnectionLimits Server::connectionLimits() const
+{
+    return d->limits;
+}
+
+void Server::setConnectionLimits(const ConnectionLimits &limits)
+{
+    d->limits = limits;
+}
+
 std::filesystem::path Server::tlsCertificate() const
 {
     return d->tlsCertificate;
@@ -161,8 +411,28 @@ void Server::setTlsCertificateKey(const std::filesystem::path &newTlsCertificate
     d->tlsCertificateKey = newTlsCertificateKey;
 }
 
+void Server::setTlsCredentials(const std::filesystem::path &newTlsCertificate, const std::filesystem::path &newTlsCertificateKey)
+{
+    if (newTlsCertificate == d->tlsCertificate && newTlsCertificateKey == d->tlsCertificateKey) {
+        return;
+    }
+
+    d->tlsCertificate = newTlsCertificate;
+    d->tlsCertificateKey = newTlsCertificateKey;
+    if (d->settings) {
+        d->loadTlsCredentials();
+    }
+}
+
 void Server::incomingConnection(qintptr handle)
 {
+    // Refuse connections before anything is allocated for them, so a flood of
+    // connections cannot take resources away from the sessions already running.
+    if (!d->admitConnection(handle)) {
+        ::close(int(handle));
+        return;
+    }
+
     auto session = std::make_unique<RdpConnection>(this, handle);
     auto sessionPtr = session.get();
     // queued: signal comes from the run thread, and it keeps the erase below from destroying the sender mid-emission
@@ -182,10 +452,22 @@ void Server::incomingConnection(qintptr handle)
                 // from destroyed() handlers) that re-enters this vector, so destroy it once consistent again
                 auto session = std::move(*itr);
                 d->sessions.erase(itr);
+                d->updateIdleTimer();
             }
         },
         Qt::QueuedConnection);
+
+    if (d->limits.authenticationTimeout > std::chrono::seconds(0)) {
+        QTimer::singleShot(d->limits.authenticationTimeout, sessionPtr, [sessionPtr]() {
+            if (isAuthenticating(sessionPtr)) {
+                qCWarning(KRDP) << "Closing connection that did not authenticate in time";
+                sessionPtr->close();
+            }
+        });
+    }
+
     d->sessions.push_back(std::move(session));
+    d->updateIdleTimer();
     Q_EMIT newConnectionCreated(sessionPtr);
 }
 
@@ -194,4 +476,12 @@ rdp_settings *Server::rdpSettings() const
     return d->settings;
 }
 
+std::shared_ptr<QTemporaryFile> Server::samFile()
+{
+    if (!d->samFile) {
+        d->samFile = createSamFile(d->users);
+    }
+    return d->samFile;
+}
+
 #include "moc_Server.cpp"
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <filesystem>
 #include <memory>
 
@@ -13,6 +14,8 @@
 
 #include "krdp_export.h"
 
+class QTemporaryFile;
+
 namespace KRdp
 {
 
@@ -27,6 +30,19 @@ struct User {
     bool readOnly = false; ///< Whether this user is allowed to control the session.
 };
 
+/**
+ * Limits on incoming connections.
+ *
+ * Connections over a limit are closed right after they are accepted, before
+ * any RDP processing happens for them. A value of 0 disables a limit.
+ */
+struct ConnectionLimits {
+    int maximumConnections = 16; ///< Connections open at the same time.
+    int maximumPendingConnections = 4; ///< Connections that have not finished authenticating.
+    int connectionsPerMinute = 20; ///< New connections per minute from a single address.
+    std::chrono::seconds authenticationTimeout = std::chrono::seconds(30); ///< Time a client has to authenticate.
+};
+
 /**
  * Core RDP server class.
  *
@@ -47,6 +63,9 @@ public:
      *
      * Note that `address` and `port` should be set before calling this,
      * changing them after the server has started listening has no effect.
+     *
+     * If the process was started through socket activation, the listening
+     * socket passed by the service manager is used instead.
      */
     bool start();
     /**
@@ -75,6 +94,23 @@ public:
     quint16 port() const;
     void setPort(quint16 newPort);
 
+    /**
+     * Whether a listening socket was passed to this process by the service manager.
+     *
+     * This follows the systemd socket activation protocol. It means a client is
+     * already waiting to connect, so the server should start as soon as possible.
+     */
+    bool isSocketActivated() const;
+
+    /**
+     * Time without any connections after which idle() is emitted.
+     *
+     * The timer starts when the server starts and whenever the last connection
+     * closes. A value of 0, the default, disables it.
+     */
+    std::chrono::seconds idleTimeout() const;
+    void setIdleTimeout(std::chrono::seconds timeout);
+
     /**
      * The list of users allowed to log in to the server.
      *
@@ -90,11 +126,19 @@ public:
     bool usePAMAuthentication() const;
     void setUsePAMAuthentication(bool usePAM);
 
+    /**
+     * Limits to protect the server against floods of connections.
+     */
+    ConnectionLimits connectionLimits() const;
+    void setConnectionLimits(const ConnectionLimits &limits);
+
     /**
      * The path of a certificate file to use for encrypting communications.
      *
      * This is required to be set to a valid file, as the RDP login process only
-     * works over an encrypted connection.
+     * works over an encrypted connection. The file is read when the server
+     * starts. To replace the credentials of a running server, use
+     * setTlsCredentials() so the certificate and key change together.
      */
     std::filesystem::path tlsCertificate() const;
     void setTlsCertificate(const std::filesystem::path &newTlsCertificate);
@@ -103,11 +147,22 @@ public:
      * The path of a certificate key to use for encrypting communications.
      *
      * This is required to be set to a valid file, as the RDP login process only
-     * works over an encrypted connection.
+     * works over an encrypted connection. The file is read when the server
+     * starts. To replace the credentials of a running server, use
+     * setTlsCredentials() so the certificate and key change together.
      */
     std::filesystem::path tlsCertificateKey() const;
     void setTlsCertificateKey(const std::filesystem::path &newTlsCertificateKey);
 
+    /**
+     * Set both the certificate and the certificate key.
+     *
+     * If the server is running, the new pair is read once, after both paths
+     * have been updated, so new connections never get a certificate that
+     * does not match its key.
+     */
+    void setTlsCredentials(const std::filesystem::path &newTlsCertificate, const std::filesystem::path &newTlsCertificateKey);
+
     /**
      * Emitted whenever a new connection is started.
      *
@@ -115,6 +170,11 @@ public:
      */
     Q_SIGNAL void newConnectionCreated(RdpConnection *connection);
 
+    /**
+     * Emitted when there were no connections for idleTimeout().
+     */
+    Q_SIGNAL void idle();
+
 protected:
     /**
      * Overridden from QTcpServer
@@ -124,6 +184,7 @@ protected:
 private:
     friend class RdpConnection;
     rdp_settings *rdpSettings() const;
+    std::shared_ptr<QTemporaryFile> samFile();
 
     class Private;
     const std::unique_ptr<Private> d;
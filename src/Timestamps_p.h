@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2026 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+
+#pragma once
+
+#include <cstdint>
+
+#include <QDateTime>
+#include <QTime>
+
+namespace KRdp
+{
+
+/**
+ * Timestamps sent along with graphics frames and audio packets.
+ *
+ * Both are derived from the same UTC time of day, so a client can tell which
+ * audio belongs to which frame.
+ */
+namespace Timestamps
+{
+
+/**
+ * The current time of day in UTC, which both kinds of timestamps encode.
+ */
+inline QTime now()
+{
+    return QDateTime::currentDateTimeUtc().time();
+}
+
+/**
+ * The timestamp of a graphics frame (MS-RDPEGFX StartFrame).
+ *
+ * The time of day is packed into bit fields: hours in bits 22 to 31, minutes
+ * in bits 16 to 21, seconds in bits 10 to 15 and milliseconds in bits 0 to 9.
+ */
+inline uint32_t frameTimestamp(const QTime &time)
+{
+    return uint32_t(time.hour()) << 22 | uint32_t(time.minute()) << 16 | uint32_t(time.second()) << 10 | uint32_t(time.msec());
+}
+
+/**
+ * The timestamp of an audio packet (MS-RDPEA wTimeStamp).
+ *
+ * This only has 16 bits, so it is the time of day in milliseconds modulo
+ * 65536 and wraps about every 65 seconds. Unpacking a frame timestamp to
+ * milliseconds since midnight and taking it modulo 65536 gives a value on the
+ * same scale.
+ */
+inline uint16_t audioTimestamp(const QTime &time)
+{
+    return uint16_t(time.msecsSinceStartOfDay());
+}
+}
+
+}
@@ -14,10 +14,13 @@
 #include <cmath>
 #include <condition_variable>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
-#include <QDateTime>
+#include <QPointer>
 #include <QQueue>
 #include <QSet>
+#include <QTimer>
 
 #include <DmaBufHandler>
 #include <PipeWireEncodedStream>
@@ -27,9 +30,12 @@
 #include <freerdp/update.h>
 #include <qassert.h>
 
+#include "CongestionController.h"
+#include "Cursor.h"
 #include "NetworkDetection.h"
 #include "PeerContext_p.h"
 #include "RdpConnection.h"
+#include "Timestamps_p.h"
 
 #include "krdp_logging.h"
 
@@ -38,15 +44,21 @@ namespace KRdp
 
 namespace clk = std::chrono;
 
-constexpr qsizetype MaximumInFlightFrames = 2; // in-flight window floor
-constexpr double InFlightGain = 1.0; // window spans this many round trips of frames
-constexpr double LatencyBudgetSec = 1.0; // never buffer more than this many seconds of video
+constexpr qsizetype MaximumInFlightFrames = 2; // in-flight window until the congestion controller has run
 constexpr double MinimumWindowFrameRate = 5.0; // floor for producer-rate window sizing (avoids stop-and-wait)
 constexpr double ProducerFpsEwmaAlpha = 0.25; // smoothing for the producer-rate estimate
-constexpr double RttEwmaAlpha = 0.125; // second-stage smoothing of the (already windowed) averageRTT
-constexpr double MinimumValidRttMs = 5.0; // ignore implausibly-low RTT samples
-constexpr double MaximumValidRttMs = 60000.0; // ignore garbage RTT samples
+constexpr double FrameSizeEwmaAlpha = 0.125; // smoothing for the encoded frame size estimate
+constexpr int IdleFrameRate = 5; // capture and encode rate while the screen is static
+constexpr auto IdleTimeout = std::chrono::seconds(2); // time without damage or input before going idle
+constexpr qsizetype StaticPacketSize = 512; // H.264 P-frames below this size carry no visible change
+// Frames allowed to wait inside the encoder: the one being encoded plus one waiting. Frames queued
+// there add latency the in-flight window does not see. This never exceeds the window, which is at
+// least two frames.
+constexpr int EncoderPendingFrames = 2;
+constexpr auto ResizeTransitionTimeout = std::chrono::seconds(1); // how long old frames are scaled to a new size
+constexpr auto SharedKeyFrameInterval = std::chrono::seconds(1); // minimum time between keyframes requested by other streams
 constexpr uint32_t ProgressiveCodecContextId = 1;
+constexpr uint32_t SuspendFrameAcknowledgement = 0xFFFFFFFF; // queueDepth value of MS-RDPEGFX 2.2.2.13
 struct RdpCapsInformation {
     uint32_t version;
     RDPGFX_CAPSET capSet;
@@ -112,73 +124,204 @@ struct Surface {
     uint16_t id;
     uint32_t codecContextId;
     QSize size;
+    QSize outputSize;
+    // Monitor layout the surface was mapped in, see VideoStream::performReset().
+    uint32_t layoutGeneration;
+};
+
+using ProgressiveContextPtr = std::unique_ptr<PROGRESSIVE_CONTEXT, decltype(&progressive_context_free)>;
+
+/**
+ * A captured monitor.
+ *
+ * Every output has its own capture stream, frame queue, surface and frame
+ * submission thread, so frames of one monitor are encoded and sent without
+ * waiting for the others. The first output is the primary monitor.
+ */
+class KRDP_NO_EXPORT VideoStream::Output
+{
+public:
+    int index = 0;
+    quint32 nodeId = 0;
+    quint64 objectSerial = quint64(-1);
+    // Logical geometry of the monitor on the server's desktop.
+    QRect geometry;
+
+    std::unique_ptr<PipeWireEncodedStream> encodedStream;
+    std::unique_ptr<PipeWireSourceStream> sourceStream;
+    ProgressiveContextPtr progressive = ProgressiveContextPtr(nullptr, progressive_context_free);
+
+    Surface surface = {};
+    QSize size;
+    // Size of the frames produced by the encoded stream.
+    QSize streamSize;
+    // Size the surface is shown at on the client's desktop, guarded by Private::gfxMutex.
+    QSize layoutSize;
+
+    std::atomic_bool pendingReset = true;
+    std::atomic_bool releaseSurface = false;
+    std::atomic_bool awaitingKeyFrame = false;
+    // Set when a layout change of another output made the client drop this output's surface.
+    std::atomic_bool surfaceLost = false;
+
+    // Surface the last frame was sent to and, for progressive, the last frame sent. Only
+    // used by the frame submission thread.
+    uint16_t sentSurfaceId = 0;
+    VideoFrame lastSentFrame;
+
+    std::mutex frameQueueMutex;
+    QQueue<VideoFrame> frameQueue;
+    // Captured frames not yet processed by onFrameReceived(), and the damage of frames skipped
+    // because a newer one was already waiting.
+    std::atomic_int queuedCaptureFrames = 0;
+    QRegion skippedDamage;
+
+    std::jthread frameSubmissionThread;
 };
 
 class KRDP_NO_EXPORT VideoStream::Private
 {
 public:
     using RdpGfxContextPtr = std::unique_ptr<RdpgfxServerContext, decltype(&rdpgfx_server_context_free)>;
-    using ProgressiveContextPtr = std::unique_ptr<PROGRESSIVE_CONTEXT, decltype(&progressive_context_free)>;
 
     RdpConnection *session;
     std::optional<EncodingMode> activeEncodingMode;
-    std::unique_ptr<PipeWireEncodedStream> encodedStream;
-    std::unique_ptr<PipeWireSourceStream> sourceStream;
+    // Outputs are only added on the main thread, while holding gfxMutex.
+    std::vector<std::unique_ptr<Output>> outputs;
     DmaBufHandler dmaBufHandler;
 
     RdpGfxContextPtr gfxContext = RdpGfxContextPtr(nullptr, rdpgfx_server_context_free);
-    ProgressiveContextPtr progressive = ProgressiveContextPtr(nullptr, progressive_context_free);
 
-    uint32_t frameId = 0;
+    // Serializes graphics pipeline messages from the frame submission threads.
+    // Also guards the monitor layout and the surface ids.
+    std::mutex gfxMutex;
+    // Monitor layout last sent to the client and a counter of how often it was sent.
+    QList<QRect> monitorLayout;
+    uint32_t layoutGeneration = 0;
+    uint16_t nextSurfaceId = 1;
+
+    std::atomic<uint32_t> frameId = 0;
     uint32_t channelId = 0;
-    quint32 nodeId = 0;
     int pipeWireFd = -1;
-    quint64 objectSerial = quint64(-1);
 
-    uint16_t nextSurfaceId = 1;
-    Surface surface;
-    QSize size;
     QSize requestedSize;
 
-    bool pendingReset = true;
     bool enabled = false;
+    // Output suppression, see VideoStream::setOutputSuppressed().
+    bool outputSuppressed = false;
     bool streamingEnabled = false;
     bool capsConfirmed = false;
     bool channelOpen = false;
 
-    std::jthread frameSubmissionThread;
-    std::mutex frameQueueMutex;
-
-    QQueue<VideoFrame> frameQueue;
     QSet<uint32_t> pendingFrames;
 
     std::mutex pendingFramesMutex;
 
     std::atomic_int requestedFrameRate = 60;
-    std::atomic<qsizetype> maxInFlight{MaximumInFlightFrames}; // recomputed from RTT on rttChanged
+    std::atomic<qsizetype> maxInFlight{MaximumInFlightFrames}; // set by updateCongestionControl()
     // Producer-rate estimate for window sizing (see VideoStream::effectiveProducerFps()).
     std::atomic<uint64_t> producedFrames = 0; // frames entering krdp; written from frame callbacks
-    uint64_t lastProducedFrames = 0; // touched only by updateInFlightWindow()
-    clk::steady_clock::time_point lastProducerRateUpdate{}; // touched only by updateInFlightWindow()
-    double smoothedProducerFps = MinimumWindowFrameRate; // touched only by updateInFlightWindow()
-    // RTT smoothing for window sizing (see updateInFlightWindow()); touched only there.
-    double smoothedRttMs = 0.0; // EWMA of valid averageRTT samples
-    bool hasSmoothedRtt = false;
-    double baseRttMs = 0.0; // session-minimum valid RTT (path BDP floor)
-    bool hasBaseRtt = false;
+    uint64_t lastProducedFrames = 0; // touched only by updateCongestionControl()
+    clk::steady_clock::time_point lastProducerRateUpdate{}; // touched only by updateCongestionControl()
+    double smoothedProducerFps = MinimumWindowFrameRate; // touched only by updateCongestionControl()
+
+    // Congestion controller inputs, written from the frame submission and connection threads.
+    // Only frames dropped because the in-flight window was full or the transport was write
+    // blocked count, frames merged because the encoder outpaces submission do not, so a busy
+    // CPU is not mistaken for network congestion.
+    std::atomic<uint64_t> droppedFrames = 0;
+    std::atomic<uint32_t> clientQueueDepth = 0;
+    std::atomic<uint64_t> averageFrameSize = 0;
+
+    std::unique_ptr<CongestionController> congestionController = std::make_unique<DelayBasedCongestionController>();
+    CongestionController::Outputs congestionOutputs;
+    std::atomic<quint8> targetQuality = 100;
+
+    // Server-side downscaling of the primary output. While scale is below 1.0 the stream
+    // is captured at a smaller size and the surface is mapped to an output of outputSize.
+    std::atomic_bool scaledOutputSupported = false;
+    double scale = 1.0;
+    QSize outputSize;
+    // While the client resizes, frames of the old size are scaled to resizeTarget
+    // until the capture produces frames of the new size.
+    QSize resizeTarget;
+    QTimer resizeTimer;
+    // Output size the surface is mapped to, for the frame submission thread. Invalid
+    // when the surface is mapped unscaled.
+    std::mutex scaledOutputMutex;
+    QSize scaledOutputSize;
+
+    // Static screen detection, see VideoStream::contentChanged().
+    QTimer idleTimer;
+    bool idle = false;
+
+    // Frame sharing between streams, see VideoStream::setFrameSource().
+    QPointer<VideoStream> frameSource;
+    QList<VideoStream *> viewers;
+    // Keyframes requested by viewers restart the encoder of the primary output, see
+    // VideoStream::requestSharedKeyFrame().
+    QTimer sharedKeyFrameTimer;
+    clk::steady_clock::time_point lastEncoderRestart;
 
     bool initialized = false;
     quint8 quality = 100;
 
+    Output &primary() const
+    {
+        return *outputs.front();
+    }
+
+    void publishScaledOutput()
+    {
+        std::lock_guard lock(scaledOutputMutex);
+        scaledOutputSize = scale < 1.0 ? outputSize : resizeTarget;
+    }
+
     void setSize(VideoStream *q, const QSize &newSize)
     {
-        if (size == newSize) {
+        auto &output = primary();
+        if (output.size == newSize) {
             return;
         }
 
-        size = newSize;
+        output.size = newSize;
         Q_EMIT q->sizeChanged(newSize);
     }
+
+    /**
+     * Position of every output on the client's desktop, outputs without frames are left out.
+     *
+     * Monitors keep their position on the server's desktop. Those positions are in logical
+     * coordinates, so they are scaled by the largest device pixel ratio of all monitors.
+     * That way monitors never overlap, at the cost of gaps next to monitors with a lower ratio.
+     */
+    QList<QRect> currentLayout() const
+    {
+        qreal ratio = 0.0;
+        std::optional<QPoint> origin;
+        for (const auto &output : outputs) {
+            if (!output->layoutSize.isValid() || output->geometry.isEmpty()) {
+                continue;
+            }
+            ratio = std::max(ratio, qreal(output->layoutSize.width()) / output->geometry.width());
+            const QPoint topLeft = output->geometry.topLeft();
+            origin = origin ? QPoint(std::min(origin->x(), topLeft.x()), std::min(origin->y(), topLeft.y())) : topLeft;
+        }
+
+        QList<QRect> layout(outputs.size());
+        for (const auto &output : outputs) {
+            if (!output->layoutSize.isValid()) {
+                continue;
+            }
+
+            QPoint position;
+            if (origin && !output->geometry.isEmpty()) {
+                position = (output->geometry.topLeft() - *origin) * ratio;
+            }
+            layout[output->index] = QRect(position, output->layoutSize);
+        }
+        return layout;
+    }
 };
 
 static QString encodingModeName(VideoStream::EncodingMode mode)
@@ -242,6 +385,31 @@ VideoStream::VideoStream(RdpConnection *session)
     , d(std::make_unique<Private>())
 {
     d->session = session;
+    d->outputs.push_back(std::make_unique<Output>());
+
+    d->idleTimer.setSingleShot(true);
+    d->idleTimer.setInterval(IdleTimeout);
+    connect(&d->idleTimer, &QTimer::timeout, this, [this]() {
+        setIdle(true);
+    });
+
+    d->resizeTimer.setSingleShot(true);
+    d->resizeTimer.setInterval(ResizeTransitionTimeout);
+    connect(&d->resizeTimer, &QTimer::timeout, this, [this]() {
+        // The capture did not follow the requested size, go back to mapping frames unscaled.
+        auto &primary = d->primary();
+        d->resizeTarget = QSize();
+        d->publishScaledOutput();
+        primary.pendingReset = true;
+        if (const auto size = primary.encodedStream ? primary.streamSize : primary.sourceStream ? primary.sourceStream->size() : QSize(); size.isValid()) {
+            d->setSize(this, size);
+        }
+    });
+
+    d->sharedKeyFrameTimer.setSingleShot(true);
+    connect(&d->sharedKeyFrameTimer, &QTimer::timeout, this, [this]() {
+        restartEncoder(d->primary());
+    });
 }
 
 void VideoStream::setActiveEncodingMode(EncodingMode mode)
@@ -250,63 +418,91 @@ void VideoStream::setActiveEncodingMode(EncodingMode mode)
         return;
     }
 
-    if (d->encodedStream) {
-        d->encodedStream->stop();
-        d->encodedStream.reset();
+    d->activeEncodingMode = mode;
+
+    for (const auto &output : d->outputs) {
+        createCaptureStream(*output);
+    }
+}
+
+void VideoStream::createCaptureStream(Output &output)
+{
+    if (output.encodedStream) {
+        output.encodedStream->stop();
+        output.encodedStream.reset();
     }
-    if (d->sourceStream) {
-        d->sourceStream->setActive(false);
-        d->sourceStream.reset();
+    if (output.sourceStream) {
+        output.sourceStream->setActive(false);
+        output.sourceStream.reset();
     }
 
     {
-        std::lock_guard lock(d->frameQueueMutex);
-        d->frameQueue.clear();
+        std::lock_guard lock(output.frameQueueMutex);
+        output.frameQueue.clear();
     }
 
-    d->activeEncodingMode = mode;
+    // Only the primary output follows the size requested by the client.
+    const auto requestedSize = output.index == 0 ? streamRequestedSize() : QSize();
 
-    if (mode == EncodingMode::H264) {
-        d->encodedStream = std::make_unique<PipeWireEncodedStream>();
-        d->encodedStream->setEncodingPreference(PipeWireBaseEncodedStream::EncodingPreference::Speed);
-        d->encodedStream->setColorRange(PipeWireBaseEncodedStream::ColorRange::Full);
-        d->encodedStream->setEncoder(PipeWireEncodedStream::H264Baseline);
-        d->encodedStream->setQuality(d->quality);
-        d->encodedStream->setMaxFramerate(d->requestedFrameRate, 1);
-        d->encodedStream->setMaxPendingFrames(d->requestedFrameRate);
-        if (d->requestedSize.isValid()) {
-            d->encodedStream->setRequestedSize(d->requestedSize);
+    if (d->activeEncodingMode == EncodingMode::H264) {
+        output.encodedStream = std::make_unique<PipeWireEncodedStream>();
+        output.encodedStream->setEncodingPreference(PipeWireBaseEncodedStream::EncodingPreference::Speed);
+        output.encodedStream->setColorRange(PipeWireBaseEncodedStream::ColorRange::Full);
+        output.encodedStream->setEncoder(PipeWireEncodedStream::H264Baseline);
+        output.encodedStream->setQuality(d->congestionOutputs.quality);
+        output.encodedStream->setMaxFramerate(captureFrameRate(), 1);
+        output.encodedStream->setMaxPendingFrames(EncoderPendingFrames);
+        if (requestedSize.isValid()) {
+            output.encodedStream->setRequestedSize(requestedSize);
         }
 
-        connect(d->encodedStream.get(), &PipeWireEncodedStream::newPacket, this, &VideoStream::onPacketReceived);
-        connect(d->encodedStream.get(), &PipeWireEncodedStream::sizeChanged, this, [this](const QSize &size) {
-            d->setSize(this, size);
+        connect(output.encodedStream.get(), &PipeWireEncodedStream::newPacket, this, [this, &output](const PipeWireEncodedStream::Packet &packet) {
+            onPacketReceived(output, packet);
         });
-        connect(d->encodedStream.get(), &PipeWireEncodedStream::cursorChanged, this, &VideoStream::cursorChanged);
-        if (d->nodeId != 0) {
-            d->encodedStream->setObjectSerial(d->objectSerial);
-            d->encodedStream->setNodeId(d->nodeId);
+        connect(output.encodedStream.get(), &PipeWireEncodedStream::sizeChanged, this, [this, &output](const QSize &size) {
+            output.streamSize = size;
+            onStreamSizeChanged(output, size);
+        });
+        connect(output.encodedStream.get(), &PipeWireEncodedStream::cursorChanged, this, &VideoStream::cursorChanged);
+        if (output.nodeId != 0) {
+            output.encodedStream->setObjectSerial(output.objectSerial);
+            output.encodedStream->setNodeId(output.nodeId);
             if (d->pipeWireFd > 0) {
-                d->encodedStream->setFd(d->pipeWireFd);
+                output.encodedStream->setFd(d->pipeWireFd);
             }
         }
-        if (d->streamingEnabled && d->nodeId != 0) {
-            d->encodedStream->start();
+        if (d->streamingEnabled && output.nodeId != 0) {
+            output.encodedStream->start();
         }
     } else {
-        d->sourceStream = std::make_unique<PipeWireSourceStream>();
-        d->sourceStream->setAllowDmaBuf(true);
-        d->sourceStream->setDamageEnabled(true);
-        d->sourceStream->setMaxFramerate({static_cast<quint32>(d->requestedFrameRate.load()), 1});
-        if (d->requestedSize.isValid()) {
-            d->sourceStream->setRequestedSize(d->requestedSize);
+        output.sourceStream = std::make_unique<PipeWireSourceStream>();
+        output.sourceStream->setAllowDmaBuf(true);
+        output.sourceStream->setDamageEnabled(true);
+        output.sourceStream->setMaxFramerate({static_cast<quint32>(captureFrameRate()), 1});
+        if (requestedSize.isValid()) {
+            output.sourceStream->setRequestedSize(requestedSize);
         }
-        connect(d->sourceStream.get(), &PipeWireSourceStream::frameReceived, this, &VideoStream::onFrameReceived, Qt::QueuedConnection);
-        connect(d->sourceStream.get(), &PipeWireSourceStream::streamParametersChanged, this, [this]() {
-            d->setSize(this, d->sourceStream->size());
+        connect(
+            output.sourceStream.get(),
+            &PipeWireSourceStream::frameReceived,
+            this,
+            [&output]() {
+                output.queuedCaptureFrames++;
+            },
+            Qt::DirectConnection);
+        connect(
+            output.sourceStream.get(),
+            &PipeWireSourceStream::frameReceived,
+            this,
+            [this, &output](const PipeWireFrame &frame) {
+                onFrameReceived(output, frame);
+            },
+            Qt::QueuedConnection);
+        connect(output.sourceStream.get(), &PipeWireSourceStream::streamParametersChanged, this, [this, &output]() {
+            onStreamSizeChanged(output, output.sourceStream->size());
         });
         connect(
-            d->sourceStream.get(),
+            output.sourceStream.get(),
             &PipeWireSourceStream::frameReceived,
             this,
             [this](const PipeWireFrame &frame) {
@@ -316,26 +512,31 @@ void VideoStream::setActiveEncodingMode(EncodingMode mode)
             },
             Qt::QueuedConnection);
 
-        if (d->nodeId != 0 && d->pipeWireFd) {
+        if (output.nodeId != 0 && d->pipeWireFd) {
             bool created = false;
-            if (d->objectSerial != quint64(-1)) {
-                created = d->sourceStream->createStream(d->objectSerial, d->pipeWireFd);
+            if (output.objectSerial != quint64(-1)) {
+                created = output.sourceStream->createStream(output.objectSerial, d->pipeWireFd);
             } else {
-                created = d->sourceStream->createStream(d->nodeId, d->pipeWireFd);
+                created = output.sourceStream->createStream(output.nodeId, d->pipeWireFd);
             }
             if (!created) {
-                qCWarning(KRDP) << "Could not create PipeWire source stream" << d->sourceStream->error();
+                qCWarning(KRDP) << "Could not create PipeWire source stream" << output.sourceStream->error();
                 d->session->close(RdpConnection::CloseReason::VideoInitFailed);
                 return;
             }
-            d->size = d->sourceStream->size();
+            if (output.index == 0) {
+                d->setSize(this, output.sourceStream->size());
+            } else {
+                output.size = output.sourceStream->size();
+            }
         }
-        d->sourceStream->setActive(d->streamingEnabled && d->nodeId != 0);
+        output.sourceStream->setActive(d->streamingEnabled && output.nodeId != 0);
     }
 }
 
 VideoStream::~VideoStream()
 {
+    setFrameSource(nullptr);
     close();
 }
 
@@ -364,19 +565,50 @@ bool VideoStream::initialize()
         return false;
     }
 
-    d->progressive.reset(progressive_context_new(TRUE));
-    if (!d->progressive) {
-        qCWarning(KRDP) << "Failed to create progressive codec context";
-        d->gfxContext.reset();
-        return false;
+    for (const auto &output : d->outputs) {
+        if (!startFrameSubmission(*output)) {
+            d->gfxContext.reset();
+            return false;
+        }
     }
 
     d->initialized = true;
 
-    connect(d->session->networkDetection(), &NetworkDetection::rttChanged, this, &VideoStream::updateInFlightWindow);
+    connect(d->session->networkDetection(), &NetworkDetection::rttChanged, this, &VideoStream::updateCongestionControl);
+
+    qCDebug(KRDP) << "Video stream initialized with H.264" << (h264Disabled() ? "disabled" : "enabled");
 
-    d->frameSubmissionThread = std::jthread([this](std::stop_token token) {
+    return true;
+}
+
+bool VideoStream::startFrameSubmission(Output &output)
+{
+    output.progressive.reset(progressive_context_new(TRUE));
+    if (!output.progressive) {
+        qCWarning(KRDP) << "Failed to create progressive codec context";
+        return false;
+    }
+
+    output.frameSubmissionThread = std::jthread([this, &output](std::stop_token token) {
         while (!token.stop_requested()) {
+            // The surface is owned by this thread while streaming, so release it here.
+            if (output.releaseSurface.exchange(false)) {
+                std::lock_guard lock(d->gfxMutex);
+                destroySurface(output);
+            }
+
+            // Another output changed the layout and the client dropped this output's surface. Recreate
+            // it right away, a static monitor would otherwise stay black until its content changes.
+            if (d->gfxContext && d->capsConfirmed && output.surfaceLost.exchange(false)) {
+                restoreSurface(output);
+            }
+
+            // Pointer updates are sent from the primary output's thread as well, after the
+            // frames queued before them.
+            if (output.index == 0) {
+                d->session->cursor()->sendPendingUpdates();
+            }
+
             if (!hasInFlightCapacity() || !d->gfxContext || !d->capsConfirmed) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 continue;
@@ -384,48 +616,56 @@ bool VideoStream::initialize()
 
             VideoFrame nextFrame;
             {
-                std::unique_lock lock(d->frameQueueMutex);
-                if (!d->frameQueue.isEmpty()) {
-                    nextFrame = d->frameQueue.takeFirst();
+                std::unique_lock lock(output.frameQueueMutex);
+                if (!output.frameQueue.isEmpty()) {
+                    nextFrame = output.frameQueue.takeFirst();
                 }
             }
             if (nextFrame.size.isEmpty()) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1000) / d->requestedFrameRate.load());
                 continue;
             }
-            sendFrame(nextFrame);
+            sendFrame(output, nextFrame);
         }
     });
 
-    qCDebug(KRDP) << "Video stream initialized with H.264" << (h264Disabled() ? "disabled" : "enabled");
-
     return true;
 }
 
 void VideoStream::close()
 {
-    if (d->encodedStream) {
-        d->encodedStream->stop();
-    }
-    if (d->sourceStream) {
-        d->sourceStream->setActive(false);
+    for (const auto &output : d->outputs) {
+        if (output->encodedStream) {
+            output->encodedStream->stop();
+        }
+        if (output->sourceStream) {
+            output->sourceStream->setActive(false);
+        }
     }
-    if (d->frameSubmissionThread.joinable()) {
-        d->frameSubmissionThread.request_stop();
-        d->frameSubmissionThread.join();
+    for (const auto &output : d->outputs) {
+        if (output->frameSubmissionThread.joinable()) {
+            output->frameSubmissionThread.request_stop();
+            output->frameSubmissionThread.join();
+        }
     }
 
     {
         std::lock_guard lock(d->pendingFramesMutex);
         d->pendingFrames.clear();
     }
+
     {
-        std::lock_guard lock(d->frameQueueMutex);
-        d->frameQueue.clear();
+        std::lock_guard lock(d->gfxMutex);
+        for (const auto &output : d->outputs) {
+            {
+                std::lock_guard queueLock(output->frameQueueMutex);
+                output->frameQueue.clear();
+            }
+            destroySurface(*output);
+        }
+        d->monitorLayout.clear();
     }
 
-    destroySurface();
-
     if (d->gfxContext) {
         if (d->channelOpen) {
             d->gfxContext->Close(d->gfxContext.get());
@@ -440,35 +680,66 @@ void VideoStream::close()
 }
 
 void VideoStream::queueFrame(const KRdp::VideoFrame &frame)
+{
+    queueFrame(d->primary(), frame);
+}
+
+void VideoStream::queueFrame(Output &output, const KRdp::VideoFrame &frame)
 {
     if (d->session->state() != RdpConnection::State::Streaming || !d->enabled) {
         return;
     }
     d->producedFrames.fetch_add(1, std::memory_order_relaxed); // count only accepted frames
 
-    std::lock_guard lock(d->frameQueueMutex);
+    // Checked before taking the queue lock, the submission thread locks them the other way around.
+    const bool windowFull = !hasInFlightCapacity();
+
+    std::lock_guard lock(output.frameQueueMutex);
     if (d->activeEncodingMode == EncodingMode::H264) {
         if (frame.isKeyFrame) {
-            d->frameQueue.clear();
+            output.awaitingKeyFrame = false;
+            if (windowFull) {
+                d->droppedFrames += output.frameQueue.size();
+            }
+            output.frameQueue.clear();
+        } else if (output.awaitingKeyFrame) {
+            // A new surface can only start decoding at a keyframe.
+            if (d->frameSource) {
+                d->frameSource->requestSharedKeyFrame();
+            }
+            return;
+        } else if (d->frameSource && output.frameQueue.size() >= d->maxInFlight.load()) {
+            // This client cannot keep up with the shared encoder. Frames cannot be left
+            // out of an H.264 stream, so skip ahead to the next keyframe instead.
+            d->droppedFrames += output.frameQueue.size() + 1;
+            output.frameQueue.clear();
+            output.awaitingKeyFrame = true;
+            d->frameSource->requestSharedKeyFrame();
+            return;
         }
-        d->frameQueue.append(frame);
+        output.frameQueue.append(frame);
         return;
     } else if (d->activeEncodingMode == EncodingMode::Progressive) {
         // for the raster path we only need to keep the latest frame, but accumulate damage
         QRegion lastDamage;
-        if (!d->frameQueue.isEmpty()) {
-            lastDamage = d->frameQueue.last().damage;
-            d->frameQueue.clear();
+        if (!output.frameQueue.isEmpty()) {
+            lastDamage = output.frameQueue.last().damage;
+            if (windowFull) {
+                d->droppedFrames += output.frameQueue.size();
+            }
+            output.frameQueue.clear();
         }
         KRdp::VideoFrame nextFrame = frame;
         nextFrame.damage += lastDamage;
-        d->frameQueue.append(std::move(nextFrame));
+        output.frameQueue.append(std::move(nextFrame));
     }
 }
 
 void VideoStream::reset()
 {
-    d->pendingReset = true;
+    for (const auto &output : d->outputs) {
+        output->pendingReset = true;
+    }
 }
 
 bool VideoStream::enabled() const
@@ -483,9 +754,142 @@ void VideoStream::setEnabled(bool enabled)
     }
 
     d->enabled = enabled;
+    // This is called from the connection thread when the client suppresses output.
+    QMetaObject::invokeMethod(
+        this,
+        [this, enabled]() {
+            setOutputSuppressed(!enabled);
+        },
+        Qt::QueuedConnection);
     Q_EMIT enabledChanged();
 }
 
+void VideoStream::setOutputSuppressed(bool suppressed)
+{
+    if (d->outputSuppressed == suppressed) {
+        return;
+    }
+    d->outputSuppressed = suppressed;
+
+    if (suppressed) {
+        for (const auto &output : d->outputs) {
+            {
+                std::lock_guard lock(output->frameQueueMutex);
+                output->frameQueue.clear();
+            }
+            output->releaseSurface = true;
+        }
+
+        // Other streams may still be sending the frames captured here.
+        if (d->viewers.isEmpty()) {
+            qCDebug(KRDP) << "Output suppressed, stopping capture and encoding";
+            setCaptureActive(false);
+            d->idleTimer.stop();
+        }
+        return;
+    }
+
+    qCDebug(KRDP) << "Output resumed, restarting capture and encoding";
+
+    for (const auto &output : d->outputs) {
+        // A new surface is created for the next frame, which is sent in full.
+        output->pendingReset = true;
+        output->awaitingKeyFrame = d->activeEncodingMode == EncodingMode::H264;
+    }
+    setCaptureActive(true);
+    contentChanged();
+}
+
+void VideoStream::setCaptureActive(bool active)
+{
+    for (const auto &output : d->outputs) {
+        if (!active) {
+            // Stop rather than pause the encoder, which releases its buffers and
+            // guarantees the stream starts with a keyframe when it is restarted.
+            if (output->encodedStream) {
+                output->encodedStream->stop();
+            }
+            if (output->sourceStream) {
+                output->sourceStream->setActive(false);
+            }
+            continue;
+        }
+
+        if (output->encodedStream && d->streamingEnabled && output->nodeId != 0) {
+            if (output->encodedStream->state() == PipeWireBaseEncodedStream::Idle) {
+                output->encodedStream->start();
+            } else if (output->awaitingKeyFrame) {
+                // The encoder kept running for other streams.
+                restartEncoder(*output);
+            }
+        }
+        if (output->sourceStream) {
+            output->sourceStream->setActive(d->streamingEnabled && output->nodeId != 0);
+        }
+    }
+}
+
+void VideoStream::setFrameSource(VideoStream *source)
+{
+    if (d->frameSource == source) {
+        return;
+    }
+
+    if (d->frameSource) {
+        disconnect(d->frameSource, nullptr, this, nullptr);
+        auto previous = d->frameSource.data();
+        previous->d->viewers.removeAll(this);
+        if (previous->d->viewers.isEmpty() && previous->d->outputSuppressed) {
+            qCDebug(KRDP) << "Output suppressed and no other streams left, stopping capture and encoding";
+            previous->setCaptureActive(false);
+            previous->d->idleTimer.stop();
+        }
+    }
+
+    d->frameSource = source;
+    if (!source) {
+        return;
+    }
+
+    // The client may have negotiated its encoding before it got a source.
+    const auto sourceMode = source->d->activeEncodingMode;
+    if (d->activeEncodingMode && sourceMode && d->activeEncodingMode != sourceMode) {
+        if (*sourceMode == EncodingMode::H264) {
+            qCWarning(KRDP) << "Client cannot decode the shared H.264 stream";
+            d->frameSource = nullptr;
+            d->session->close(RdpConnection::CloseReason::VideoInitFailed);
+            return;
+        }
+        setActiveEncodingMode(*sourceMode);
+        d->primary().releaseSurface = true;
+    }
+
+    source->d->viewers.append(this);
+    if (source->d->viewers.size() == 1 && source->d->outputSuppressed) {
+        // The client of source does not want frames, but this one does.
+        source->setCaptureActive(true);
+    }
+    connect(source, &VideoStream::frameCaptured, this, [this](const VideoFrame &frame) {
+        queueFrame(d->primary(), frame);
+    });
+    connect(source, &VideoStream::cursorChanged, this, &VideoStream::cursorChanged);
+    connect(source, &VideoStream::sizeChanged, this, [this](const QSize &size) {
+        d->setSize(this, size);
+    });
+    if (const auto size = source->d->primary().size; size.isValid()) {
+        d->setSize(this, size);
+    }
+
+    // Frames are shared mid-stream, so decoding has to wait for the next keyframe.
+    auto &primary = d->primary();
+    {
+        std::lock_guard lock(primary.frameQueueMutex);
+        primary.frameQueue.clear();
+    }
+    primary.pendingReset = true;
+    primary.awaitingKeyFrame = true;
+}
+
 void VideoStream::setStreamingEnabled(bool enabled)
 {
     if (d->streamingEnabled == enabled) {
@@ -493,76 +897,176 @@ void VideoStream::setStreamingEnabled(bool enabled)
     }
 
     d->streamingEnabled = enabled;
-    if (d->encodedStream) {
-        if (enabled && d->nodeId != 0) {
-            if (d->encodedStream->state() == PipeWireBaseEncodedStream::Paused) {
-                d->encodedStream->resume();
+    for (const auto &output : d->outputs) {
+        if (output->encodedStream) {
+            if (enabled && output->nodeId != 0) {
+                if (output->encodedStream->state() == PipeWireBaseEncodedStream::Paused) {
+                    if (output->awaitingKeyFrame) {
+                        // Restart rather than resume to get a keyframe, see requestKeyFrame().
+                        output->encodedStream->stop();
+                        output->encodedStream->start();
+                    } else {
+                        output->encodedStream->resume();
+                    }
+                } else {
+                    output->encodedStream->start();
+                }
             } else {
-                d->encodedStream->start();
+                output->encodedStream->pause();
             }
-        } else {
-            d->encodedStream->pause();
         }
-    }
-    if (d->sourceStream) {
-        d->sourceStream->setActive(enabled && d->nodeId != 0);
+        if (output->sourceStream) {
+            output->sourceStream->setActive(enabled && output->nodeId != 0);
+        }
     }
 }
 
 void VideoStream::setVideoQuality(quint8 quality)
 {
     d->quality = quality;
-    if (d->encodedStream) {
-        d->encodedStream->setQuality(quality);
-    }
+    d->congestionController->setLimits(d->requestedFrameRate, quality);
+    updateCongestionControl();
+}
+
+void VideoStream::setCongestionController(std::unique_ptr<CongestionController> controller)
+{
+    Q_ASSERT(controller);
+    d->congestionController = std::move(controller);
+    d->congestionController->setLimits(d->requestedFrameRate, d->quality);
+    updateCongestionControl();
+}
+
+int VideoStream::requestedFrameRate() const
+{
+    return d->requestedFrameRate;
 }
 
 void VideoStream::setRequestedSize(const QSize &size)
 {
-    d->requestedSize = size;
-    if (d->encodedStream) {
-        d->encodedStream->setRequestedSize(size);
+    if (size == d->requestedSize) {
+        return;
     }
-    if (d->sourceStream) {
-        d->sourceStream->setRequestedSize(size);
+
+    d->requestedSize = size;
+    if (d->outputs.size() > 1) {
+        // Monitors keep the size they have on the server.
+        return;
     }
+
+    auto &primary = d->primary();
+    if (d->scale < 1.0 && size.isValid()) {
+        d->outputSize = size;
+        d->publishScaledOutput();
+        primary.pendingReset = true;
+    } else if (d->scaledOutputSupported && size.isValid() && primary.size.isValid() && size != primary.size) {
+        // Rather than stalling until the capture delivers frames of the new size,
+        // show the current frames scaled to it.
+        d->resizeTarget = size;
+        d->publishScaledOutput();
+        primary.pendingReset = true;
+        d->setSize(this, size);
+        d->resizeTimer.start();
+    }
+    applyRequestedSize();
 }
 
-void VideoStream::setPipeWireSource(quint32 nodeId, quint64 objectSerial, int fd)
+void VideoStream::onStreamSizeChanged(Output &output, const QSize &size)
 {
-    d->nodeId = nodeId;
-    d->objectSerial = objectSerial;
+    if (output.index != 0) {
+        output.size = size;
+        return;
+    }
 
-    d->pipeWireFd = fd;
+    if (d->resizeTarget.isValid() && size == d->resizeTarget) {
+        d->resizeTimer.stop();
+        d->resizeTarget = QSize();
+        d->publishScaledOutput();
+    }
 
-    if (d->encodedStream) {
-        d->encodedStream->setObjectSerial(objectSerial);
-        d->encodedStream->setNodeId(nodeId);
+    if (d->scale >= 1.0 && !d->resizeTarget.isValid()) {
+        d->setSize(this, size);
+    }
+}
 
-        d->encodedStream->setFd(d->pipeWireFd);
-        if (d->streamingEnabled) {
-            d->encodedStream->start();
-        }
+QSize VideoStream::streamRequestedSize() const
+{
+    if (d->outputs.size() > 1) {
+        return QSize();
+    }
+
+    if (d->scale >= 1.0) {
+        return d->requestedSize;
     }
 
-    if (!d->sourceStream)
+    // Keep dimensions even, encoders generally require that.
+    const int width = int(d->outputSize.width() * d->scale) & ~1;
+    const int height = int(d->outputSize.height() * d->scale) & ~1;
+    return QSize(width, height);
+}
+
+void VideoStream::applyRequestedSize()
+{
+    auto size = streamRequestedSize();
+    if (!size.isValid()) {
+        // Going back to the native size without an explicit request from the client.
+        size = d->outputSize;
+    }
+    if (!size.isValid()) {
         return;
+    }
 
-    bool created = false;
-    if (objectSerial != quint64(-1)) {
-        created = d->sourceStream->createStream(objectSerial, fd);
-    } else {
-        created = d->sourceStream->createStream(nodeId, fd);
+    auto &primary = d->primary();
+    if (primary.encodedStream) {
+        primary.encodedStream->setRequestedSize(size);
     }
+    if (primary.sourceStream) {
+        primary.sourceStream->setRequestedSize(size);
+    }
+}
 
-    if (!created) {
-        qCWarning(KRDP) << "Could not create PipeWire source stream" << d->sourceStream->error();
-        d->session->close(RdpConnection::CloseReason::VideoInitFailed);
+void VideoStream::setPipeWireSource(quint32 nodeId, quint64 objectSerial, int fd)
+{
+    setPipeWireSources({PipeWireSource{.nodeId = nodeId, .objectSerial = objectSerial}}, fd);
+}
+
+void VideoStream::setPipeWireSources(const QList<PipeWireSource> &sources, int fd)
+{
+    if (sources.isEmpty()) {
         return;
     }
 
-    d->setSize(this, d->sourceStream->size());
-    d->sourceStream->setActive(d->streamingEnabled);
+    d->pipeWireFd = fd;
+
+    for (qsizetype i = d->outputs.size(); i < sources.size(); ++i) {
+        auto output = std::make_unique<Output>();
+        output->index = i;
+        std::lock_guard lock(d->gfxMutex);
+        d->outputs.push_back(std::move(output));
+    }
+
+    for (qsizetype i = 0; i < sources.size(); ++i) {
+        auto &output = *d->outputs.at(i);
+        output.nodeId = sources.at(i).nodeId;
+        output.objectSerial = sources.at(i).objectSerial;
+        {
+            // Read by the frame submission threads to build the monitor layout.
+            std::lock_guard lock(d->gfxMutex);
+            output.geometry = sources.at(i).geometry;
+        }
+
+        if (d->initialized && !output.frameSubmissionThread.joinable() && !startFrameSubmission(output)) {
+            d->session->close(RdpConnection::CloseReason::VideoInitFailed);
+            return;
+        }
+
+        if (d->activeEncodingMode) {
+            createCaptureStream(output);
+        }
+    }
+
+    if (sources.size() > 1) {
+        qCDebug(KRDP) << "Streaming" << sources.size() << "monitors";
+    }
 }
 
 bool VideoStream::onChannelIdAssigned(uint32_t channelId)
@@ -581,8 +1085,15 @@ uint32_t VideoStream::onCapsAdvertise(const RDPGFX_CAPS_ADVERTISE_PDU *capsAdver
     if (d->capsConfirmed) {
         qCDebug(KRDP) << "GFX channel reset (re-advertisement), resetting surface state";
         d->capsConfirmed = false;
-        d->pendingReset = true;
-        destroySurface();
+        {
+            std::lock_guard lock(d->gfxMutex);
+            for (const auto &output : d->outputs) {
+                output->pendingReset = true;
+                destroySurface(*output);
+            }
+            // The client dropped its graphics state, so the layout has to be sent again.
+            d->monitorLayout.clear();
+        }
         std::lock_guard lock(d->pendingFramesMutex);
         d->pendingFrames.clear();
     }
@@ -647,12 +1158,27 @@ uint32_t VideoStream::onCapsAdvertise(const RDPGFX_CAPS_ADVERTISE_PDU *capsAdver
         return CHANNEL_RC_INITIALIZATION_ERROR;
     }
 
+    bool sourceModeSupported = true;
     QMetaObject::invokeMethod(
         this,
-        [this, negotiatedMode]() {
+        [this, supportsH264, &negotiatedMode, &sourceModeSupported]() {
+            // Shared frames are already encoded, so the encoding of their source has to be used.
+            if (d->frameSource && d->frameSource->d->activeEncodingMode) {
+                const auto sourceMode = *d->frameSource->d->activeEncodingMode;
+                if (sourceMode == EncodingMode::H264 && !supportsH264) {
+                    sourceModeSupported = false;
+                    return;
+                }
+                negotiatedMode = sourceMode;
+            }
             setActiveEncodingMode(negotiatedMode);
         },
         Qt::BlockingQueuedConnection); // RDP callbacks are on the connection thread, VideoStream operates on the main thread
+    if (!sourceModeSupported) {
+        qCWarning(KRDP) << "Client cannot decode the shared H.264 stream";
+        d->session->close(RdpConnection::CloseReason::VideoInitFailed);
+        return CHANNEL_RC_INITIALIZATION_ERROR;
+    }
     qCDebug(KRDP) << "Selected encoding mode:" << encodingModeName(negotiatedMode);
 
     auto maxVersion = std::max_element(capsInformation.begin(), capsInformation.end(), [](const auto &first, const auto &second) {
@@ -661,6 +1187,8 @@ uint32_t VideoStream::onCapsAdvertise(const RDPGFX_CAPS_ADVERTISE_PDU *capsAdver
 
     qCDebug(KRDP) << "Selected caps:" << capVersionToString(maxVersion->version);
 
+    d->scaledOutputSupported = maxVersion->version >= RDPGFX_CAPVERSION_107 && !(maxVersion->capSet.flags & RDPGFX_CAPS_FLAG_SCALEDMAP_DISABLE);
+
     RDPGFX_CAPS_CONFIRM_PDU capsConfirmPdu;
     capsConfirmPdu.capsSet = &(maxVersion->capSet);
     const UINT status = d->gfxContext->CapsConfirm(d->gfxContext.get(), &capsConfirmPdu);
@@ -687,25 +1215,93 @@ uint32_t VideoStream::onFrameAcknowledge(const RDPGFX_FRAME_ACKNOWLEDGE_PDU *fra
     }
 
     d->pendingFrames.erase(itr);
+    d->session->networkDetection()->frameAcknowledged(id);
+
+    if (frameAcknowledge->queueDepth != SuspendFrameAcknowledgement) {
+        d->clientQueueDepth = frameAcknowledge->queueDepth;
+    }
 
     return CHANNEL_RC_OK;
 }
 
-void VideoStream::onPacketReceived(const PipeWireEncodedStream::Packet &data)
+void VideoStream::notifyInput()
 {
+    contentChanged();
+}
+
+void VideoStream::contentChanged()
+{
+    if (d->idle) {
+        setIdle(false);
+    }
+    d->idleTimer.start();
+}
+
+void VideoStream::setIdle(bool idle)
+{
+    if (d->idle == idle) {
+        return;
+    }
+
+    qCDebug(KRDP) << (idle ? "Screen is static, reducing capture frame rate" : "Screen changed, restoring capture frame rate");
+    d->idle = idle;
+    applyFrameRate();
+}
+
+int VideoStream::captureFrameRate() const
+{
+    const int frameRate = d->congestionOutputs.frameRate;
+    return d->idle ? std::min(IdleFrameRate, frameRate) : frameRate;
+}
+
+void VideoStream::applyFrameRate()
+{
+    const int frameRate = captureFrameRate();
+    for (const auto &output : d->outputs) {
+        if (output->encodedStream) {
+            output->encodedStream->setMaxFramerate(frameRate, 1);
+        }
+        if (output->sourceStream) {
+            output->sourceStream->setMaxFramerate({static_cast<quint32>(frameRate), 1});
+        }
+    }
+}
+
+void VideoStream::onPacketReceived(Output &output, const PipeWireEncodedStream::Packet &data)
+{
+    // The encoded stream carries no damage information, but an encoder
+    // produces tiny P-frames when nothing changed.
+    if (data.isKeyFrame() || data.data().size() >= StaticPacketSize) {
+        contentChanged();
+    }
+
     VideoFrame frameData;
-    frameData.size = d->size;
+    frameData.size = output.streamSize.isValid() ? output.streamSize : output.size;
     frameData.data = data.data();
     frameData.isKeyFrame = data.isKeyFrame();
-    queueFrame(frameData);
+    if (output.index == 0) {
+        Q_EMIT frameCaptured(frameData);
+    }
+    queueFrame(output, frameData);
 }
 
-void VideoStream::onFrameReceived(const PipeWireFrame &data)
+void VideoStream::onFrameReceived(Output &output, const PipeWireFrame &data)
 {
     VideoFrame frameData;
 
     frameData.size = data.dataFrame ? data.dataFrame->size : QSize(data.dmabuf ? data.dmabuf->width : 0, data.dmabuf ? data.dmabuf->height : 0);
     frameData.damage = data.damage.value_or(QRegion(QRect(QPoint(0, 0), frameData.size)));
+    if (!frameData.damage.isEmpty()) {
+        contentChanged();
+    }
+
+    // A newer frame is already waiting, so this one would be replaced before it is
+    // encoded. Skip the conversion or DMA-BUF download and carry its damage forward.
+    if (output.queuedCaptureFrames.fetch_sub(1) > 1) {
+        output.skippedDamage += frameData.damage;
+        return;
+    }
+    frameData.damage += std::exchange(output.skippedDamage, QRegion());
     if (data.presentationTimestamp) {
         frameData.presentationTimeStamp = clk::system_clock::time_point(clk::duration_cast<clk::microseconds>(*data.presentationTimestamp));
     }
@@ -724,7 +1320,10 @@ void VideoStream::onFrameReceived(const PipeWireFrame &data)
         return;
     }
 
-    queueFrame(frameData);
+    if (output.index == 0) {
+        Q_EMIT frameCaptured(frameData);
+    }
+    queueFrame(output, frameData);
 }
 
 bool VideoStream::openChannel()
@@ -745,114 +1344,183 @@ bool VideoStream::openChannel()
     return true;
 }
 
-void VideoStream::destroySurface()
+void VideoStream::destroySurface(Output &output)
 {
-    if (d->surface.id == 0) {
+    // Called with gfxMutex held.
+    if (output.surface.id == 0) {
         return;
     }
 
-    if (d->gfxContext && d->surface.codecContextId != 0) {
+    // The client deletes all surfaces on ResetGraphics, so surfaces of an older layout are already gone.
+    const bool clientHasSurface = output.surface.layoutGeneration == d->layoutGeneration;
+
+    if (d->gfxContext && clientHasSurface && output.surface.codecContextId != 0) {
         RDPGFX_DELETE_ENCODING_CONTEXT_PDU deleteEncodingContextPdu = {};
-        deleteEncodingContextPdu.surfaceId = d->surface.id;
-        deleteEncodingContextPdu.codecContextId = d->surface.codecContextId;
+        deleteEncodingContextPdu.surfaceId = output.surface.id;
+        deleteEncodingContextPdu.codecContextId = output.surface.codecContextId;
         const UINT status = d->gfxContext->DeleteEncodingContext(d->gfxContext.get(), &deleteEncodingContextPdu);
         if (status != CHANNEL_RC_OK && status != CHANNEL_RC_NOT_INITIALIZED) {
             qCWarning(KRDP) << "DeleteEncodingContext failed" << status;
         }
     }
 
-    if (d->gfxContext) {
+    if (d->gfxContext && clientHasSurface) {
         RDPGFX_DELETE_SURFACE_PDU deleteSurfacePdu = {};
-        deleteSurfacePdu.surfaceId = d->surface.id;
+        deleteSurfacePdu.surfaceId = output.surface.id;
         const UINT status = d->gfxContext->DeleteSurface(d->gfxContext.get(), &deleteSurfacePdu);
         if (status != CHANNEL_RC_OK && status != CHANNEL_RC_NOT_INITIALIZED) {
             qCWarning(KRDP) << "DeleteSurface failed" << status;
         }
     }
 
-    if (d->progressive) {
-        progressive_delete_surface_context(d->progressive.get(), d->surface.id);
+    if (output.progressive) {
+        progressive_delete_surface_context(output.progressive.get(), output.surface.id);
     }
 
-    d->surface = Surface{};
+    output.surface = Surface{};
 }
 
-void VideoStream::performReset(QSize size)
+void VideoStream::performReset(Output &output, QSize size)
 {
+    // Called with gfxMutex held.
     if (!d->gfxContext) {
         auto settings = d->session->rdpPeerContext()->settings;
         freerdp_settings_set_uint32(settings, FreeRDP_DesktopWidth, size.width());
         freerdp_settings_set_uint32(settings, FreeRDP_DesktopHeight, size.height());
         d->session->rdpPeerContext()->update->DesktopResize(d->session->rdpPeerContext());
-        d->surface.size = size;
+        output.surface.size = size;
         return;
     }
 
-    destroySurface();
+    // When downscaling or resizing, the client's desktop has a different size than
+    // the frames and the surface is scaled to it.
+    QSize outputSize = size;
+    if (output.index == 0) {
+        std::lock_guard lock(d->scaledOutputMutex);
+        if (d->scaledOutputSize.isValid()) {
+            outputSize = d->scaledOutputSize;
+        }
+    }
+    output.layoutSize = outputSize;
 
-    RDPGFX_RESET_GRAPHICS_PDU resetGraphicsPdu;
-    resetGraphicsPdu.width = size.width();
-    resetGraphicsPdu.height = size.height();
-    resetGraphicsPdu.monitorCount = 1;
-
-    MONITOR_DEF monitor = {};
-    monitor.left = 0;
-    monitor.right = size.width();
-    monitor.top = 0;
-    monitor.bottom = size.height();
-    monitor.flags = MONITOR_PRIMARY;
-    resetGraphicsPdu.monitorDefArray = &monitor;
-    UINT status = d->gfxContext->ResetGraphics(d->gfxContext.get(), &resetGraphicsPdu);
-    if (status != CHANNEL_RC_OK) {
-        qCWarning(KRDP) << "ResetGraphics failed" << status << "for size" << size;
+    // Every monitor needs to be part of the layout, so a monitor changing size
+    // or appearing sends a new layout. That invalidates the other surfaces too.
+    const auto layout = d->currentLayout();
+    if (layout != d->monitorLayout && !resetGraphics(layout)) {
         return;
     }
 
+    // Nothing changed, keep the surface and its codec contexts.
+    if (output.surface.id != 0 && output.surface.size == size && output.surface.outputSize == outputSize
+        && output.surface.layoutGeneration == d->layoutGeneration) {
+        return;
+    }
+
+    destroySurface(output);
+
     RDPGFX_CREATE_SURFACE_PDU createSurfacePdu;
     createSurfacePdu.width = size.width();
     createSurfacePdu.height = size.height();
     uint16_t surfaceId = d->nextSurfaceId++;
     createSurfacePdu.surfaceId = surfaceId;
     createSurfacePdu.pixelFormat = GFX_PIXEL_FORMAT_XRGB_8888;
-    status = d->gfxContext->CreateSurface(d->gfxContext.get(), &createSurfacePdu);
+    UINT status = d->gfxContext->CreateSurface(d->gfxContext.get(), &createSurfacePdu);
     if (status != CHANNEL_RC_OK) {
         qCWarning(KRDP) << "CreateSurface failed" << status << "surface" << surfaceId << "size" << size;
         return;
     }
 
-    d->surface = Surface{
+    output.surface = Surface{
         .id = surfaceId,
         .codecContextId = d->activeEncodingMode == EncodingMode::Progressive ? ProgressiveCodecContextId : 0,
         .size = size,
+        .outputSize = outputSize,
+        .layoutGeneration = d->layoutGeneration,
     };
 
     if (d->activeEncodingMode == EncodingMode::Progressive) {
-        if (progressive_create_surface_context(d->progressive.get(), surfaceId, size.width(), size.height()) < 0) {
+        if (progressive_create_surface_context(output.progressive.get(), surfaceId, size.width(), size.height()) < 0) {
             qCWarning(KRDP) << "Failed to create progressive surface context";
-            destroySurface();
+            destroySurface(output);
             return;
         }
     }
 
-    RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU mapSurfaceToOutputPdu;
-    mapSurfaceToOutputPdu.outputOriginX = 0;
-    mapSurfaceToOutputPdu.outputOriginY = 0;
-    mapSurfaceToOutputPdu.surfaceId = surfaceId;
-    status = d->gfxContext->MapSurfaceToOutput(d->gfxContext.get(), &mapSurfaceToOutputPdu);
+    const QPoint origin = layout.at(output.index).topLeft();
+    if (outputSize != size) {
+        RDPGFX_MAP_SURFACE_TO_SCALED_OUTPUT_PDU mapSurfaceToScaledOutputPdu = {};
+        mapSurfaceToScaledOutputPdu.surfaceId = surfaceId;
+        mapSurfaceToScaledOutputPdu.outputOriginX = origin.x();
+        mapSurfaceToScaledOutputPdu.outputOriginY = origin.y();
+        mapSurfaceToScaledOutputPdu.targetWidth = outputSize.width();
+        mapSurfaceToScaledOutputPdu.targetHeight = outputSize.height();
+        status = d->gfxContext->MapSurfaceToScaledOutput(d->gfxContext.get(), &mapSurfaceToScaledOutputPdu);
+    } else {
+        RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU mapSurfaceToOutputPdu;
+        mapSurfaceToOutputPdu.outputOriginX = origin.x();
+        mapSurfaceToOutputPdu.outputOriginY = origin.y();
+        mapSurfaceToOutputPdu.surfaceId = surfaceId;
+        status = d->gfxContext->MapSurfaceToOutput(d->gfxContext.get(), &mapSurfaceToOutputPdu);
+    }
     if (status != CHANNEL_RC_OK) {
         qCWarning(KRDP) << "MapSurfaceToOutput failed" << status << "surface" << surfaceId;
-        destroySurface();
+        destroySurface(output);
         return;
     }
 }
 
+bool VideoStream::resetGraphics(const QList<QRect> &layout)
+{
+    // Called with gfxMutex held.
+    QRect desktop;
+    std::vector<MONITOR_DEF> monitors;
+    for (qsizetype i = 0; i < layout.size(); ++i) {
+        const QRect &rect = layout.at(i);
+        if (rect.isEmpty()) {
+            continue;
+        }
+
+        desktop |= rect;
+
+        MONITOR_DEF monitor = {};
+        monitor.left = rect.x();
+        monitor.right = rect.x() + rect.width();
+        monitor.top = rect.y();
+        monitor.bottom = rect.y() + rect.height();
+        // The primary output comes first, unless it has not produced a frame yet.
+        monitor.flags = monitors.empty() ? MONITOR_PRIMARY : 0;
+        monitors.push_back(monitor);
+    }
+
+    RDPGFX_RESET_GRAPHICS_PDU resetGraphicsPdu;
+    resetGraphicsPdu.width = desktop.x() + desktop.width();
+    resetGraphicsPdu.height = desktop.y() + desktop.height();
+    resetGraphicsPdu.monitorCount = monitors.size();
+    resetGraphicsPdu.monitorDefArray = monitors.data();
+    const UINT status = d->gfxContext->ResetGraphics(d->gfxContext.get(), &resetGraphicsPdu);
+    if (status != CHANNEL_RC_OK) {
+        qCWarning(KRDP) << "ResetGraphics failed" << status << "for layout" << layout;
+        return false;
+    }
+
+    d->monitorLayout = layout;
+    d->layoutGeneration++;
+    for (const auto &output : d->outputs) {
+        if (output->surface.id != 0) {
+            output->surfaceLost = true;
+        }
+    }
+    Q_EMIT monitorLayoutChanged(layout);
+    return true;
+}
+
 double VideoStream::effectiveProducerFps()
 {
     // Producer rate = frames entering krdp from the source/encoder callbacks. It is measured
     // upstream of the send window, so sizing the window from it cannot feed back into itself
     // (unlike client-decoded FPS). Invariant: producedFrames is written from frame callbacks;
-    // the smoothing state is touched only here (updateInFlightWindow() is the sole caller, one
-    // rttChanged connection, so no lock is needed). All returns are clamped to a bootstrap/
+    // the smoothing state is touched only here (updateCongestionControl() is the sole caller, on
+    // the main thread, so no lock is needed). All returns are clamped to a bootstrap/
     // stop-and-wait floor (MinimumWindowFrameRate), and to the requested rate when it is above
     // that floor (so a very low requested rate yields the floor, not less).
     const double requested = d->requestedFrameRate.load();
@@ -884,37 +1552,72 @@ double VideoStream::effectiveProducerFps()
     return clampFps(d->smoothedProducerFps);
 }
 
-void VideoStream::updateInFlightWindow()
-{
-    // Size the in-flight window from the bandwidth-delay product: how many produced frames fit
-    // within the round-trip time. averageRTT() is already windowed; we smooth it a second time
-    // (EWMA) so transient RTT spikes do not immediately inflate the submission window, and floor
-    // the smoothed value at the session-minimum RTT so the window never drops below the path's
-    // BDP (which would collapse high-RTT throughput). Producer FPS is measured from frames
-    // entering krdp; averageRTT() is published via atomics; both are safe to read here. The RTT
-    // smoothing state is updated only from here, which the rttChanged connection invokes serially,
-    // so no lock is needed. Falls back to the fixed floor until a valid RTT is known.
-    const double fps = effectiveProducerFps();
-    const double rttMs = clk::duration<double, std::milli>(d->session->networkDetection()->averageRTT()).count();
-    qsizetype window = MaximumInFlightFrames;
-    if (rttMs >= MinimumValidRttMs && rttMs < MaximumValidRttMs) {
-        if (!d->hasBaseRtt || rttMs < d->baseRttMs) {
-            d->baseRttMs = rttMs;
-            d->hasBaseRtt = true;
+void VideoStream::updateCongestionControl()
+{
+    // Gather everything the congestion controller needs. NetworkDetection publishes its values
+    // through atomics and the other inputs are atomics as well, so reading them here is safe.
+    // The controller itself is only used from the main thread.
+    auto networkDetection = d->session->networkDetection();
+
+    CongestionController::Inputs inputs;
+    inputs.now = clk::steady_clock::now();
+    inputs.rtt = clk::duration_cast<clk::milliseconds>(networkDetection->averageRTT());
+    inputs.minimumRtt = clk::duration_cast<clk::milliseconds>(networkDetection->baseRTT());
+    inputs.jitter = clk::duration_cast<clk::milliseconds>(networkDetection->rttJitter());
+    inputs.deliveryRate = networkDetection->deliveryRate();
+    inputs.averageFrameSize = d->averageFrameSize;
+    inputs.producerFrameRate = effectiveProducerFps();
+    inputs.queueDepth = d->clientQueueDepth;
+    inputs.droppedFrames = d->droppedFrames;
+
+    const auto outputs = d->congestionController->update(inputs);
+    d->maxInFlight.store(outputs.inFlightWindow);
+
+    if (outputs == d->congestionOutputs) {
+        return;
+    }
+
+    qCDebug(KRDP) << "Congestion control: window" << outputs.inFlightWindow << "frame rate" << outputs.frameRate << "quality" << outputs.quality
+                  << "scale" << outputs.scale;
+
+    const auto previous = std::exchange(d->congestionOutputs, outputs);
+
+    if (outputs.quality != previous.quality) {
+        d->targetQuality = outputs.quality;
+        for (const auto &output : d->outputs) {
+            if (output->encodedStream) {
+                output->encodedStream->setQuality(outputs.quality);
+            }
+        }
+    }
+
+    if (outputs.frameRate != previous.frameRate) {
+        applyFrameRate();
+    }
+
+    // Downscaling requires the client to scale the surface to its output. With
+    // several monitors the layout would change with the scale, so it is not used.
+    const double scale = d->scaledOutputSupported && d->outputs.size() == 1 ? outputs.scale : 1.0;
+    if (scale != d->scale) {
+        auto &primary = d->primary();
+        if (d->scale >= 1.0) {
+            d->outputSize = primary.size;
         }
-        if (!d->hasSmoothedRtt) {
-            d->smoothedRttMs = rttMs;
-            d->hasSmoothedRtt = true;
-        } else {
-            d->smoothedRttMs = (1.0 - RttEwmaAlpha) * d->smoothedRttMs + RttEwmaAlpha * rttMs;
+        d->scale = scale;
+        d->publishScaledOutput();
+        if (d->outputSize.isValid()) {
+            applyRequestedSize();
+            primary.pendingReset = true;
         }
-        const double effectiveRttMs = std::max(d->baseRttMs, d->smoothedRttMs);
-        const double rttSec = effectiveRttMs / 1000.0;
-        const qsizetype bdp = qsizetype(std::ceil(fps * rttSec * InFlightGain));
-        const qsizetype cap = std::max<qsizetype>(MaximumInFlightFrames, qsizetype(std::ceil(fps * LatencyBudgetSec)));
-        window = std::clamp(bdp, qsizetype(MaximumInFlightFrames), cap);
     }
-    d->maxInFlight.store(window);
+}
+
+void VideoStream::updateAverageFrameSize(uint64_t bytes)
+{
+    // Called from the frame submission threads. With several monitors an update may
+    // occasionally be lost, which only delays the average slightly.
+    const auto average = d->averageFrameSize.load();
+    d->averageFrameSize = average == 0 ? bytes : uint64_t(average * (1.0 - FrameSizeEwmaAlpha) + bytes * FrameSizeEwmaAlpha);
 }
 
 bool VideoStream::hasInFlightCapacity() const
@@ -923,10 +1626,11 @@ bool VideoStream::hasInFlightCapacity() const
     return d->pendingFrames.size() < d->maxInFlight.load();
 }
 
-void VideoStream::sendFrame(const VideoFrame &frame)
+void VideoStream::sendFrame(Output &output, const VideoFrame &frame)
 {
     auto peer = d->session->rdpPeer();
     if (peer->IsWriteBlocked && peer->IsWriteBlocked(peer)) {
+        d->droppedFrames++;
         return;
     }
 
@@ -934,28 +1638,135 @@ void VideoStream::sendFrame(const VideoFrame &frame)
         return;
     }
 
-    if (d->pendingReset) {
-        d->pendingReset = false;
-        performReset(frame.size);
+    if (d->activeEncodingMode == EncodingMode::H264) {
+        // Held until the frame is sent, so another output cannot reset the graphics and
+        // with that delete this output's surface in between.
+        std::lock_guard lock(d->gfxMutex);
+        resetSurfaceIfNeeded(output, frame.size);
+        if (!frame.isKeyFrame && (output.surface.id != output.sentSurfaceId || output.awaitingKeyFrame)) {
+            // A new surface can only start decoding at a keyframe.
+            if (!output.awaitingKeyFrame.exchange(true)) {
+                requestKeyFrame(output);
+            }
+            return;
+        }
+        sendFrameH264(output, frame);
+    } else if (d->activeEncodingMode == EncodingMode::Progressive) {
+        bool surfaceReset = false;
+        {
+            std::lock_guard lock(d->gfxMutex);
+            resetSurfaceIfNeeded(output, frame.size);
+            surfaceReset = output.surface.id != output.sentSurfaceId;
+        }
+
+        if (surfaceReset) {
+            // A new surface starts out empty, so damage alone is not enough.
+            VideoFrame fullFrame = frame;
+            fullFrame.damage = QRegion();
+            sendFrameProgressive(output, fullFrame);
+        } else {
+            sendFrameProgressive(output, frame);
+        }
     }
-    if (d->surface.size != frame.size) {
-        performReset(frame.size);
+}
+
+void VideoStream::resetSurfaceIfNeeded(Output &output, const QSize &size)
+{
+    // Called with gfxMutex held.
+    if (output.pendingReset.exchange(false) || output.surface.size != size || output.surface.layoutGeneration != d->layoutGeneration) {
+        performReset(output, size);
     }
+}
 
+void VideoStream::restoreSurface(Output &output)
+{
+    {
+        std::lock_guard lock(d->gfxMutex);
+        if (output.surface.id == 0 || output.surface.layoutGeneration == d->layoutGeneration) {
+            return;
+        }
+        performReset(output, output.surface.size);
+    }
+
+    // The new surface is empty. Resend the last frame, or get a keyframe from the encoder.
     if (d->activeEncodingMode == EncodingMode::H264) {
-        sendFrameH264(frame);
-    } else if (d->activeEncodingMode == EncodingMode::Progressive) {
-        sendFrameProgressive(frame);
+        if (!output.awaitingKeyFrame.exchange(true)) {
+            requestKeyFrame(output);
+        }
+    } else if (!output.lastSentFrame.image.isNull()) {
+        requeueFullFrame(output, output.lastSentFrame);
+    }
+}
+
+void VideoStream::requeueFullFrame(Output &output, const VideoFrame &frame)
+{
+    const QRegion fullDamage(QRect(QPoint(0, 0), frame.size));
+
+    std::lock_guard lock(output.frameQueueMutex);
+    if (!output.frameQueue.isEmpty()) {
+        // A newer frame is already waiting, send it in full instead.
+        output.frameQueue.last().damage = fullDamage;
+        return;
     }
+
+    VideoFrame fullFrame = frame;
+    fullFrame.damage = fullDamage;
+    output.frameQueue.append(std::move(fullFrame));
+}
+
+void VideoStream::requestKeyFrame(Output &output)
+{
+    QMetaObject::invokeMethod(
+        this,
+        [this, &output]() {
+            if (d->frameSource) {
+                d->frameSource->requestSharedKeyFrame();
+            } else {
+                restartEncoder(output);
+            }
+        },
+        Qt::QueuedConnection);
 }
 
-void VideoStream::sendFrameH264(const VideoFrame &frame)
+void VideoStream::restartEncoder(Output &output)
+{
+    // KPipeWire cannot be asked for a keyframe, but a restarted encoder starts with one.
+    if (!output.encodedStream) {
+        return;
+    }
+    const auto state = output.encodedStream->state();
+    if (state == PipeWireBaseEncodedStream::Idle || state == PipeWireBaseEncodedStream::Paused) {
+        return;
+    }
+    output.encodedStream->stop();
+    output.encodedStream->start();
+
+    if (output.index == 0) {
+        d->lastEncoderRestart = clk::steady_clock::now();
+    }
+}
+
+void VideoStream::requestSharedKeyFrame()
+{
+    // A keyframe is sent to every stream sharing the encoder and is many times larger
+    // than other frames. Coalesce the requests of clients joining or falling behind, so
+    // one slow client cannot flood the others with keyframes.
+    if (d->sharedKeyFrameTimer.isActive()) {
+        return;
+    }
+
+    const auto sinceRestart = clk::steady_clock::now() - d->lastEncoderRestart;
+    const auto delay = std::max<clk::steady_clock::duration>(SharedKeyFrameInterval - sinceRestart, clk::steady_clock::duration::zero());
+    d->sharedKeyFrameTimer.start(clk::ceil<clk::milliseconds>(delay));
+}
+
+void VideoStream::sendFrameH264(Output &output, const VideoFrame &frame)
 {
     if (frame.data.isEmpty()) {
         return;
     }
 
-    if (d->surface.id == 0) {
+    if (output.surface.id == 0) {
         qCWarning(KRDP) << "No graphics surface available for H264 frame submission";
         return;
     }
@@ -966,18 +1777,18 @@ void VideoStream::sendFrameH264(const VideoFrame &frame)
         std::lock_guard lock(d->pendingFramesMutex);
         d->pendingFrames.insert(frameId);
     }
+    updateAverageFrameSize(frame.data.size());
 
     RDPGFX_START_FRAME_PDU startFramePdu;
     RDPGFX_END_FRAME_PDU endFramePdu;
 
-    auto now = QDateTime::currentDateTimeUtc().time();
-    startFramePdu.timestamp = now.hour() << 22 | now.minute() << 16 | now.second() << 10 | now.msec();
+    startFramePdu.timestamp = Timestamps::frameTimestamp(Timestamps::now());
 
     startFramePdu.frameId = frameId;
     endFramePdu.frameId = frameId;
 
     RDPGFX_SURFACE_COMMAND surfaceCommand;
-    surfaceCommand.surfaceId = d->surface.id;
+    surfaceCommand.surfaceId = output.surface.id;
     surfaceCommand.codecId = RDPGFX_CODECID_AVC420;
     surfaceCommand.contextId = 0;
     surfaceCommand.format = PIXEL_FORMAT_BGRX32;
@@ -1007,7 +1818,7 @@ void VideoStream::sendFrameH264(const VideoFrame &frame)
     avcStream.meta.quantQualityVals = qualities.get();
     qualities[0].qp = 22;
     qualities[0].p = 0;
-    qualities[0].qualityVal = 100;
+    qualities[0].qualityVal = d->targetQuality;
 
     const UINT startStatus = d->gfxContext->StartFrame(d->gfxContext.get(), &startFramePdu);
     if (startStatus != CHANNEL_RC_OK) {
@@ -1017,7 +1828,7 @@ void VideoStream::sendFrameH264(const VideoFrame &frame)
 
     const UINT commandStatus = d->gfxContext->SurfaceCommand(d->gfxContext.get(), &surfaceCommand);
     if (commandStatus != CHANNEL_RC_OK) {
-        qCWarning(KRDP) << "SurfaceCommand failed" << commandStatus << "frameId" << frameId << "surface" << d->surface.id << "encodedBytes"
+        qCWarning(KRDP) << "SurfaceCommand failed" << commandStatus << "frameId" << frameId << "surface" << output.surface.id << "encodedBytes"
                         << frame.data.size();
     }
 
@@ -1025,15 +1836,22 @@ void VideoStream::sendFrameH264(const VideoFrame &frame)
     if (endStatus != CHANNEL_RC_OK) {
         qCWarning(KRDP) << "EndFrame failed" << endStatus << "frameId" << frameId;
     }
+
+    // Only a frame that was actually sent will be acknowledged by the client.
+    if (commandStatus == CHANNEL_RC_OK && endStatus == CHANNEL_RC_OK) {
+        d->session->networkDetection()->frameSent(frameId, frame.data.size());
+    }
+
+    output.sentSurfaceId = output.surface.id;
 }
 
-void VideoStream::sendFrameProgressive(const VideoFrame &frame)
+void VideoStream::sendFrameProgressive(Output &output, const VideoFrame &frame)
 {
     if (frame.image.isNull()) {
         return;
     }
 
-    if (d->surface.id == 0) {
+    if (output.surface.id == 0) {
         qCWarning(KRDP) << "No graphics surface available for progressive frame submission";
         return;
     }
@@ -1049,7 +1867,7 @@ void VideoStream::sendFrameProgressive(const VideoFrame &frame)
     BYTE *encodedData = nullptr;
     UINT32 encodedSize = 0;
     const UINT32 rectCount = region16_n_rects(&*invalidRegion);
-    const int compressionStatus = progressive_compress(d->progressive.get(),
+    const int compressionStatus = progressive_compress(output.progressive.get(),
                                                        image.constBits(),
                                                        image.sizeInBytes(),
                                                        PIXEL_FORMAT_BGRX32,
@@ -1066,20 +1884,18 @@ void VideoStream::sendFrameProgressive(const VideoFrame &frame)
         return;
     }
 
-    d->session->networkDetection()->startBandwidthMeasure();
-
     auto frameId = d->frameId++;
 
     {
         std::lock_guard lock(d->pendingFramesMutex);
         d->pendingFrames.insert(frameId);
     }
+    updateAverageFrameSize(encodedSize);
 
     RDPGFX_START_FRAME_PDU startFramePdu;
     RDPGFX_END_FRAME_PDU endFramePdu;
 
-    auto now = QDateTime::currentDateTimeUtc().time();
-    startFramePdu.timestamp = now.hour() << 22 | now.minute() << 16 | now.second() << 10 | now.msec();
+    startFramePdu.timestamp = Timestamps::frameTimestamp(Timestamps::now());
 
     startFramePdu.frameId = frameId;
     endFramePdu.frameId = frameId;
@@ -1087,9 +1903,9 @@ void VideoStream::sendFrameProgressive(const VideoFrame &frame)
     const RECTANGLE_16 *extents = region16_extents(&*invalidRegion);
 
     RDPGFX_SURFACE_COMMAND surfaceCommand;
-    surfaceCommand.surfaceId = d->surface.id;
+    surfaceCommand.surfaceId = output.surface.id;
     surfaceCommand.codecId = RDPGFX_CODECID_CAPROGRESSIVE;
-    surfaceCommand.contextId = d->surface.codecContextId;
+    surfaceCommand.contextId = output.surface.codecContextId;
     surfaceCommand.format = PIXEL_FORMAT_BGRX32;
     surfaceCommand.left = extents->left;
     surfaceCommand.top = extents->top;
@@ -1101,14 +1917,40 @@ void VideoStream::sendFrameProgressive(const VideoFrame &frame)
     surfaceCommand.data = encodedData;
     surfaceCommand.extra = nullptr;
 
-    const UINT status = d->gfxContext->SurfaceFrameCommand(d->gfxContext.get(), &surfaceCommand, &startFramePdu, &endFramePdu);
+    UINT status = CHANNEL_RC_OK;
+    bool surfaceCurrent = true;
+    {
+        std::lock_guard lock(d->gfxMutex);
+        // Another output may have reset the graphics while this frame was compressed,
+        // which deletes this output's surface on the client.
+        surfaceCurrent = output.surface.id == surfaceCommand.surfaceId && output.surface.layoutGeneration == d->layoutGeneration;
+        if (surfaceCurrent) {
+            status = d->gfxContext->SurfaceFrameCommand(d->gfxContext.get(), &surfaceCommand, &startFramePdu, &endFramePdu);
+        }
+    }
+    region16_uninit(&*invalidRegion);
+
+    if (!surfaceCurrent) {
+        {
+            std::lock_guard lock(d->pendingFramesMutex);
+            d->pendingFrames.remove(frameId);
+        }
+        // Send it again in full once the surface is recreated.
+        requeueFullFrame(output, frame);
+        return;
+    }
+
     if (status != CHANNEL_RC_OK) {
-        qCWarning(KRDP) << "SurfaceFrameCommand failed" << status << "frameId" << frameId << "surface" << d->surface.id << "encodedBytes" << encodedSize
-                        << "damageRects" << rectCount;
+        qCWarning(KRDP) << "SurfaceFrameCommand failed" << status << "frameId" << frameId << "surface" << surfaceCommand.surfaceId << "encodedBytes"
+                        << encodedSize << "damageRects" << rectCount;
+        return;
     }
 
-    d->session->networkDetection()->stopBandwidthMeasure();
-    region16_uninit(&*invalidRegion);
+    // Only recorded now, a frame requeued above is never acknowledged by the client.
+    d->session->networkDetection()->frameSent(frameId, encodedSize);
+
+    output.sentSurfaceId = surfaceCommand.surfaceId;
+    output.lastSentFrame = frame;
 }
 }
 
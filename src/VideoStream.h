@@ -6,8 +6,10 @@
 
 #include <memory>
 
+#include <QList>
 #include <QObject>
 #include <QPoint>
+#include <QRect>
 #include <QRegion>
 #include <QSize>
 
@@ -21,6 +23,7 @@
 namespace KRdp
 {
 
+class CongestionController;
 class RdpConnection;
 
 /**
@@ -48,6 +51,17 @@ public:
         Progressive,
     };
 
+    /**
+     * A monitor captured through PipeWire.
+     */
+    struct PipeWireSource {
+        quint32 nodeId = 0;
+        quint64 objectSerial = quint64(-1);
+        // Logical geometry of the monitor on the server's desktop, used to lay
+        // out the monitors on the client's desktop.
+        QRect geometry;
+    };
+
     explicit VideoStream(RdpConnection *session);
     ~VideoStream() override;
 
@@ -83,9 +97,70 @@ public:
     void setEnabled(bool enabled);
     Q_SIGNAL void enabledChanged();
     void setStreamingEnabled(bool enabled);
+    /**
+     * Set the maximum quality of the video stream.
+     *
+     * The congestion controller may lower quality below this when the network
+     * cannot keep up.
+     */
     void setVideoQuality(quint8 quality);
+    /**
+     * Replace the congestion controller.
+     *
+     * The congestion controller decides the in-flight window, frame rate,
+     * quality and scale of the video stream. By default a
+     * DelayBasedCongestionController is used.
+     */
+    void setCongestionController(std::unique_ptr<CongestionController> controller);
+    /**
+     * The frame rate requested from the capture source.
+     */
+    int requestedFrameRate() const;
     void setRequestedSize(const QSize &size);
+    /**
+     * Notify the video stream of user input.
+     *
+     * While the screen is static, capture and encoding run at a low frame
+     * rate. Input is likely to change the screen, so this restores the full
+     * frame rate right away.
+     */
+    void notifyInput();
     void setPipeWireSource(quint32 nodeId, quint64 objectSerial, int fd = -1);
+    /**
+     * Stream several monitors.
+     *
+     * Every monitor gets its own surface on the client. It is captured,
+     * encoded and sent independently of the other monitors, so changes on
+     * one monitor do not delay frames of the others. All sources share the
+     * PipeWire remote \p fd. The first source is the primary monitor.
+     */
+    void setPipeWireSources(const QList<PipeWireSource> &sources, int fd = -1);
+    /**
+     * Emitted when the position of the monitors on the client's desktop changes.
+     *
+     * The list is indexed like the sources passed to setPipeWireSources().
+     */
+    Q_SIGNAL void monitorLayoutChanged(const QList<QRect> &layout);
+
+    /**
+     * Emitted for every frame captured for the primary monitor.
+     *
+     * \see setFrameSource()
+     */
+    Q_SIGNAL void frameCaptured(const KRdp::VideoFrame &frame);
+    /**
+     * Send the frames captured by another stream instead of capturing.
+     *
+     * This lets several clients watch the same screen while it is captured
+     * and encoded only once, by \p source. This stream keeps its own frame
+     * queue and in-flight window, so a slow client drops frames without
+     * holding back the others. With H.264 a client can only skip ahead to a
+     * keyframe, which is requested from \p source when needed.
+     *
+     * Only the primary monitor of \p source is shared. Pass nullptr to stop
+     * following \p source.
+     */
+    void setFrameSource(VideoStream *source);
 
     bool openChannel();
 
@@ -98,18 +173,45 @@ private:
     uint32_t onCapsAdvertise(const RDPGFX_CAPS_ADVERTISE_PDU *capsAdvertise);
     uint32_t onFrameAcknowledge(const RDPGFX_FRAME_ACKNOWLEDGE_PDU *frameAcknowledge);
 
-    void onPacketReceived(const PipeWireEncodedStream::Packet &data);
-    void onFrameReceived(const PipeWireFrame &frame);
+    class Output;
+
+    void onPacketReceived(Output &output, const PipeWireEncodedStream::Packet &data);
+    void onFrameReceived(Output &output, const PipeWireFrame &frame);
     void setActiveEncodingMode(EncodingMode mode);
-    void destroySurface();
-    void performReset(QSize size);
+    void createCaptureStream(Output &output);
+    bool startFrameSubmission(Output &output);
+    void queueFrame(Output &output, const VideoFrame &frame);
+    void destroySurface(Output &output);
+    void performReset(Output &output, QSize size);
+    void resetSurfaceIfNeeded(Output &output, const QSize &size);
+    /**
+     * Recreate a surface the client dropped because another output changed the layout.
+     */
+    void restoreSurface(Output &output);
+    void requeueFullFrame(Output &output, const VideoFrame &frame);
+    bool resetGraphics(const QList<QRect> &layout);
     bool hasInFlightCapacity() const;
-    void sendFrame(const VideoFrame &frame);
-    void sendFrameH264(const VideoFrame &frame);
-    void sendFrameProgressive(const VideoFrame &frame);
-
-    void updateInFlightWindow();
+    void sendFrame(Output &output, const VideoFrame &frame);
+    void sendFrameH264(Output &output, const VideoFrame &frame);
+    void sendFrameProgressive(Output &output, const VideoFrame &frame);
+    void requestKeyFrame(Output &output);
+    void restartEncoder(Output &output);
+    void requestSharedKeyFrame();
+
+    void setCaptureActive(bool active);
+
+    void setOutputSuppressed(bool suppressed);
+    void onStreamSizeChanged(Output &output, const QSize &size);
+    void contentChanged();
+    void setIdle(bool idle);
+    int captureFrameRate() const;
+    void applyFrameRate();
+
+    void updateCongestionControl();
+    void updateAverageFrameSize(uint64_t bytes);
     double effectiveProducerFps();
+    QSize streamRequestedSize() const;
+    void applyRequestedSize();
 
     class Private;
     const std::unique_ptr<Private> d;